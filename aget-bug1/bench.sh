@@ -0,0 +1,147 @@
+#!/bin/sh
+#
+# Segmented download throughput of aget against the local stand-in
+# server of tools/httpstub, over a range of thread counts (-n) and file
+# sizes, and the cost of interrupting a download (SIGINT, save_log) and
+# resuming it from the log.
+#
+# Everything is set from the environment, e.g.
+#
+#   THREADS="1 2 4 8" SIZES="64m 256m" RATE=2m LATENCY=20 ./bench.sh
+#
+# RATE caps every connection (bytes/s) and LATENCY delays every response
+# (ms), to look like a remote mirror instead of the loopback.
+
+AGET=${AGET:-./aget-devel/aget}
+STUB=${STUB:-../tools/httpstub/httpstub}
+PORT=${PORT:-8090}
+THREADS=${THREADS:-"1 2 4 8 16"}
+SIZES=${SIZES:-"16m 64m 256m"}
+RATE=${RATE:-}
+LATENCY=${LATENCY:-0}
+RUNS=${RUNS:-3}
+RESUME_SIZE=${RESUME_SIZE:-64m}
+RESUME_RATE=${RESUME_RATE:-4m}
+RESUME_PORT=$((PORT + 1))
+
+WORK=$(mktemp -d /tmp/aget-bench.XXXXXX)
+OUT=aget-bench.out
+# save_log puts the log of an interrupted download in the home directory
+# of the passwd entry, whatever $HOME says
+LOG=$(getent passwd $(id -u) | cut -d: -f6)/$OUT-ageth.log
+
+cleanup() {
+	kill $STUB_PID $RESUME_STUB_PID 2>/dev/null
+	cd /
+	rm -rf $WORK $LOG
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+now() {
+	date +%s.%N
+}
+
+# 64m -> 67108864
+bytes() {
+	echo $1 | awk '{ n = $1 + 0; u = substr($1, length($1));
+		if (u == "k" || u == "K") n *= 1024;
+		if (u == "m" || u == "M") n *= 1048576;
+		if (u == "g" || u == "G") n *= 1073741824;
+		printf "%d\n", n }'
+}
+
+check() {
+	if ! $STUB -c $OUT >/dev/null; then
+		echo "corrupt download: $($STUB -c $OUT)"
+		exit 1
+	fi
+}
+
+for f in $AGET $STUB; do
+	if [ ! -x $f ]; then
+		echo "$f not found, build it first (see INSTALL)"
+		exit 1
+	fi
+done
+AGET=$(cd $(dirname $AGET) && pwd)/$(basename $AGET)
+STUB=$(cd $(dirname $STUB) && pwd)/$(basename $STUB)
+
+# aget puts its -l file in the current directory
+cd $WORK
+
+$STUB -p $PORT -l $LATENCY ${RATE:+-b $RATE} >/dev/null &
+STUB_PID=$!
+$STUB -p $RESUME_PORT -l $LATENCY -b $RESUME_RATE >/dev/null &
+RESUME_STUB_PID=$!
+sleep 0.5
+
+echo "throughput, $RUNS runs each${RATE:+, $RATE/s per connection}, latency ${LATENCY}ms"
+printf "%8s %8s %10s %10s\n" size threads MB/s seconds
+for size in $SIZES; do
+	for n in $THREADS; do
+		total=0
+		r=0
+		while [ $r -lt $RUNS ]; do
+			rm -f $OUT
+			t0=$(now)
+			$AGET -p $PORT -n$n -l $OUT http://127.0.0.1/file/$size >/dev/null 2>&1
+			t1=$(now)
+			check
+			total=$(awk "BEGIN { print $total + $t1 - $t0 }")
+			r=$((r + 1))
+		done
+		awk "BEGIN { printf \"%8s %8d %10.1f %10.3f\n\", \"$size\", $n,
+			$(bytes $size) * $RUNS / $total / 1048576, $total / $RUNS }"
+	done
+done
+
+# Interrupt every download halfway, then resume it. 'stop' is the time
+# from SIGINT to exit, which includes save_log; 'ideal' is what the
+# remaining bytes take at the capped rate, so 'overhead' is what the
+# resume costs on top of that.
+echo
+echo "resume, $RESUME_SIZE at $RESUME_RATE/s per connection"
+printf "%8s %10s %10s %10s %10s %10s\n" threads stop_ms saved_MB resume_s ideal_s overhead_s
+size=$(bytes $RESUME_SIZE)
+rate=$(bytes $RESUME_RATE)
+for n in $THREADS; do
+	rm -f $OUT $LOG
+	half=$(awk "BEGIN { print $size / ($n * $rate) / 2 }")
+	# without job control a background job ignores SIGINT
+	set -m 2>/dev/null
+	$AGET -p $RESUME_PORT -n$n -l $OUT http://127.0.0.1/file/$RESUME_SIZE >$WORK/log 2>&1 &
+	pid=$!
+	set +m
+	sleep $half
+	t0=$(now)
+	kill -INT $pid
+	# the interrupt itself can deadlock aget, see DESCRIPTION
+	waited=0
+	while kill -0 $pid 2>/dev/null && [ $waited -lt 1000 ]; do
+		sleep 0.01
+		waited=$((waited + 1))
+	done
+	if kill -0 $pid 2>/dev/null; then
+		kill -9 $pid
+		wait $pid 2>/dev/null
+		printf "%8d %10s\n" $n "hang"
+		continue
+	fi
+	wait $pid 2>/dev/null
+	t1=$(now)
+	saved=$(sed -n 's/.*so far \([0-9]*\) bytes.*/\1/p' $WORK/log)
+	if [ -z "$saved" ] || [ ! -f $LOG ]; then
+		printf "%8d %10s\n" $n "no log"
+		continue
+	fi
+
+	t2=$(now)
+	$AGET -p $RESUME_PORT -l $OUT http://127.0.0.1/file/$RESUME_SIZE >/dev/null 2>&1
+	t3=$(now)
+	check
+	awk "BEGIN { ideal = ($size - $saved) / ($n * $rate);
+		printf \"%8d %10.1f %10.1f %10.3f %10.3f %10.3f\n\", $n,
+			($t1 - $t0) * 1000, $saved / 1048576, $t3 - $t2, ideal,
+			$t3 - $t2 - ideal }"
+done
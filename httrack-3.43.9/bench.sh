@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Crawl throughput of the httrack engine (the one htsserver/webhttrack
+# drive) on a synthetic site served by tools/httpstub -S, over a range
+# of simultaneous connections (-c), and how much of the crawl is spent
+# in the engine rather than waiting on the network.
+#
+# Everything is set from the environment, e.g.
+#
+#   HTTRACK=<httrack_install_dir>/bin/httrack CONNS="1 4 16" LATENCY=20 ./bench.sh
+#
+# The site has PAGES pages of FANOUT links each, every page embedding
+# ASSETS assets of ASSET_SIZE bytes; LATENCY delays every response (ms)
+# and JITTER adds up to that much more at random, RATE caps every
+# connection (bytes/s), to look like a remote site instead of the
+# loopback.
+
+HTTRACK=${HTTRACK:-$(command -v httrack)}
+STUB=${STUB:-../tools/httpstub/httpstub}
+PORT=${PORT:-8092}
+CONNS=${CONNS:-"1 2 4 8 16 32"}
+PAGES=${PAGES:-500}
+FANOUT=${FANOUT:-8}
+ASSETS=${ASSETS:-2}
+ASSET_SIZE=${ASSET_SIZE:-16k}
+LATENCY=${LATENCY:-0}
+JITTER=${JITTER:-0}
+RATE=${RATE:-}
+RUNS=${RUNS:-3}
+
+WORK=$(mktemp -d /tmp/httrack-bench.XXXXXX)
+
+cleanup() {
+	kill $STUB_PID 2>/dev/null
+	cd /
+	rm -rf $WORK
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+now() {
+	date +%s.%N
+}
+
+# user + sys seconds of the children of the shell, from the output of
+# 'times' (which must run in the shell that waited for them)
+children_cpu() {
+	awk 'NR == 2 { split($1, u, "m"); split($2, s, "m");
+		print u[1] * 60 + u[2] + s[1] * 60 + s[2] }'
+}
+
+if [ -z "$HTTRACK" ] || [ ! -x "$HTTRACK" ]; then
+	echo "httrack not found, build it first (see INSTALL) and set HTTRACK"
+	exit 1
+fi
+if [ ! -x $STUB ]; then
+	echo "$STUB not found, build it first (see INSTALL)"
+	exit 1
+fi
+STUB=$(cd $(dirname $STUB) && pwd)/$(basename $STUB)
+
+cd $WORK
+
+$STUB -p $PORT -S $PAGES -F $FANOUT -A $ASSETS -z $ASSET_SIZE \
+	-l $LATENCY -j $JITTER ${RATE:+-b $RATE} >/dev/null &
+STUB_PID=$!
+sleep 0.5
+
+# -%! lifts the limits httrack puts on a crawl to spare the server
+# (4 connections, 100KB/s, 5 connections/s), -A0 and -%c0 remove the
+# rate limits, -s0 skips robots.txt and -r is deep enough for the tree
+# of links to reach every page.
+FLAGS="-%! -A0 -%c0 -s0 -r99 -q -%v0"
+FILES=$((PAGES * (ASSETS + 1)))
+
+echo "crawl of $PAGES pages ($FANOUT links, $ASSETS assets of $ASSET_SIZE each), $RUNS runs each, latency ${LATENCY}ms${RATE:+, $RATE/s per connection}"
+echo "engine is the CPU time of httrack (user + sys), wait the rest of the wall time"
+printf "%8s %8s %10s %10s %10s %10s %10s\n" conns files pages/s MB/s wall_s engine_s wait_s
+for n in $CONNS; do
+	wall=0
+	cpu=0
+	r=0
+	while [ $r -lt $RUNS ]; do
+		# a mirror left in place would make the next run an update
+		rm -rf $WORK/mirror
+		t0=$(now)
+		c=$( { $HTTRACK http://127.0.0.1:$PORT/ -O $WORK/mirror -c$n $FLAGS \
+			>/dev/null 2>&1; times; } | children_cpu)
+		t1=$(now)
+		wall=$(awk "BEGIN { print $wall + $t1 - $t0 }")
+		cpu=$(awk "BEGIN { print $cpu + $c }")
+		r=$((r + 1))
+	done
+	# counted on the last run, ! if it missed some of the site
+	site=$WORK/mirror/127.0.0.1_$PORT
+	files=$(find $site -type f | wc -l)
+	pages=$(find $site -type f -name '*.html' | wc -l)
+	bytes=$(find $site -type f -printf '%s\n' | awk '{ n += $1 } END { print n + 0 }')
+	awk "BEGIN { printf \"%8d %8s %10.1f %10.2f %10.3f %10.3f %10.3f\n\", $n,
+		\"$files\" ($files == $FILES ? \"\" : \"!\"),
+		$pages * $RUNS / $wall, $bytes * $RUNS / $wall / 1048576,
+		$wall / $RUNS, $cpu / $RUNS, ($wall - $cpu) / $RUNS }"
+done
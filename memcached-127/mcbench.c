@@ -0,0 +1,939 @@
+/*
+ * Load generator for memcached, grown out of the memcached-127 trigger.
+ *
+ * Every thread drives many non-blocking connections through epoll and
+ * keeps up to g_depth requests in flight on each of them. Requests are
+ * drawn from a get/set/incr/decr/multiget mix over a key space with
+ * uniform or Zipfian popularity, in the text or the binary protocol.
+ * Like the trigger, every successful incr and decr is counted per counter
+ * key, and at the end the counters on the server are compared with those
+ * counts. With decr in the mix the counters start at g_base, so that no
+ * decr hits the floor of memcached at 0.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lathist.h"
+
+const char* g_host = "127.0.0.1";
+unsigned short g_port = 11211;
+bool g_binary = false;
+
+unsigned int g_threads = 2;
+unsigned int g_conns = 4;		/* connections per thread */
+unsigned int g_depth = 1;		/* requests in flight per connection */
+unsigned int g_duration = 10;		/* seconds, unless g_ops is set */
+uint64_t g_ops = 0;			/* total operations, 0 = run g_duration */
+uint64_t g_keys = 100000;		/* size of the key space */
+double g_zipf = 0;			/* Zipf exponent, 0 = uniform */
+unsigned int g_value_size = 100;
+unsigned int g_mget_keys = 10;		/* keys per multiget */
+unsigned int g_counters = 16;		/* keys the incr/decr requests go to */
+unsigned int g_step = 10;
+uint64_t g_base = 0;			/* start value of the counters */
+bool g_base_set = false;
+bool g_preload = false;
+
+enum op_type { OP_GET, OP_SET, OP_INCR, OP_DECR, OP_MGET, OP_NTYPES };
+static const char* op_names[OP_NTYPES] = { "get", "set", "incr", "decr", "mget" };
+static unsigned int g_mix[OP_NTYPES] = { 90, 10, 0, 0, 0 };	/* weights */
+static unsigned int g_mix_total = 100;
+
+static volatile bool g_stop = false;
+static uint64_t g_issued = 0;		/* operations started, when g_ops is set */
+static char* g_value;
+
+/* binary protocol, see protocol_binary.h of memcached */
+enum {
+	BIN_REQ = 0x80,
+	BIN_RES = 0x81,
+	BIN_GET = 0x00,
+	BIN_SET = 0x01,
+	BIN_INCR = 0x05,
+	BIN_DECR = 0x06,
+	BIN_GETK = 0x0c,
+	BIN_HDR = 24
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, one per thread */
+static inline uint64_t next_rand(uint64_t* s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545f4914f6cdd1dULL;
+}
+
+static inline double next_double(uint64_t* s)
+{
+	return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Zipfian ranks as in YCSB (Gray et al., "Quickly generating
+ * billion-record synthetic databases"), rank 0 being the most popular.
+ */
+static double g_zeta_n, g_zipf_alpha, g_zipf_eta, g_zipf_half;
+
+static void zipf_init(void)
+{
+	double zeta2 = 1 + pow(0.5, g_zipf);
+	uint64_t i;
+
+	g_zeta_n = 0;
+	for(i=1; i <= g_keys; ++i)
+		g_zeta_n += 1.0 / pow((double)i, g_zipf);
+	g_zipf_alpha = 1.0 / (1.0 - g_zipf);
+	g_zipf_eta = (1 - pow(2.0 / g_keys, 1 - g_zipf)) / (1 - zeta2 / g_zeta_n);
+	g_zipf_half = 1 + pow(0.5, g_zipf);
+}
+
+static inline uint64_t next_key(uint64_t* s)
+{
+	uint64_t rank, h;
+	double u, uz;
+
+	if(g_zipf <= 0)
+		return next_rand(s) % g_keys;
+
+	u = next_double(s);
+	uz = u * g_zeta_n;
+	if(uz < 1)
+		rank = 0;
+	else if(uz < g_zipf_half)
+		rank = 1;
+	else
+		rank = (uint64_t)(g_keys * pow(g_zipf_eta * u - g_zipf_eta + 1, g_zipf_alpha));
+	if(rank >= g_keys)
+		rank = g_keys - 1;
+
+	/* scatter the popular keys over the key space (FNV-1a) */
+	h = 0xcbf29ce484222325ULL;
+	for(; rank; rank >>= 8)
+		h = (h ^ (rank & 0xff)) * 0x100000001b3ULL;
+	return h % g_keys;
+}
+
+static inline int key_name(char* buf, uint64_t key)
+{
+	return sprintf(buf, "mcb:%llu", (unsigned long long)key);
+}
+
+static inline int counter_name(char* buf, unsigned int counter)
+{
+	return sprintf(buf, "mcb:ctr:%u", counter);
+}
+
+/* a request in flight */
+struct pending {
+	uint64_t sent;			/* ns */
+	unsigned int counter;		/* incr, decr */
+	unsigned short remaining;	/* responses still expected */
+	unsigned short hits;		/* text get, values seen so far */
+	unsigned char type;
+	unsigned char failed;
+};
+
+struct thread_ctx;
+
+struct conn {
+	int fd;				/* -1 once lost */
+	struct thread_ctx* th;
+	char* wbuf;
+	size_t wlen, woff, wcap;
+	char* rbuf;
+	size_t rlen, rcap;
+	struct pending* q;		/* ring of g_depth entries */
+	unsigned int qhead, qcount;
+	bool polling_out;
+};
+
+struct thread_ctx {
+	pthread_t tid;
+	uint64_t seed;
+	int epfd;
+	struct conn* conns;
+	struct lathist hist[OP_NTYPES];
+	uint64_t errors[OP_NTYPES];
+	uint64_t hits, misses;
+	uint64_t lost;			/* connections the server closed or reset */
+	int64_t* incremented;		/* per counter, successful incrs - decrs */
+};
+
+static void die(const char* what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int connect_server(void)
+{
+	struct addrinfo hints, *ai, *a;
+	char port[8];
+	int fd = -1, one = 1, rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%u", g_port);
+	rc = getaddrinfo(g_host, port, &hints, &ai);
+	if(rc) {
+		fprintf(stderr, "cannot resolve %s: %s\n", g_host, gai_strerror(rc));
+		exit(1);
+	}
+	for(a=ai; a; a=a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(fd < 0)
+			continue;
+		if(connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if(fd < 0)
+		die("connect failed");
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static inline void wreserve(struct conn* c, size_t n)
+{
+	if(c->wlen + n > c->wcap) {
+		while(c->wlen + n > c->wcap)
+			c->wcap *= 2;
+		c->wbuf = realloc(c->wbuf, c->wcap);
+		if(!c->wbuf)
+			die("realloc");
+	}
+}
+
+static inline void wput(struct conn* c, const void* p, size_t n)
+{
+	wreserve(c, n);
+	memcpy(c->wbuf + c->wlen, p, n);
+	c->wlen += n;
+}
+
+static void bin_header(struct conn* c, unsigned char opcode, unsigned int keylen,
+		unsigned int extlen, unsigned int bodylen)
+{
+	unsigned char h[BIN_HDR];
+
+	memset(h, 0, sizeof(h));
+	h[0] = BIN_REQ;
+	h[1] = opcode;
+	h[2] = keylen >> 8;
+	h[3] = keylen;
+	h[4] = extlen;
+	h[8] = bodylen >> 24;
+	h[9] = bodylen >> 16;
+	h[10] = bodylen >> 8;
+	h[11] = bodylen;
+	wput(c, h, sizeof(h));
+}
+
+static void put_be64(unsigned char* p, uint64_t v)
+{
+	int i;
+
+	for(i=7; i >= 0; --i) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/* append the next request of the mix to the write buffer of c */
+static void issue(struct conn* c)
+{
+	struct thread_ctx* th = c->th;
+	struct pending* p;
+	unsigned int r, type, i;
+	char key[32], line[64];
+	int klen, n;
+
+	r = next_rand(&th->seed) % g_mix_total;
+	for(type=0; r >= g_mix[type]; ++type)
+		r -= g_mix[type];
+
+	p = &c->q[(c->qhead + c->qcount) % g_depth];
+	c->qcount++;
+	p->type = type;
+	p->remaining = 1;
+	p->hits = 0;
+	p->failed = 0;
+	p->sent = now_ns();
+
+	switch(type) {
+	case OP_GET:
+		klen = key_name(key, next_key(&th->seed));
+		if(g_binary) {
+			bin_header(c, BIN_GET, klen, 0, klen);
+			wput(c, key, klen);
+		} else {
+			wput(c, "get ", 4);
+			wput(c, key, klen);
+			wput(c, "\r\n", 2);
+		}
+		break;
+	case OP_MGET:
+		if(g_binary) {
+			/* one GETK per key, the last response completes it */
+			for(i=0; i < g_mget_keys; ++i) {
+				klen = key_name(key, next_key(&th->seed));
+				bin_header(c, BIN_GETK, klen, 0, klen);
+				wput(c, key, klen);
+			}
+			p->remaining = g_mget_keys;
+		} else {
+			wput(c, "get", 3);
+			for(i=0; i < g_mget_keys; ++i) {
+				key[0] = ' ';
+				klen = key_name(key + 1, next_key(&th->seed)) + 1;
+				wput(c, key, klen);
+			}
+			wput(c, "\r\n", 2);
+		}
+		break;
+	case OP_SET:
+		klen = key_name(key, next_key(&th->seed));
+		if(g_binary) {
+			unsigned char extras[8];
+			memset(extras, 0, sizeof(extras));
+			bin_header(c, BIN_SET, klen, 8, 8 + klen + g_value_size);
+			wput(c, extras, 8);
+			wput(c, key, klen);
+			wput(c, g_value, g_value_size);
+		} else {
+			n = sprintf(line, "set %.*s 0 0 %u\r\n", klen, key, g_value_size);
+			wput(c, line, n);
+			wput(c, g_value, g_value_size);
+			wput(c, "\r\n", 2);
+		}
+		break;
+	case OP_INCR:
+	case OP_DECR:
+		p->counter = next_rand(&th->seed) % g_counters;
+		klen = counter_name(key, p->counter);
+		if(g_binary) {
+			unsigned char extras[20];
+			memset(extras, 0, sizeof(extras));
+			put_be64(extras, g_step);
+			/* expiration 0xffffffff: fail rather than create a missing counter */
+			memset(extras + 16, 0xff, 4);
+			bin_header(c, type == OP_INCR ? BIN_INCR : BIN_DECR, klen, 20, 20 + klen);
+			wput(c, extras, 20);
+			wput(c, key, klen);
+		} else {
+			n = sprintf(line, "%s %.*s %u\r\n", op_names[type], klen, key, g_step);
+			wput(c, line, n);
+		}
+		break;
+	}
+}
+
+static bool may_issue(void)
+{
+	if(g_stop)
+		return false;
+	if(g_ops) {
+		if(__sync_fetch_and_add(&g_issued, 1) >= g_ops) {
+			g_stop = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+static void complete(struct conn* c)
+{
+	struct thread_ctx* th = c->th;
+	struct pending* p = &c->q[c->qhead];
+
+	if(p->failed)
+		th->errors[p->type]++;
+	else {
+		lathist_add(&th->hist[p->type], now_ns() - p->sent);
+		if(p->type == OP_INCR)
+			th->incremented[p->counter]++;
+		else if(p->type == OP_DECR)
+			th->incremented[p->counter]--;
+	}
+	c->qhead = (c->qhead + 1) % g_depth;
+	c->qcount--;
+}
+
+/*
+ * Consume the complete responses at the start of the read buffer.
+ * Returns false if the server sent something we do not understand.
+ */
+static bool parse_text(struct conn* c)
+{
+	size_t off = 0;
+
+	while(c->qcount) {
+		struct pending* p = &c->q[c->qhead];
+		char* line = c->rbuf + off;
+		char* eol = memchr(line, '\n', c->rlen - off);
+		size_t len;
+
+		if(!eol)
+			break;
+		len = eol - line + 1;
+
+		if(p->type == OP_GET || p->type == OP_MGET) {
+			unsigned long bytes;
+			if(strncmp(line, "VALUE ", 6) == 0) {
+				if(sscanf(line, "VALUE %*s %*u %lu", &bytes) != 1)
+					return false;
+				if(off + len + bytes + 2 > c->rlen)
+					break;
+				off += len + bytes + 2;
+				p->hits++;
+				continue;
+			}
+			off += len;
+			if(strncmp(line, "END", 3) != 0)
+				p->failed = 1;
+			else {
+				c->th->hits += p->hits;
+				c->th->misses += (p->type == OP_MGET ? g_mget_keys : 1) - p->hits;
+			}
+			complete(c);
+		} else if(p->type == OP_SET) {
+			off += len;
+			if(strncmp(line, "STORED", 6) != 0)
+				p->failed = 1;
+			complete(c);
+		} else {
+			off += len;
+			if(line[0] < '0' || line[0] > '9')
+				p->failed = 1;
+			complete(c);
+		}
+	}
+	if(off) {
+		memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+		c->rlen -= off;
+	}
+	return true;
+}
+
+static bool parse_binary(struct conn* c)
+{
+	size_t off = 0;
+
+	while(c->qcount && c->rlen - off >= BIN_HDR) {
+		unsigned char* h = (unsigned char*)c->rbuf + off;
+		struct pending* p = &c->q[c->qhead];
+		uint32_t bodylen;
+		uint16_t status;
+
+		if(h[0] != BIN_RES)
+			return false;
+		bodylen = ((uint32_t)h[8] << 24) | (h[9] << 16) | (h[10] << 8) | h[11];
+		if(c->rlen - off < BIN_HDR + bodylen)
+			break;
+		status = (h[6] << 8) | h[7];
+		off += BIN_HDR + bodylen;
+
+		if(p->type == OP_GET || p->type == OP_MGET) {
+			if(status == 0)
+				c->th->hits++;
+			else if(status == 1)
+				c->th->misses++;
+			else
+				p->failed = 1;
+		} else if(status != 0)
+			p->failed = 1;
+		if(--p->remaining == 0)
+			complete(c);
+	}
+	if(off) {
+		memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+		c->rlen -= off;
+	}
+	return true;
+}
+
+/* the server closed or reset c: fail the requests in flight and drop it */
+static void lose_conn(struct conn* c, const char* why)
+{
+	fprintf(stderr, "lost a connection to the server: %s\n", why);
+	c->th->lost++;
+	while(c->qcount) {
+		c->q[c->qhead].failed = 1;
+		complete(c);
+	}
+	close(c->fd);
+	c->fd = -1;
+	c->wlen = c->woff = 0;
+}
+
+static void update_events(struct conn* c)
+{
+	bool want_out = c->wlen > c->woff;
+	struct epoll_event ev;
+
+	if(want_out == c->polling_out)
+		return;
+	ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if(epoll_ctl(c->th->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+		die("epoll_ctl");
+	c->polling_out = want_out;
+}
+
+static void flush_conn(struct conn* c)
+{
+	while(c->woff < c->wlen) {
+		ssize_t n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				break;
+			if(errno == EPIPE || errno == ECONNRESET) {
+				lose_conn(c, strerror(errno));
+				return;
+			}
+			die("write");
+		}
+		c->woff += n;
+	}
+	if(c->woff == c->wlen)
+		c->woff = c->wlen = 0;
+	update_events(c);
+}
+
+static void fill_conn(struct conn* c)
+{
+	if(c->fd < 0)
+		return;
+	while(c->qcount < g_depth && may_issue())
+		issue(c);
+	flush_conn(c);
+}
+
+static void read_conn(struct conn* c)
+{
+	for(;;) {
+		ssize_t n;
+		if(c->rcap - c->rlen < 4096) {
+			c->rcap *= 2;
+			c->rbuf = realloc(c->rbuf, c->rcap);
+			if(!c->rbuf)
+				die("realloc");
+		}
+		n = read(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				break;
+			if(errno == ECONNRESET) {
+				lose_conn(c, strerror(errno));
+				return;
+			}
+			die("read");
+		}
+		if(n == 0) {
+			lose_conn(c, "closed by the server");
+			return;
+		}
+		c->rlen += n;
+		if(!(g_binary ? parse_binary(c) : parse_text(c))) {
+			fprintf(stderr, "unexpected response from the server\n");
+			exit(1);
+		}
+	}
+}
+
+static void* worker(void* arg)
+{
+	struct thread_ctx* th = arg;
+	struct epoll_event events[64];
+	unsigned int i, outstanding, live;
+	int n;
+
+	th->epfd = epoll_create(g_conns);
+	if(th->epfd < 0)
+		die("epoll_create");
+	th->conns = calloc(g_conns, sizeof(struct conn));
+	for(i=0; i < g_conns; ++i) {
+		struct conn* c = &th->conns[i];
+		struct epoll_event ev;
+
+		c->fd = connect_server();
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+		c->th = th;
+		c->wcap = 4096;
+		c->wbuf = malloc(c->wcap);
+		c->rcap = 16384;
+		c->rbuf = malloc(c->rcap);
+		c->q = calloc(g_depth, sizeof(struct pending));
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if(epoll_ctl(th->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+			die("epoll_ctl");
+		fill_conn(c);
+	}
+
+	for(;;) {
+		outstanding = live = 0;
+		for(i=0; i < g_conns; ++i) {
+			outstanding += th->conns[i].qcount;
+			live += th->conns[i].fd >= 0;
+		}
+		if((g_stop && !outstanding) || !live)
+			break;
+
+		n = epoll_wait(th->epfd, events, 64, 100);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			die("epoll_wait");
+		}
+		for(i=0; i < (unsigned int)n; ++i) {
+			struct conn* c = events[i].data.ptr;
+			if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				read_conn(c);
+			fill_conn(c);
+		}
+	}
+
+	for(i=0; i < g_conns; ++i) {
+		if(th->conns[i].fd >= 0)
+			close(th->conns[i].fd);
+		free(th->conns[i].wbuf);
+		free(th->conns[i].rbuf);
+		free(th->conns[i].q);
+	}
+	free(th->conns);
+	close(th->epfd);
+	return NULL;
+}
+
+/*
+ * Send a text command on a blocking connection and read one response
+ * line. Returns NULL, with buf saying so, if the server has gone away.
+ */
+static char* command(int fd, const char* cmd, size_t len, char* buf, size_t buflen)
+{
+	size_t got = 0;
+
+	while(len) {
+		ssize_t n = write(fd, cmd, len);
+		if(n < 0) {
+			snprintf(buf, buflen, "connection lost\n");
+			return NULL;
+		}
+		cmd += n;
+		len -= n;
+	}
+	while(got < buflen - 1) {
+		ssize_t n = read(fd, buf + got, buflen - 1 - got);
+		if(n <= 0) {
+			snprintf(buf, buflen, "connection lost\n");
+			return NULL;
+		}
+		got += n;
+		buf[got] = '\0';
+		if(strstr(buf, "\r\n") && (strncmp(buf, "VALUE", 5) != 0 || strstr(buf, "END\r\n")))
+			break;
+	}
+	return buf;
+}
+
+/* set every key of the key space, pipelined with noreply */
+static void preload(int fd)
+{
+	char line[128], buf[256];
+	char* batch;
+	size_t blen = 0, bcap = 1 << 20;
+	uint64_t k;
+	int n;
+
+	batch = malloc(bcap + g_value_size + sizeof(line));
+	for(k=0; k < g_keys; ++k) {
+		n = key_name(line + 4, k);
+		memcpy(line, "set ", 4);
+		n = 4 + n;
+		n += sprintf(line + n, " 0 0 %u noreply\r\n", g_value_size);
+		memcpy(batch + blen, line, n);
+		blen += n;
+		memcpy(batch + blen, g_value, g_value_size);
+		blen += g_value_size;
+		memcpy(batch + blen, "\r\n", 2);
+		blen += 2;
+		if(blen >= bcap || k == g_keys - 1) {
+			size_t off = 0;
+			while(off < blen) {
+				ssize_t w = write(fd, batch + off, blen - off);
+				if(w < 0)
+					die("write");
+				off += w;
+			}
+			blen = 0;
+		}
+	}
+	free(batch);
+	/* the reply to version comes after all the sets are done */
+	command(fd, "version\r\n", 9, buf, sizeof(buf));
+	if(strncmp(buf, "VERSION", 7) != 0) {
+		fprintf(stderr, "preload failed: %s", buf);
+		exit(1);
+	}
+}
+
+static bool parse_mix(char* spec)
+{
+	char* tok;
+	unsigned int i;
+
+	memset(g_mix, 0, sizeof(g_mix));
+	for(tok=strtok(spec, ","); tok; tok=strtok(NULL, ",")) {
+		char* eq = strchr(tok, '=');
+		if(!eq)
+			return false;
+		*eq = '\0';
+		for(i=0; i < OP_NTYPES; ++i)
+			if(strcmp(tok, op_names[i]) == 0)
+				break;
+		if(i == OP_NTYPES)
+			return false;
+		g_mix[i] = atoi(eq + 1);
+	}
+	g_mix_total = 0;
+	for(i=0; i < OP_NTYPES; ++i)
+		g_mix_total += g_mix[i];
+	return g_mix_total > 0;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -h host       server (%s)\n"
+		"  -p port       port (%u)\n"
+		"  -B            binary protocol\n"
+		"  -t threads    threads (%u)\n"
+		"  -c conns      connections per thread (%u)\n"
+		"  -d depth      requests in flight per connection (%u)\n"
+		"  -n seconds    run time (%u)\n"
+		"  -o ops        run this many operations instead\n"
+		"  -m mix        weights, e.g. get=80,set=10,incr=5,decr=5,mget=0 (get=90,set=10)\n"
+		"  -k keys       key space (%llu)\n"
+		"  -z theta      Zipf exponent of the key popularity, 0 = uniform (%g)\n"
+		"  -v bytes      value size (%u)\n"
+		"  -g keys       keys per multiget (%u)\n"
+		"  -C counters   keys the incrs and decrs go to (%u)\n"
+		"  -s step       incr and decr step (%u)\n"
+		"  -b base       start value of the counters (0, with decr ops x step\n"
+		"                or 10^12 for a timed run)\n"
+		"  -P            set every key before the run\n",
+		prog, g_host, g_port, g_threads, g_conns, g_depth, g_duration,
+		(unsigned long long)g_keys, g_zipf, g_value_size, g_mget_keys,
+		g_counters, g_step);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	struct thread_ctx* threads;
+	struct lathist total[OP_NTYPES];
+	uint64_t errors[OP_NTYPES], hits = 0, misses = 0, ops = 0, lost = 0;
+	int64_t* incremented;
+	uint64_t start, elapsed;
+	unsigned int i, j;
+	int opt, setup, bad = 0;
+
+	while((opt = getopt(argc, argv, "h:p:Bt:c:d:n:o:m:k:z:v:g:C:s:b:P")) != -1) {
+		switch(opt) {
+		case 'h': g_host = optarg; break;
+		case 'p': g_port = atoi(optarg); break;
+		case 'B': g_binary = true; break;
+		case 't': g_threads = atoi(optarg); break;
+		case 'c': g_conns = atoi(optarg); break;
+		case 'd': g_depth = atoi(optarg); break;
+		case 'n': g_duration = atoi(optarg); break;
+		case 'o': g_ops = strtoull(optarg, NULL, 10); break;
+		case 'm': if(!parse_mix(optarg)) usage(argv[0]); break;
+		case 'k': g_keys = strtoull(optarg, NULL, 10); break;
+		case 'z': g_zipf = atof(optarg); break;
+		case 'v': g_value_size = atoi(optarg); break;
+		case 'g': g_mget_keys = atoi(optarg); break;
+		case 'C': g_counters = atoi(optarg); break;
+		case 's': g_step = atoi(optarg); break;
+		case 'b': g_base = strtoull(optarg, NULL, 10); g_base_set = true; break;
+		case 'P': g_preload = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(!g_threads || !g_conns || !g_depth || !g_keys || !g_counters ||
+			!g_mget_keys || g_mget_keys > 65535 || g_zipf == 1.0 ||
+			(!g_ops && !g_duration))
+		usage(argv[0]);
+	/*
+	 * A decr that stops at 0 would be counted in full. Without decr the
+	 * counters start at 0 like in the trigger: the race needs an incr
+	 * that makes a counter longer than it ever was, and from a high
+	 * base that hardly happens.
+	 */
+	if(g_mix[OP_DECR] && !g_base_set)
+		g_base = g_ops ? g_ops * g_step : 1000000000000ULL;
+	if(g_mix[OP_DECR] && g_ops && g_base < g_ops * g_step) {
+		fprintf(stderr, "-b %llu is too low for %llu decrs of %u\n",
+			(unsigned long long)g_base, (unsigned long long)g_ops, g_step);
+		exit(1);
+	}
+
+	/* a server that goes away is reported, not a silent death */
+	signal(SIGPIPE, SIG_IGN);
+
+	g_value = malloc(g_value_size);
+	memset(g_value, 'x', g_value_size);
+	if(g_zipf > 0)
+		zipf_init();
+
+	/* reset the counters, like the trigger does, but to g_base */
+	setup = connect_server();
+	{
+		char buf[256], cmd[96], val[24];
+		int n, vlen = sprintf(val, "%llu", (unsigned long long)g_base);
+		for(i=0; i < g_counters; ++i) {
+			n = counter_name(cmd + 4, i);
+			memcpy(cmd, "set ", 4);
+			n = 4 + n;
+			n += sprintf(cmd + n, " 0 0 %d\r\n%s\r\n", vlen, val);
+			command(setup, cmd, n, buf, sizeof(buf));
+			if(strncmp(buf, "STORED", 6) != 0) {
+				fprintf(stderr, "set failed: %s", buf);
+				exit(1);
+			}
+		}
+	}
+	if(g_preload)
+		preload(setup);
+
+	threads = calloc(g_threads, sizeof(struct thread_ctx));
+	start = now_ns();
+	for(i=0; i < g_threads; ++i) {
+		int err;
+		threads[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1) ^ start;
+		threads[i].incremented = calloc(g_counters, sizeof(int64_t));
+		err = pthread_create(&threads[i].tid, NULL, worker, &threads[i]);
+		if(err != 0) {
+			fprintf(stderr, "failed to create thread: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	if(!g_ops) {
+		struct timespec ts = { g_duration, 0 };
+		while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+		g_stop = true;
+	}
+
+	memset(total, 0, sizeof(total));
+	memset(errors, 0, sizeof(errors));
+	incremented = calloc(g_counters, sizeof(int64_t));
+	for(i=0; i < g_threads; ++i) {
+		void* ret;
+		int err = pthread_join(threads[i].tid, &ret);
+		if(err != 0)
+			fprintf(stderr, "failed to join thread: %s\n", strerror(err));
+		for(j=0; j < OP_NTYPES; ++j) {
+			lathist_merge(&total[j], &threads[i].hist[j]);
+			errors[j] += threads[i].errors[j];
+		}
+		hits += threads[i].hits;
+		misses += threads[i].misses;
+		lost += threads[i].lost;
+		for(j=0; j < g_counters; ++j)
+			incremented[j] += threads[i].incremented[j];
+	}
+	elapsed = now_ns() - start;
+
+	for(j=0; j < OP_NTYPES; ++j)
+		ops += total[j].count;
+	printf("%s protocol, %u threads x %u connections x depth %u, %llu keys%s\n",
+		g_binary ? "binary" : "text", g_threads, g_conns, g_depth,
+		(unsigned long long)g_keys, g_zipf > 0 ? " (zipf)" : "");
+	printf("%llu ops in %.3f s: %.0f ops/s\n", (unsigned long long)ops,
+		elapsed / 1e9, ops / (elapsed / 1e9));
+	printf("%6s %10s %12s %9s %9s %9s %9s %9s %9s\n", "op", "count", "ops/s",
+		"mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+	for(j=0; j < OP_NTYPES; ++j) {
+		const struct lathist* h = &total[j];
+		if(!h->count && !errors[j])
+			continue;
+		printf("%6s %10llu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f",
+			op_names[j], (unsigned long long)h->count,
+			h->count / (elapsed / 1e9),
+			lathist_mean(h) / 1e3,
+			lathist_percentile(h, 50) / 1e3, lathist_percentile(h, 90) / 1e3,
+			lathist_percentile(h, 99) / 1e3, lathist_percentile(h, 99.9) / 1e3,
+			h->max / 1e3);
+		if(errors[j])
+			printf("  errors: %llu", (unsigned long long)errors[j]);
+		printf("\n");
+	}
+	if(hits + misses)
+		printf("get hits: %llu misses: %llu\n", (unsigned long long)hits,
+			(unsigned long long)misses);
+	if(lost)
+		printf("lost connections: %llu of %u\n", (unsigned long long)lost,
+			g_threads * g_conns);
+
+	/* the check of the trigger, for every counter */
+	if(total[OP_INCR].count || total[OP_DECR].count) {
+		char buf[256], cmd[64];
+		for(i=0; i < g_counters; ++i) {
+			unsigned long long expected = g_base + incremented[i] * (int64_t)g_step, actual;
+			int n = counter_name(cmd + 4, i);
+			memcpy(cmd, "get ", 4);
+			n = 4 + n;
+			memcpy(cmd + n, "\r\n", 2);
+			command(setup, cmd, n + 2, buf, sizeof(buf));
+			if(sscanf(buf, "VALUE %*s %*u %*u\r\n%llu", &actual) != 1) {
+				fprintf(stderr, "get of counter %u failed: %s", i, buf);
+				bad++;
+				continue;
+			}
+			if(actual != expected) {
+				printf("counter %u: expected: %llu result: %llu\n", i, expected, actual);
+				bad++;
+			}
+		}
+		printf("incr/decr verification: %s (%u counters)\n",
+			bad ? "FAILED" : "ok", g_counters);
+	}
+	close(setup);
+
+	fflush(stdout);
+	if(bad)
+		assert(0);
+	return lost ? 1 : 0;
+}
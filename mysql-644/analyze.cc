@@ -0,0 +1,516 @@
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+
+#include "histogram.h"
+
+// g++ -g3 -O2 -Wshadow -Wall -o analyze analyze.cc -lpthread
+using namespace std;
+
+/**
+   Post-run analyzer for the 'queries' file written by runtran.
+
+   Each line is "clientid type host start latency \"query\"" with start
+   (since the workers were released) and latency in seconds. The file is
+   mapped into memory and split at line boundaries into one chunk per
+   cpu, which are parsed in parallel into histograms and per-second
+   counts and merged at the end.
+*/
+
+#define ABORT() do { cout << " at line " << __LINE__ << endl; abort(); } while(0)
+#define EABORT() do { if (errno) {cout << strerror(errno) << " dying ... ";} ABORT(); } while(0)
+#define MSGABORT(MGS) do { cout << MGS << " at line " << __LINE__ << endl; abort(); } while(0)
+
+/** number of statement types, as enum stm_type_t in runtran.cc */
+static const int NTYPES = 6;
+
+/** printable names of the statement types, as in runtran.cc */
+static const char* stm_names[NTYPES] = { "BEGIN", "COMMIT", "ROLLBACK", "SELECT", "TEMPTPL", "WRITE" };
+
+static int nthreads = 0; ///< parser threads (0 = one per cpu)
+static bool json = 0; ///< write json instead of csv
+
+/** What one or more query files add up to */
+struct analysis {
+     histogram hist[NTYPES]; ///< Latency in usec per statement type
+     double sumsq[NTYPES]; ///< Sum of the squared latencies, for the variance
+     vector<unsigned long> timeline[NTYPES]; ///< Statements completed in each second
+     unsigned long bad; ///< Lines that could not be parsed
+
+     /// Constructor
+     analysis() : bad(0) {
+          for (int t = 0; t < NTYPES; t++)
+               sumsq[t] = 0;
+     }
+
+     /** account a statement of type \a t started at \a start that took \a lat, both in usec */
+     void add(int t, uint64_t start, uint64_t lat) {
+          hist[t].add(lat);
+          sumsq[t] += (double)lat * lat;
+          unsigned long sec = (start + lat) / 1000000;
+          if (sec >= timeline[t].size())
+               timeline[t].resize(sec + 1);
+          timeline[t][sec]++;
+     }
+
+     /** add everything in \a o */
+     void merge(const analysis& o) {
+          bad += o.bad;
+          for (int t = 0; t < NTYPES; t++) {
+               hist[t].merge(o.hist[t]);
+               sumsq[t] += o.sumsq[t];
+               if (o.timeline[t].size() > timeline[t].size())
+                    timeline[t].resize(o.timeline[t].size());
+               for (unsigned int s = 0; s < o.timeline[t].size(); s++)
+                    timeline[t][s] += o.timeline[t][s];
+          }
+     }
+
+     /** @return the variance of the latencies of type \a t */
+     double variance(int t) const {
+          const histogram& h = hist[t];
+          if (h.count < 2)
+               return 0;
+          double m = h.mean();
+          return (sumsq[t] - h.count * m * m) / (h.count - 1);
+     }
+
+     /** @return the length of the timeline in seconds */
+     unsigned int seconds() const {
+          unsigned int len = 0;
+          for (int t = 0; t < NTYPES; t++)
+               if (timeline[t].size() > len)
+                    len = timeline[t].size();
+          return len;
+     }
+
+     /** @return the statements of all types completed in second \a s */
+     unsigned long total(unsigned int s) const {
+          unsigned long n = 0;
+          for (int t = 0; t < NTYPES; t++)
+               if (s < timeline[t].size())
+                    n += timeline[t][s];
+          return n;
+     }
+};
+
+/**
+   Parse "sec.usec" at \a p into usec
+
+   @return position after the number, NULL if there is none
+*/
+static inline const char* parse_time(const char* p, const char* end, uint64_t* usec) {
+     uint64_t sec = 0, frac = 0;
+     const char* q = p;
+     while (q < end && *q >= '0' && *q <= '9')
+          sec = sec * 10 + (*q++ - '0');
+     if (q == p || q >= end || *q != '.')
+          return NULL;
+     q++;
+     int digits = 0;
+     while (q < end && *q >= '0' && *q <= '9') {
+          if (digits++ < 6)
+               frac = frac * 10 + (*q - '0');
+          q++;
+     }
+     for (; digits < 6; digits++)
+          frac *= 10;
+     *usec = sec * 1000000 + frac;
+     return q;
+}
+
+/** @return position after the next space separated field at \a p */
+static inline const char* skip_field(const char* p, const char* end) {
+     while (p < end && *p == ' ')
+          p++;
+     while (p < end && *p != ' ' && *p != '\n')
+          p++;
+     return p;
+}
+
+/** A chunk of a mapped file and what it adds up to */
+struct chunk {
+     const char* begin; ///< First character, the start of a line
+     const char* end; ///< One past the last character, after a newline
+     analysis* result; ///< Filled in by parse_chunk()
+};
+
+/**
+   Parser thread start function
+
+   @param param is a chunk*
+*/
+static void* parse_chunk(void* param) {
+     struct chunk* c = (struct chunk*) param;
+     analysis* a = new analysis;
+     const char* p = c->begin;
+     while (p < c->end) {
+          const char* eol = (const char*) memchr(p, '\n', c->end - p);
+          if (!eol)
+               eol = c->end;
+          if (eol > p) {
+               const char* q = skip_field(p, eol); // clientid
+               while (q < eol && *q == ' ')
+                    q++;
+               int t = -1;
+               if (q < eol && *q >= '0' && *q < '0' + NTYPES && (q + 1 == eol || q[1] == ' '))
+                    t = *q - '0';
+               q = skip_field(q, eol); // type
+               q = skip_field(q, eol); // host
+               uint64_t start = 0, lat = 0;
+               if (q < eol)
+                    q = parse_time(q + 1, eol, &start);
+               if (q && q < eol)
+                    q = parse_time(q + 1, eol, &lat);
+               if (t >= 0 && q)
+                    a->add(t, start, lat);
+               else
+                    a->bad++;
+          }
+          p = eol + 1;
+     }
+     c->result = a;
+     return NULL;
+}
+
+/**
+   Analyze one query file, or the 'queries' file of a runtran output directory
+
+   @param a where to add the statements of the file
+*/
+static void analyze_file(string fname, analysis& a) {
+     struct stat st;
+     if (stat(fname.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+          fname += "/queries";
+     int fd = open(fname.c_str(), O_RDONLY);
+     if (fd == -1) {
+          cout << "Can not open " << fname << endl;
+          EABORT();
+     }
+     if (fstat(fd, &st) == -1)
+          EABORT();
+     if (st.st_size == 0) {
+          close(fd);
+          return;
+     }
+     const char* data = (const char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+     if (data == MAP_FAILED)
+          EABORT();
+     madvise((void*) data, st.st_size, MADV_SEQUENTIAL);
+     madvise((void*) data, st.st_size, MADV_WILLNEED);
+
+     int n = nthreads;
+     if (n <= 0)
+          n = sysconf(_SC_NPROCESSORS_ONLN);
+     // no point in giving a thread less than a megabyte
+     if (n > st.st_size / (1 << 20))
+          n = st.st_size / (1 << 20);
+     if (n < 1)
+          n = 1;
+
+     vector<chunk> chunks(n);
+     vector<pthread_t> threads(n);
+     const char* end = data + st.st_size;
+     const char* p = data;
+     for (int i = 0; i < n; i++) {
+          const char* e = i == n - 1 ? end : data + st.st_size / n * (i + 1);
+          if (e < p)
+               e = p;
+          const char* nl = (const char*) memchr(e, '\n', end - e);
+          e = nl ? nl + 1 : end;
+          chunks[i].begin = p;
+          chunks[i].end = e;
+          chunks[i].result = NULL;
+          p = e;
+          if (pthread_create(&threads[i], NULL, parse_chunk, &chunks[i]))
+               EABORT();
+     }
+     for (int i = 0; i < n; i++) {
+          if (pthread_join(threads[i], NULL))
+               EABORT();
+          a.merge(*chunks[i].result);
+          delete chunks[i].result;
+     }
+     munmap((void*) data, st.st_size);
+     close(fd);
+}
+
+/** Analyze a comma separated list of query files or output directories, e.g. the agents of one run */
+static void analyze_run(const char* run, analysis& a) {
+     char* tmp = strdup(run);
+     for (char* tok = strtok(tmp, ","); tok; tok = strtok(NULL, ","))
+          analyze_file(tok, a);
+     free(tmp);
+     if (a.bad)
+          cout << run << ": ignored " << a.bad << " malformed lines" << endl;
+}
+
+/** percentiles reported in the tables */
+static const double pcts[] = { 50, 90, 95, 99, 99.9 };
+static const int npcts = sizeof(pcts) / sizeof(pcts[0]);
+
+/** print the percentile table of \a a to stdout */
+static void print_table(const analysis& a) {
+     cout << setw(9) << "type" << setw(10) << "count" << setw(10) << "mean" << setw(10) << "stddev";
+     for (int i = 0; i < npcts; i++) {
+          char name[16];
+          snprintf(name, sizeof(name), "p%g", pcts[i]);
+          cout << setw(10) << name;
+     }
+     cout << setw(10) << "max" << endl;
+     for (int t = 0; t < NTYPES; t++) {
+          const histogram& h = a.hist[t];
+          if (!h.count)
+               continue;
+          cout << setw(9) << stm_names[t] << setw(10) << h.count
+               << setw(10) << (unsigned long long) h.mean()
+               << setw(10) << (unsigned long long) sqrt(a.variance(t));
+          for (int i = 0; i < npcts; i++)
+               cout << setw(10) << h.percentile(pcts[i]);
+          cout << setw(10) << h.max << endl;
+     }
+}
+
+/** write the timeline, percentile table and cdf of \a a as csv files starting with \a prefix */
+static void write_csv(const analysis& a, const string& prefix) {
+     ofstream tl((prefix + "timeline.csv").c_str(), ios::out | ios::trunc);
+     tl << "sec";
+     for (int t = 0; t < NTYPES; t++)
+          tl << "," << stm_names[t];
+     tl << ",total" << endl;
+     for (unsigned int s = 0; s < a.seconds(); s++) {
+          tl << s;
+          for (int t = 0; t < NTYPES; t++)
+               tl << "," << (s < a.timeline[t].size() ? a.timeline[t][s] : 0);
+          tl << "," << a.total(s) << endl;
+     }
+
+     ofstream pt((prefix + "percentiles.csv").c_str(), ios::out | ios::trunc);
+     pt << "type,count,mean,stddev,min";
+     for (int i = 0; i < npcts; i++)
+          pt << ",p" << pcts[i];
+     pt << ",max" << endl;
+     for (int t = 0; t < NTYPES; t++) {
+          const histogram& h = a.hist[t];
+          if (!h.count)
+               continue;
+          pt << stm_names[t] << "," << h.count << "," << h.mean() << "," << sqrt(a.variance(t))
+             << "," << h.min;
+          for (int i = 0; i < npcts; i++)
+               pt << "," << h.percentile(pcts[i]);
+          pt << "," << h.max << endl;
+     }
+
+     ofstream cdf((prefix + "cdf.csv").c_str(), ios::out | ios::trunc);
+     cdf << "type,usec,fraction" << endl;
+     for (int t = 0; t < NTYPES; t++) {
+          const histogram& h = a.hist[t];
+          uint64_t seen = 0;
+          for (unsigned int i = 0; i < histogram::NBUCKETS && seen < h.count; i++) {
+               if (!h.b[i])
+                    continue;
+               seen += h.b[i];
+               cdf << stm_names[t] << "," << histogram::highest(i) << ","
+                   << (double) seen / h.count << endl;
+          }
+     }
+     cout << "Wrote " << prefix << "timeline.csv, " << prefix << "percentiles.csv and "
+          << prefix << "cdf.csv" << endl;
+}
+
+/** write the timeline, percentile table and cdf of \a a as one json file starting with \a prefix */
+static void write_json(const analysis& a, const string& prefix) {
+     ofstream o((prefix + "analysis.json").c_str(), ios::out | ios::trunc);
+     o << "{\"types\":{";
+     bool first = 1;
+     for (int t = 0; t < NTYPES; t++) {
+          const histogram& h = a.hist[t];
+          if (!h.count)
+               continue;
+          o << (first ? "" : ",") << "\n\"" << stm_names[t] << "\":{\"count\":" << h.count
+            << ",\"mean\":" << h.mean() << ",\"stddev\":" << sqrt(a.variance(t))
+            << ",\"min\":" << h.min << ",\"max\":" << h.max << ",\"percentiles\":{";
+          for (int i = 0; i < npcts; i++)
+               o << (i ? "," : "") << "\"p" << pcts[i] << "\":" << h.percentile(pcts[i]);
+          o << "},\"cdf\":[";
+          uint64_t seen = 0;
+          bool firstb = 1;
+          for (unsigned int i = 0; i < histogram::NBUCKETS && seen < h.count; i++) {
+               if (!h.b[i])
+                    continue;
+               seen += h.b[i];
+               o << (firstb ? "" : ",") << "[" << histogram::highest(i) << ","
+                 << (double) seen / h.count << "]";
+               firstb = 0;
+          }
+          o << "]}";
+          first = 0;
+     }
+     o << "},\n\"timeline\":[";
+     for (unsigned int s = 0; s < a.seconds(); s++) {
+          o << (s ? "," : "") << "\n{\"sec\":" << s;
+          for (int t = 0; t < NTYPES; t++)
+               if (s < a.timeline[t].size() && a.timeline[t][s])
+                    o << ",\"" << stm_names[t] << "\":" << a.timeline[t][s];
+          o << ",\"total\":" << a.total(s) << "}";
+     }
+     o << "]}" << endl;
+     cout << "Wrote " << prefix << "analysis.json" << endl;
+}
+
+/**
+   Mean and 95% confidence half width of the per-second throughput,
+   leaving out the first and last second, which are usually partial
+*/
+static void throughput(const analysis& a, double* mean, double* ci) {
+     unsigned int len = a.seconds();
+     double sum = 0, sq = 0;
+     unsigned int n = 0;
+     for (unsigned int s = 1; s + 1 < len; s++) {
+          double x = a.total(s);
+          sum += x;
+          sq += x * x;
+          n++;
+     }
+     *mean = n ? sum / n : 0;
+     *ci = n > 1 ? 1.96 * sqrt((sq - n * *mean * *mean) / (n - 1) / n) : 0;
+}
+
+/**
+   Compare run \a b against run \a a: the difference of the mean latency
+   of every statement type and of the throughput, with a 95% confidence
+   interval (normal approximation of Welch's t interval), and the
+   change of the percentiles
+*/
+static void compare(const analysis& a, const analysis& b, const string& prefix) {
+     ofstream o((prefix + (json ? "compare.json" : "compare.csv")).c_str(), ios::out | ios::trunc);
+     if (json)
+          o << "{\"types\":{";
+     else
+          o << "type,count_a,count_b,mean_a,mean_b,diff,ci_low,ci_high,significant,p50_a,p50_b,p99_a,p99_b" << endl;
+     cout << setw(9) << "type" << setw(12) << "mean a" << setw(12) << "mean b" << setw(12) << "diff"
+          << setw(25) << "95% ci" << setw(10) << "p99 a" << setw(10) << "p99 b" << endl;
+     bool first = 1;
+     for (int t = 0; t < NTYPES; t++) {
+          const histogram& ha = a.hist[t];
+          const histogram& hb = b.hist[t];
+          if (!ha.count || !hb.count)
+               continue;
+          double diff = hb.mean() - ha.mean();
+          double half = 1.96 * sqrt(a.variance(t) / ha.count + b.variance(t) / hb.count);
+          bool sig = diff - half > 0 || diff + half < 0;
+          cout << setw(9) << stm_names[t] << fixed << setprecision(1)
+               << setw(12) << ha.mean() << setw(12) << hb.mean() << setw(12) << diff
+               << "   [" << setw(10) << diff - half << "," << setw(10) << diff + half << "]"
+               << setw(10) << ha.percentile(99) << setw(10) << hb.percentile(99)
+               << (sig ? "  *" : "") << endl;
+          if (json)
+               o << (first ? "" : ",") << "\n\"" << stm_names[t] << "\":{\"count_a\":" << ha.count
+                 << ",\"count_b\":" << hb.count << ",\"mean_a\":" << ha.mean()
+                 << ",\"mean_b\":" << hb.mean() << ",\"diff\":" << diff
+                 << ",\"ci\":[" << diff - half << "," << diff + half << "]"
+                 << ",\"significant\":" << (sig ? "true" : "false")
+                 << ",\"p50_a\":" << ha.percentile(50) << ",\"p50_b\":" << hb.percentile(50)
+                 << ",\"p99_a\":" << ha.percentile(99) << ",\"p99_b\":" << hb.percentile(99) << "}";
+          else
+               o << stm_names[t] << "," << ha.count << "," << hb.count << "," << ha.mean()
+                 << "," << hb.mean() << "," << diff << "," << diff - half << "," << diff + half
+                 << "," << sig << "," << ha.percentile(50) << "," << hb.percentile(50)
+                 << "," << ha.percentile(99) << "," << hb.percentile(99) << endl;
+          first = 0;
+     }
+
+     double ma, ca, mb, cb;
+     throughput(a, &ma, &ca);
+     throughput(b, &mb, &cb);
+     double diff = mb - ma;
+     double half = sqrt(ca * ca + cb * cb);
+     cout << "throughput a " << ma << " +- " << ca << "/s, b " << mb << " +- " << cb
+          << "/s, diff " << diff << " [" << diff - half << "," << diff + half << "]" << endl;
+     if (json)
+          o << "},\n\"throughput\":{\"a\":" << ma << ",\"a_ci\":" << ca << ",\"b\":" << mb
+            << ",\"b_ci\":" << cb << ",\"diff\":" << diff << ",\"ci\":[" << diff - half << ","
+            << diff + half << "]}}" << endl;
+     else
+          o << "throughput," << a.seconds() << "," << b.seconds() << "," << ma << "," << mb << ","
+            << diff << "," << diff - half << "," << diff + half << ","
+            << (diff - half > 0 || diff + half < 0) << ",,,," << endl;
+     cout << "Wrote " << prefix << (json ? "compare.json" : "compare.csv") << endl;
+}
+
+int main(int argc, char** argv) {
+     const char* out = NULL;
+     bool cmp = 0;
+     vector<const char*> runs;
+     for (int i = 1; i < argc; i++) {
+          if (strcmp(argv[i], "--json") == 0)
+               json = 1;
+          else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+               nthreads = atoi(argv[++i]);
+          else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+               out = argv[++i];
+          else if (strcmp(argv[i], "--compare") == 0)
+               cmp = 1;
+          else if (argv[i][0] == '-') {
+               cout << argv[0] << " - Unknown param " << argv[i] << endl;
+               runs.clear();
+               break;
+          }
+          else
+               runs.push_back(argv[i]);
+     }
+     if (runs.empty() || (cmp && runs.size() != 2)) {
+          cout << "Usage: " << argv[0] << " [--json] [--threads n] [--out prefix] run[,run...] ..." << endl;
+          cout << "       " << argv[0] << " [--json] [--threads n] [--out prefix] --compare run_a run_b" << endl;
+          cout << "A run is a runtran output directory or its queries file, several" << endl;
+          cout << "separated by commas (e.g. the agents of one run) are merged." << endl;
+          exit(1);
+     }
+
+     // by default the results go next to the (first) queries file
+     string prefix;
+     if (out)
+          prefix = out;
+     else {
+          string first(runs[0]);
+          first = first.substr(0, first.find(','));
+          struct stat st;
+          if (stat(first.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+               prefix = first + "/";
+          else if (first.rfind('/') != string::npos)
+               prefix = first.substr(0, first.rfind('/') + 1);
+     }
+
+     if (cmp) {
+          analysis* a = new analysis;
+          analysis* b = new analysis;
+          analyze_run(runs[0], *a);
+          analyze_run(runs[1], *b);
+          compare(*a, *b, prefix);
+          return 0;
+     }
+
+     analysis* a = new analysis;
+     for (unsigned int i = 0; i < runs.size(); i++)
+          analyze_run(runs[i], *a);
+     print_table(*a);
+     if (json)
+          write_json(*a, prefix);
+     else
+          write_csv(*a, prefix);
+     return 0;
+}
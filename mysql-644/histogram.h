@@ -0,0 +1,105 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+   Log-linear latency histogram with microsecond resolution.
+
+   Values below 2^SUBBITS are counted exactly, every larger power of two
+   is split into 2^SUBBITS equally sized buckets, so the relative error of
+   a reported percentile stays below 1/2^SUBBITS while the whole 64 bit
+   range fits in a few kilobytes.
+*/
+struct histogram {
+     enum {
+          SUBBITS = 4,
+          SUB = 1 << SUBBITS,
+          NBUCKETS = (65 - SUBBITS) * SUB
+     };
+
+     uint64_t count; ///< Number of recorded values
+     uint64_t sum; ///< Sum of all recorded values
+     uint64_t min; ///< Smallest recorded value
+     uint64_t max; ///< Largest recorded value
+     uint64_t b[NBUCKETS]; ///< Bucket counters
+
+     /// Constructor
+     histogram() { clear(); }
+
+     /** forget everything recorded so far */
+     void clear() {
+          count = sum = max = 0;
+          min = ~(uint64_t)0;
+          memset(b, 0, sizeof(b));
+     }
+
+     /** @return the bucket index \a v is counted in */
+     static unsigned int bucket(uint64_t v) {
+          if (v < SUB)
+               return (unsigned int)v;
+          unsigned int shift = 63 - __builtin_clzll(v) - SUBBITS;
+          return shift * SUB + (unsigned int)(v >> shift);
+     }
+
+     /** @return the smallest value counted in bucket \a i */
+     static uint64_t lowest(unsigned int i) {
+          if (i < SUB)
+               return i;
+          unsigned int shift = i / SUB - 1;
+          return (uint64_t)(i - shift * SUB) << shift;
+     }
+
+     /** @return the largest value counted in bucket \a i */
+     static uint64_t highest(unsigned int i) {
+          if (i < SUB)
+               return i;
+          return lowest(i) + ((uint64_t)1 << (i / SUB - 1)) - 1;
+     }
+
+     /** record one value */
+     void add(uint64_t v) {
+          b[bucket(v)]++;
+          count++;
+          sum += v;
+          if (v < min) min = v;
+          if (v > max) max = v;
+     }
+
+     /** add all values recorded in \a o */
+     void merge(const histogram& o) {
+          if (!o.count)
+               return;
+          for (unsigned int i = 0; i < NBUCKETS; i++)
+               b[i] += o.b[i];
+          count += o.count;
+          sum += o.sum;
+          if (o.min < min) min = o.min;
+          if (o.max > max) max = o.max;
+     }
+
+     /** @return the mean of the recorded values, 0 if empty */
+     double mean() const { return count ? (double)sum / count : 0.0; }
+
+     /**
+        @return the value below which \a p percent of the recorded
+        values fall, reported as the upper bound of its bucket
+     */
+     uint64_t percentile(double p) const {
+          if (!count)
+               return 0;
+          uint64_t rank = (uint64_t)(p / 100.0 * count + 0.5);
+          if (rank < 1) rank = 1;
+          if (rank > count) rank = count;
+          uint64_t seen = 0;
+          for (unsigned int i = 0; i < NBUCKETS; i++) {
+               seen += b[i];
+               if (seen >= rank)
+                    return highest(i) < max ? highest(i) : max;
+          }
+          return max;
+     }
+};
+
+#endif
@@ -8,11 +8,21 @@
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <regex.h>
+#include <sched.h>
+#include <dirent.h>
 #include <signal.h>
 
 #include <string>
 #include <ext/hash_map>
 #include <vector>
+#include <algorithm>
+#include <map>
 #include <iostream>
 #include <iomanip>
 #include <fcntl.h>
@@ -20,6 +30,8 @@
 
 #include <mysql/mysql.h>
 
+#include "histogram.h"
+
 #define MYSQL_SOCK_FILE "/tmp/mysql.sock"
 #define MYSQL_PATH "/opt/bugs/mysql-4.1.1/mysql-4.1.1-alpha/bin"
 
@@ -55,6 +67,12 @@ enum stm_type_t {
      WRITE //must be last
 };
 
+/** index of whole transactions in the per type statistics, after the statement types */
+static const int TXN = WRITE + 1;
+
+/** printable names of the statement types and TXN */
+static const char* stm_names[TXN+1] = { "BEGIN", "COMMIT", "ROLLBACK", "SELECT", "TEMPTPL", "WRITE", "TXN" };
+
 /** A query, with string and type */
 struct aquery {
      ///Constructor
@@ -86,46 +104,342 @@ struct result {
             const struct timeval &s, const struct timeval &e)
           : host(string(h)), start(s), end(e), thequery(q) {}
 
-     /// Print the statistics to a file
-     std::ostream& operator<<(std::ostream& o) const {
-          struct timeval t;
-          gettimediffs(t, end, start);
-          return o
-               << thequery->t << " "
-               << host << " "
-//             << start.tv_sec << "."
-//             << start.tv_usec << " "
-//             << end.tv_sec << "."
-//             << end.tv_usec << " "
-               << t.tv_sec << "."
-               << setfill('0') << setw(6) <<  t.tv_usec << " \""
-               << thequery->q << "\"";
-     }
+     /// Print the statistics to a file: type, host, start since start_tv, latency and query
+     std::ostream& operator<<(std::ostream& o) const;
 };
 
-std::ostream& operator<<(std::ostream& o, const struct result& r) {
-  return r.operator<<(o);
-}
 
 static vector< vector<aquery> > queries; ///< array of transactions which are arrays of queries
 static unsigned int gtid = 0; ///< next transaction id available for execution
 static pthread_mutex_t gtid_m = PTHREAD_MUTEX_INITIALIZER; ///< to protect gtid
 static volatile bool rampupdone = 0;
+static struct timeval start_tv; ///< instant the workers were released, origin of the timeline
+static unsigned int tid_lo = 0; ///< first transaction id this process executes
+static unsigned int tid_hi = ~0U; ///< one past the last transaction id this process executes
+
+/** @return one past the last transaction id this process may execute */
+static inline unsigned int tid_end() {
+     return tid_hi < queries.size() ? tid_hi : queries.size();
+}
+
+std::ostream& result::operator<<(std::ostream& o) const {
+     struct timeval t, s;
+     gettimediffs(t, end, start);
+     gettimediffs(s, start, start_tv);
+     return o
+          << thequery->t << " "
+          << host << " "
+          << s.tv_sec << "."
+          << setfill('0') << setw(6) << s.tv_usec << " "
+          << t.tv_sec << "."
+          << setfill('0') << setw(6) <<  t.tv_usec << " \""
+          << thequery->q << "\"";
+}
+
+std::ostream& operator<<(std::ostream& o, const struct result& r) {
+  return r.operator<<(o);
+}
+
+static const int MAXBACKENDS = 1024; ///< sanity limit for the number of backends
+
+/** @return \a hs[i], growing \a hs if needed */
+static inline histogram& backend_hist(vector<histogram>& hs, unsigned int i) {
+     if (i >= hs.size())
+          hs.resize(i + 1);
+     return hs[i];
+}
+
+/** send the histograms \a hs to the coordinator as "<tag>S" and "<tag>H" lines, see recv_hist() */
+static void send_hist(FILE* f, const char* tag, const vector<histogram>& hs) {
+     for (unsigned int b = 0; b < hs.size(); b++) {
+          const histogram& h = hs[b];
+          if (!h.count)
+               continue;
+          fprintf(f, "%sS %u %llu %llu %llu %llu\n", tag, b, (unsigned long long)h.count,
+                  (unsigned long long)h.sum, (unsigned long long)h.min, (unsigned long long)h.max);
+          for (unsigned int i = 0; i < histogram::NBUCKETS; i++)
+               if (h.b[i])
+                    fprintf(f, "%sH %u %u %llu\n", tag, b, i, (unsigned long long)h.b[i]);
+     }
+}
+
+/** parse one line written by send_hist() with \a tag into \a hs, @return false if it was not one */
+static bool recv_hist(const char* line, const char* tag, vector<histogram>& hs) {
+     char fmt[64];
+     int b;
+     unsigned int i;
+     unsigned long long n, sum, min, max;
+     snprintf(fmt, sizeof(fmt), "%sS %%d %%llu %%llu %%llu %%llu", tag);
+     if (sscanf(line, fmt, &b, &n, &sum, &min, &max) == 5 && b >= 0 && b < MAXBACKENDS) {
+          histogram& h = backend_hist(hs, b);
+          h.count = n;
+          h.sum = sum;
+          h.min = min;
+          h.max = max;
+          return true;
+     }
+     snprintf(fmt, sizeof(fmt), "%sH %%d %%u %%llu", tag);
+     if (sscanf(line, fmt, &b, &i, &n) == 3 && b >= 0 && b < MAXBACKENDS && i < histogram::NBUCKETS) {
+          backend_hist(hs, b).b[i] = n;
+          return true;
+     }
+     return false;
+}
+
+/**
+   Latency histograms and per-second completion counts of a run, per
+   statement type and for whole transactions (TXN), along with the
+   outcome of the transactions and the latencies seen on each backend
+*/
+struct runstats {
+     histogram hist[TXN+1]; ///< Latencies in usec measured after rampup
+     vector<unsigned long> timeline[TXN+1]; ///< Completions in each second since start_tv
+     unsigned long commits; ///< Transactions committed after rampup
+     unsigned long rollbacks; ///< Transactions rolled back by the trace after rampup
+     unsigned long aborts; ///< Transactions given up after running out of retries
+     unsigned long retries; ///< Transactions restarted after a retryable error
+     map<unsigned int, unsigned long> errors; ///< Retryable server errors seen, by error number
+     double window; ///< Seconds from the end of the rampup to the end of the run
+     vector<histogram> bstm; ///< Latencies of the statements, per backend
+     vector<histogram> btxn; ///< Latencies of the transactions, per backend
+
+     /// Constructor
+     runstats() : commits(0), rollbacks(0), aborts(0), retries(0), window(0) {}
+
+     /** count a completion of type \a t at \a end in the timeline */
+     void tick(int t, const struct timeval& end) {
+          long sec = end.tv_sec - start_tv.tv_sec;
+          if (sec < 0)
+               sec = 0;
+          if ((unsigned long)sec >= timeline[t].size())
+               timeline[t].resize(sec + 1);
+          timeline[t][sec]++;
+     }
+
+     /** add everything recorded in \a o */
+     void merge(const runstats& o) {
+          commits += o.commits;
+          rollbacks += o.rollbacks;
+          aborts += o.aborts;
+          retries += o.retries;
+          for (map<unsigned int, unsigned long>::const_iterator it = o.errors.begin(); it != o.errors.end(); ++it)
+               errors[it->first] += it->second;
+          if (o.window > window)
+               window = o.window;
+          for (unsigned int b = 0; b < o.bstm.size(); b++)
+               backend_hist(bstm, b).merge(o.bstm[b]);
+          for (unsigned int b = 0; b < o.btxn.size(); b++)
+               backend_hist(btxn, b).merge(o.btxn[b]);
+          for (int t = 0; t <= TXN; t++) {
+               hist[t].merge(o.hist[t]);
+               if (o.timeline[t].size() > timeline[t].size())
+                    timeline[t].resize(o.timeline[t].size());
+               for (unsigned int s = 0; s < o.timeline[t].size(); s++)
+                    timeline[t][s] += o.timeline[t][s];
+          }
+     }
+
+     /** send the raw counters to the coordinator, see recv() */
+     void send(FILE* f) const {
+          fprintf(f, "X %lu %lu %lu %lu %f\n", commits, rollbacks, aborts, retries, window);
+          for (map<unsigned int, unsigned long>::const_iterator it = errors.begin(); it != errors.end(); ++it)
+               fprintf(f, "E %u %lu\n", it->first, it->second);
+          for (int t = 0; t <= TXN; t++) {
+               const histogram& h = hist[t];
+               if (h.count)
+                    fprintf(f, "S %d %llu %llu %llu %llu\n", t, (unsigned long long)h.count,
+                            (unsigned long long)h.sum, (unsigned long long)h.min,
+                            (unsigned long long)h.max);
+               for (unsigned int i = 0; i < histogram::NBUCKETS; i++)
+                    if (h.b[i])
+                         fprintf(f, "H %d %u %llu\n", t, i, (unsigned long long)h.b[i]);
+               for (unsigned int s = 0; s < timeline[t].size(); s++)
+                    if (timeline[t][s])
+                         fprintf(f, "T %d %u %lu\n", t, s, timeline[t][s]);
+          }
+          send_hist(f, "B", bstm);
+          send_hist(f, "BX", btxn);
+     }
+
+     /** parse one line written by send(), @return false if it was not one */
+     bool recv(const char* line) {
+          int t;
+          unsigned int i;
+          unsigned long long a, b, c, d;
+          unsigned long n;
+          if (sscanf(line, "X %lu %lu %lu %lu %lf", &commits, &rollbacks, &aborts, &retries, &window) == 5) {
+               ;
+          } else if (sscanf(line, "E %u %lu", &i, &n) == 2) {
+               errors[i] = n;
+          } else if (sscanf(line, "S %d %llu %llu %llu %llu", &t, &a, &b, &c, &d) == 5 && t >= 0 && t <= TXN) {
+               hist[t].count = a;
+               hist[t].sum = b;
+               hist[t].min = c;
+               hist[t].max = d;
+          } else if (sscanf(line, "H %d %u %llu", &t, &i, &a) == 3 && t >= 0 && t <= TXN &&
+                     i < histogram::NBUCKETS) {
+               hist[t].b[i] = a;
+          } else if (sscanf(line, "T %d %u %lu", &t, &i, &n) == 3 && t >= 0 && t <= TXN) {
+               if (i >= timeline[t].size())
+                    timeline[t].resize(i + 1);
+               timeline[t][i] = n;
+          } else if (!recv_hist(line, "B", bstm) && !recv_hist(line, "BX", btxn))
+               return false;
+          return true;
+     }
+
+     /** write the non-empty buckets as "type low_usec high_usec count" lines */
+     void write_histogram(std::ostream& o) const {
+          for (int t = 0; t <= TXN; t++)
+               for (unsigned int i = 0; i < histogram::NBUCKETS; i++)
+                    if (hist[t].b[i])
+                         o << stm_names[t] << " " << histogram::lowest(i) << " "
+                           << histogram::highest(i) << " " << hist[t].b[i] << endl;
+          if (bstm.size() < 2)
+               return;
+          for (unsigned int b = 0; b < bstm.size(); b++)
+               for (unsigned int i = 0; i < histogram::NBUCKETS; i++)
+                    if (bstm[b].b[i])
+                         o << "backend" << b << " " << histogram::lowest(i) << " "
+                           << histogram::highest(i) << " " << bstm[b].b[i] << endl;
+          for (unsigned int b = 0; b < btxn.size(); b++)
+               for (unsigned int i = 0; i < histogram::NBUCKETS; i++)
+                    if (btxn[b].b[i])
+                         o << "backend" << b << "-TXN " << histogram::lowest(i) << " "
+                           << histogram::highest(i) << " " << btxn[b].b[i] << endl;
+     }
+
+     /**
+        write one line per second with the completions of each statement
+        type, their total and the completed transactions
+     */
+     void write_timeline(std::ostream& o) const {
+          unsigned int len = 0;
+          o << "#sec";
+          for (int t = 0; t <= TXN; t++) {
+               if (t == TXN)
+                    o << " total";
+               o << " " << stm_names[t];
+               if (timeline[t].size() > len)
+                    len = timeline[t].size();
+          }
+          o << endl;
+          for (unsigned int s = 0; s < len; s++) {
+               unsigned long total = 0;
+               o << s;
+               for (int t = 0; t <= TXN; t++) {
+                    unsigned long n = s < timeline[t].size() ? timeline[t][s] : 0;
+                    if (t == TXN)
+                         o << " " << total;
+                    total += n;
+                    o << " " << n;
+               }
+               o << endl;
+          }
+     }
+
+     /** print count, mean and percentiles in usec of every statement type seen */
+     void summary(std::ostream& o) const {
+          o << setfill(' ') << setw(9) << "type" << setw(10) << "count" << setw(10) << "mean"
+            << setw(10) << "p50" << setw(10) << "p90" << setw(10) << "p99" << setw(10) << "max" << endl;
+          for (int t = 0; t <= TXN; t++) {
+               const histogram& h = hist[t];
+               if (!h.count)
+                    continue;
+               o << setw(9) << stm_names[t] << setw(10) << h.count
+                 << setw(10) << static_cast<unsigned long long>(h.mean())
+                 << setw(10) << h.percentile(50) << setw(10) << h.percentile(90)
+                 << setw(10) << h.percentile(99) << setw(10) << h.max << endl;
+          }
+          unsigned long finished = commits + rollbacks + aborts;
+          o << "transactions: " << commits << " committed, " << rollbacks << " rolled back, "
+            << aborts << " aborted, " << retries << " retries" << endl;
+          std::streamsize prec = o.precision(2);
+          o << "tps: " << fixed << (window > 0 ? commits / window : 0.0)
+            << " abort rate: " << (finished ? 100.0 * aborts / finished : 0.0) << "%" << endl;
+          o.unsetf(ios::fixed);
+          o.precision(prec);
+          for (map<unsigned int, unsigned long>::const_iterator it = errors.begin(); it != errors.end(); ++it)
+               o << "error " << it->first << ": " << it->second << endl;
+          if (bstm.size() < 2)
+               return;
+          // shows how evenly the shards are loaded
+          uint64_t txns = 0;
+          for (unsigned int b = 0; b < btxn.size(); b++)
+               txns += btxn[b].count;
+          o << setw(9) << "backend" << setw(10) << "stmts" << setw(10) << "mean" << setw(10) << "p99"
+            << setw(10) << "txns" << setw(8) << "share" << setw(10) << "mean" << setw(10) << "p99" << endl;
+          for (unsigned int b = 0; b < bstm.size(); b++) {
+               static const histogram empty;
+               const histogram& t = b < btxn.size() ? btxn[b] : empty;
+               o << setw(9) << b << setw(10) << bstm[b].count
+                 << setw(10) << static_cast<unsigned long long>(bstm[b].mean())
+                 << setw(10) << bstm[b].percentile(99) << setw(10) << t.count
+                 << setw(7) << (txns ? 100 * t.count / txns : 0) << "%"
+                 << setw(10) << static_cast<unsigned long long>(t.mean())
+                 << setw(10) << t.percentile(99) << endl;
+          }
+     }
+};
 
 /** Groups all results from a run together */
 class resultset_t {
 public:
      vector<const struct result*> results; ///< Vector of results
+     runstats stats; ///< Histograms and timeline of this thread
      unsigned int seed; ///< The random seed we started with
      const int clientid; ///< The clientid for the thread
 
      /** Constructor */
      resultset_t(int clentid) : clientid(clentid) {}
 
-     /** push result to list if we are done with the rampup */
-     void update(const struct result* res) {
-          if (rampupdone)
+     /**
+        count result in the timeline, and keep it if we are done with the rampup
+
+        @param backend index of the backend the statement was run on
+     */
+     void update(const struct result* res, int backend) {
+          stats.tick(res->thequery->t, res->end);
+          if (rampupdone) {
+               struct timeval t;
+               gettimediffs(t, res->end, res->start);
+               uint64_t usec = (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+               stats.hist[res->thequery->t].add(usec);
+               backend_hist(stats.bstm, backend).add(usec);
                results.push_back(res);
+          }
+          else
+               delete res;
+     }
+
+     /**
+        account a transaction that started at \a s and was ended by
+        the statement \a how at \a e on \a backend
+     */
+     void txn(enum stm_type_t how, const struct timeval& s, const struct timeval& e, int backend) {
+          stats.tick(TXN, e);
+          if (rampupdone) {
+               struct timeval t;
+               gettimediffs(t, e, s);
+               uint64_t usec = (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+               stats.hist[TXN].add(usec);
+               backend_hist(stats.btxn, backend).add(usec);
+               if (how == COMMIT)
+                    stats.commits++;
+               else
+                    stats.rollbacks++;
+          }
+     }
+
+     /** account the retryable server error \a err, and whether it was \a retried */
+     void failed(unsigned int err, bool retried) {
+          if (rampupdone) {
+               stats.errors[err]++;
+               if (retried)
+                    stats.retries++;
+               else
+                    stats.aborts++;
+          }
      }
 
      /** print it */
@@ -140,6 +454,135 @@ static char* tracefile = "outc.txt"; ///< default trace filename
 static bool repeatlog = 0; ///< default stop when log runs out
 static int sleeptimeg = -1; ///< Time to sleep between queries (-1 = dont sleep, 0 = tpcw thinktime, other = that)
 static int allowwrite = 0; ///< default dont allow writes
+static vector<unsigned int> retry_errors; ///< server errors that restart a transaction
+static const unsigned int default_retry_errors[] = { 1205, 1213 }; ///< ER_LOCK_WAIT_TIMEOUT, ER_LOCK_DEADLOCK
+static int maxretries = 3; ///< restarts of a transaction before it is counted as aborted
+static int backoffms = 10; ///< sleep before the first restart, doubled for every further one
+static const int maxbackoffms = 1000; ///< upper bound of the backoff
+
+/** @return true if the server error \a err aborted the transaction but it may be retried */
+static bool retryable(unsigned int err) {
+     for (unsigned int i = 0; i < retry_errors.size(); i++)
+          if (retry_errors[i] == err)
+               return true;
+     return false;
+}
+
+/**
+   Back off before restarting a transaction for the \a attempt time,
+   exponentially with jitter so that the victims of a deadlock do not
+   collide again right away
+
+   @param seed per thread seed for rand_r, leaves the query stream of rand() alone
+*/
+static void backoff(int attempt, unsigned int* seed) {
+     long ms = backoffms;
+     for (int i = 1; i < attempt && ms < maxbackoffms; i++)
+          ms *= 2;
+     if (ms > maxbackoffms)
+          ms = maxbackoffms;
+     double jitter = 0.5 + 0.5 * rand_r(seed) / (RAND_MAX + 1.0);
+     usleep(static_cast<useconds_t>(ms * 1000 * jitter));
+}
+
+/** Read the tracefile into queries, the caller must hold gtid_m */
+static void load_trace() {
+     char buf[1024];
+     FILE* f = fopen(tracefile, "r");
+     if (!f) {
+          cout << "Can not open " << tracefile << endl;
+          EABORT();
+     }
+     while(fgets(buf,1024,f)) {
+          unsigned int nr;
+          int where;
+          char*p=rindex(buf, '\n');
+          if (p) *p='\0';
+          if (sscanf(buf,"%*s %*s B %u", &nr)) {
+               if (nr > queries.size()) queries.resize(nr);
+               queries[nr-1].push_back(aquery(BEGIN, string()));
+          } else if (sscanf(buf,"%*s %*s C %u", &nr)) {
+               if (nr > queries.size()) queries.resize(nr);
+               queries[nr-1].push_back(aquery(COMMIT, string()));
+          } else if (sscanf(buf,"%*s %*s R %u", &nr)) {
+               if (nr > queries.size()) queries.resize(nr);
+               queries[nr-1].push_back(aquery(ROLLBACK, string()));
+          } else if (sscanf(buf,"%*s %*s S %u %n", &nr, &where)) {
+               if (nr > queries.size()) queries.resize(nr);
+               queries[nr-1].push_back(aquery(SELECT, string(buf+where)));
+          } else if (sscanf(buf,"%*s %*s W %u %n", &nr, &where)) {
+               if (nr > queries.size()) queries.resize(nr);
+               if (strncmp(buf+where, "create temporary", strlen("create temporary")) == 0 ||
+                   strncmp(buf+where, "drop table", strlen("drop table")) == 0) {
+                    queries[nr-1].push_back(aquery(TEMPTPL, string(buf+where)));
+               } else {
+                    queries[nr-1].push_back(aquery(WRITE, string(buf+where)));
+               }
+          } else {
+               cout << "Ignored unknown line " << buf;
+          }
+     }
+     fclose(f);
+}
+
+static vector<bool> txn_writes; ///< true for the transactions with a write or temporary table
+
+/** note which transactions write, the caller must hold gtid_m */
+static void find_writes() {
+     txn_writes.assign(queries.size(), false);
+     for (unsigned int t = 0; t < queries.size(); t++)
+          for (unsigned int i = 0; i < queries[t].size(); i++)
+               if (queries[t][i].t == WRITE || queries[t][i].t == TEMPTPL)
+                    txn_writes[t] = true;
+}
+
+/** @return a well mixed 64 bit hash of \a x (splitmix64 finalizer) */
+static inline uint64_t mix64(uint64_t x) {
+     x += 0x9e3779b97f4a7c15ULL;
+     x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+     x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+     return x ^ (x >> 31);
+}
+
+/** @return the FNV-1a hash of \a s */
+static inline uint64_t hashstr(const string& s) {
+     uint64_t h = 0xcbf29ce484222325ULL;
+     for (unsigned int i = 0; i < s.size(); i++)
+          h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+     return h;
+}
+
+static const char* shardkey = "=[[:space:]]*('[^']*'|[0-9]+)"; ///< regex of the shard key, see --shardkey
+static regex_t shardkey_re; ///< shardkey compiled, if there are backends to route to
+static bool shardkeys = false; ///< shardkey_re is compiled
+static vector<uint64_t> txn_keys; ///< hash of the shard key of every transaction
+static unsigned int keyed_txns = 0; ///< transactions whose statements had a shard key
+
+/**
+   Hash the shard key of every transaction: the first match of shardkey
+   in its statements, or of the first group of the regex if it has one.
+   A transaction without a match is keyed by its number, which spreads
+   those evenly. The caller must hold gtid_m.
+*/
+static void find_shard_keys() {
+     if (!shardkeys)
+          return;
+     txn_keys.resize(queries.size());
+     keyed_txns = 0;
+     for (unsigned int t = 0; t < queries.size(); t++) {
+          txn_keys[t] = mix64(t);
+          for (unsigned int i = 0; i < queries[t].size(); i++) {
+               const char* q = queries[t][i].q.c_str();
+               regmatch_t m[2];
+               if (regexec(&shardkey_re, q, 2, m, 0) != 0)
+                    continue;
+               int g = m[1].rm_so == -1 ? 0 : 1;
+               txn_keys[t] = mix64(hashstr(string(q + m[g].rm_so, m[g].rm_eo - m[g].rm_so)));
+               keyed_txns++;
+               break;
+          }
+     }
+}
 
 /** A SQLgenerator, currently works by reading a tracefile */
 class SQLGenerator {
@@ -154,6 +597,9 @@ public:
      ///sequence, used to verify we issued a commit or rollback
      bool last_stm_was_new_tid() const { return ntid; }
 
+     ///The id of the transaction the last statement belongs to
+     unsigned int current() const { return tid; }
+
      ///Get a new transaction id
      void newtid() {
           ABORTIF(pthread_mutex_lock(&gtid_m));
@@ -161,6 +607,18 @@ public:
           ABORTIF(pthread_mutex_unlock(&gtid_m));
      }
 
+     ///Run the current transaction again from its first statement
+     void restart() {
+          if (tid < tid_end())
+               it = queries[tid].begin();
+     }
+
+     ///Give up the current transaction, the next statement starts a new one
+     void skip() {
+          if (tid < tid_end())
+               it = queries[tid].end();
+     }
+
      /** 
          Reinit the global transaction id counter
          
@@ -168,7 +626,7 @@ public:
          start of a trace might be run several times */
      static void reinit() {
           ABORTIF(pthread_mutex_lock(&gtid_m));
-          gtid = 0;
+          gtid = tid_lo;
           ABORTIF(pthread_mutex_unlock(&gtid_m));
      }
 
@@ -176,48 +634,16 @@ public:
      SQLGenerator(MYSQL* adbase) : dbase(adbase), ntid(0) {
           ABORTIF(pthread_mutex_lock(&gtid_m));
           if (!queries.size()) {
-               char buf[1024];
-               FILE* f = fopen(tracefile, "r");
-               if (!f) {
-                    cout << "Can not open " << tracefile << endl;
-                    EABORT();
-               }
-               while(fgets(buf,1024,f)) {
-                    unsigned int nr;
-                    int where;
-                    char*p=rindex(buf, '\n');
-                    if (p) *p='\0';
-                    if (sscanf(buf,"%*s %*s B %u", &nr)) {
-                         if (nr > queries.size()) queries.resize(nr);
-                         queries[nr-1].push_back(aquery(BEGIN, string()));
-                    } else if (sscanf(buf,"%*s %*s C %u", &nr)) {
-                         if (nr > queries.size()) queries.resize(nr);
-                         queries[nr-1].push_back(aquery(COMMIT, string()));
-                    } else if (sscanf(buf,"%*s %*s R %u", &nr)) {
-                         if (nr > queries.size()) queries.resize(nr);
-                         queries[nr-1].push_back(aquery(ROLLBACK, string()));
-                    } else if (sscanf(buf,"%*s %*s S %u %n", &nr, &where)) {
-                         if (nr > queries.size()) queries.resize(nr);
-                         queries[nr-1].push_back(aquery(SELECT, string(buf+where)));
-                    } else if (sscanf(buf,"%*s %*s W %u %n", &nr, &where)) {
-                         if (nr > queries.size()) queries.resize(nr);
-                         if (strncmp(buf+where, "create temporary", strlen("create temporary")) == 0 ||
-                             strncmp(buf+where, "drop table", strlen("drop table")) == 0) {
-                              queries[nr-1].push_back(aquery(TEMPTPL, string(buf+where)));
-                         } else {
-                              queries[nr-1].push_back(aquery(WRITE, string(buf+where)));
-                         }
-                    } else {
-                         cout << "Ignored unknown line " << buf;
-                    }
-               }
-               fclose(f);
+               load_trace();
+               find_writes();
+               find_shard_keys();
           }
           ABORTIF(pthread_mutex_unlock(&gtid_m));
 
           newtid();
           //force a new tid selection next time
-          it = queries[tid].begin();
+          if (tid < tid_end())
+               it = queries[tid].begin();
      }
 
      /**
@@ -225,10 +651,10 @@ public:
         sleep, 0 if stop), t = query to execute next
       */
      const struct aquery* getnext(resultset_t* res, int *sleeptime) {
-          if (it == queries[tid].end() || tid >= queries.size()) {
+          if (tid >= tid_end() || it == queries[tid].end()) {
                newtid();
                ntid = 1;
-               if (tid >= queries.size()) {
+               if (tid >= tid_end()) {
                     *sleeptime = 0;
                     return &(*it); //invalid
                }
@@ -268,6 +694,88 @@ static const char* sarpath = "/usr/local/bin/sar"; ///< path to sar
 static const char* sshpath = "/usr/bin/ssh"; ///< path to ssh
 static const char* saroptions[6] = { "-n", "DEV", "-n", "SOCK", "-rubcw", "1" }; ///< options to sar
 static int NRTHR = 3; ///< default number of concurrent threads
+
+/** A database server transactions can be routed to */
+struct backend {
+     string name; ///< As given with --backends
+     string host; ///< Host to connect to
+     unsigned int port; ///< TCP port, 0 for the default
+     string sock; ///< Unix socket, empty for none
+};
+
+/** How transactions are spread over the backends */
+enum route_t {
+     ROUTE_HASH, ///< consistent hash of the shard key over all backends
+     ROUTE_RW ///< transactions with writes to the first backend, the others hashed over the rest
+};
+
+static vector<backend> backends; ///< the servers to run the transactions on, see --backends
+static route_t route = ROUTE_HASH; ///< how transactions are spread over the backends
+static const int VNODES = 100; ///< points on the hash ring per backend, evens out the load
+static vector< pair<uint64_t, int> > ring; ///< consistent hash ring, (point, backend) sorted by point
+
+/**
+   Parse --backends: a comma separated list of host, host:port or the
+   path of a unix socket
+
+   @return false if a backend is malformed
+*/
+static bool parse_backends(const char* list) {
+     char* tmp = strdup(list);
+     for (char* tok = strtok(tmp, ","); tok; tok = strtok(NULL, ",")) {
+          backend b;
+          b.name = tok;
+          b.port = 0;
+          if (tok[0] == '/') {
+               b.host = "localhost";
+               b.sock = tok;
+          } else {
+               char* port = rindex(tok, ':');
+               if (port) {
+                    *port++ = '\0';
+                    b.port = atoi(port);
+                    if (!b.port) {
+                         free(tmp);
+                         return false;
+                    }
+               }
+               b.host = tok;
+          }
+          backends.push_back(b);
+     }
+     free(tmp);
+     return !backends.empty() && (int)backends.size() <= MAXBACKENDS;
+}
+
+/**
+   Put every backend the transactions are hashed over on the ring, each
+   at VNODES points derived from its name, so adding or removing a
+   backend moves only the keys next to its points
+*/
+static void build_ring() {
+     unsigned int first = route == ROUTE_RW && backends.size() > 1 ? 1 : 0;
+     for (unsigned int b = first; b < backends.size(); b++)
+          for (int v = 0; v < VNODES; v++)
+               ring.push_back(make_pair(mix64(hashstr(backends[b].name) + v), (int)b));
+     sort(ring.begin(), ring.end());
+}
+
+/**
+   @return the backend transaction \a tid runs on, from its shard key,
+   see find_shard_keys()
+*/
+static int route_txn(unsigned int tid) {
+     if (backends.size() == 1)
+          return 0;
+     if (route == ROUTE_RW && tid < txn_writes.size() && txn_writes[tid])
+          return 0;
+     uint64_t h = tid < txn_keys.size() ? txn_keys[tid] : mix64(tid);
+     vector< pair<uint64_t, int> >::const_iterator it =
+          lower_bound(ring.begin(), ring.end(), make_pair(h, 0));
+     if (it == ring.end())
+          it = ring.begin();
+     return it->second;
+}
 static int delayedstart = 0; ///< Shall we start threads all at once or delayed
 
 static int monitor_threads_len = 0; ///< only global because of signal handler
@@ -279,6 +787,125 @@ static pthread_mutex_t sync_m =  PTHREAD_MUTEX_INITIALIZER; ///< mutex to protec
 static volatile int sync_i; ///< number of worker threads remaining to start
 static volatile int done = 0; ///< indicator of if we are stopping (0=no, 1=yes, timeout, 2=yes,trace complete)
 
+static int coordport = 0; ///< port to wait for agents on (0 = not a coordinator)
+static int nagents = 0; ///< number of agents the coordinator splits the run across
+static const char* coordhost = NULL; ///< host:port of the coordinator if we are an agent
+static FILE* ctrl_in = NULL; ///< commands from the coordinator (agent only)
+static FILE* ctrl_out = NULL; ///< replies to the coordinator (agent only)
+
+/**
+   Read a line from a coordinator connection without the newline
+
+   @return 1 if a line was read, 0 on EOF, -1 if interrupted by a signal
+*/
+static int readline(FILE* f, char* buf, int len) {
+     if (!fgets(buf, len, f)) {
+          if (ferror(f) && errno == EINTR) {
+               clearerr(f);
+               return -1;
+          }
+          return 0;
+     }
+     char* p = rindex(buf, '\n');
+     if (p) *p = '\0';
+     return 1;
+}
+
+/**
+   Connect to the coordinator, retrying for ten seconds so agents can
+   be started before it
+
+   @param hostport the coordinator as host:port
+   @return the connected socket
+*/
+static int connect_coordinator(const char* hostport) {
+     char* h = strdup(hostport);
+     char* port = rindex(h, ':');
+     if (!port)
+          MSGABORT("Expected host:port of the coordinator, got " << hostport);
+     *port++ = '\0';
+
+     struct addrinfo hints, *ai;
+     memset(&hints, 0, sizeof(hints));
+     hints.ai_family = AF_UNSPEC;
+     hints.ai_socktype = SOCK_STREAM;
+     int rc = getaddrinfo(h, port, &hints, &ai);
+     if (rc)
+          MSGABORT("Can not resolve " << h << ": " << gai_strerror(rc));
+
+     int fd = -1;
+     for (int tries = 0; fd == -1 && tries < 100 && !done; tries++) {
+          for (struct addrinfo* a = ai; a; a = a->ai_next) {
+               fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+               if (fd == -1)
+                    continue;
+               if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+                    break;
+               close(fd);
+               fd = -1;
+          }
+          if (fd == -1)
+               usleep(100000);
+     }
+     freeaddrinfo(ai);
+     free(h);
+     if (fd == -1)
+          EABORT();
+
+     int one = 1;
+     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+     return fd;
+}
+
+/** Sleep until the wall clock reaches \a when, or a signal tells us to stop */
+static void sleep_until(const struct timeval& when) {
+     struct timeval now, left;
+     while (!done) {
+          gettimeofday(&now, NULL);
+          gettimediffs(left, when, now);
+          if (left.tv_sec < 0)
+               break;
+          struct timespec ts = { left.tv_sec, left.tv_usec * 1000 };
+          if (nanosleep(&ts, NULL) == 0)
+               break;
+     }
+}
+
+/**
+   Sleep through one phase of the run. Like sleep(), a signal ends it
+   early. Agents also end it when the coordinator says STOP or goes away.
+
+   @param sec length of the phase in seconds
+*/
+static void phase_sleep(long sec) {
+     if (!ctrl_in) {
+          sleep(sec);
+          return;
+     }
+     struct timeval end, now, left;
+     gettimeofday(&end, NULL);
+     end.tv_sec += sec;
+     while (!done) {
+          gettimeofday(&now, NULL);
+          gettimediffs(left, end, now);
+          if (left.tv_sec < 0)
+               break;
+          struct pollfd p;
+          p.fd = fileno(ctrl_in);
+          p.events = POLLIN;
+          int rc = poll(&p, 1, left.tv_sec * 1000 + left.tv_usec / 1000);
+          if (rc == 0)
+               break;
+          if (rc < 0)
+               continue;
+          char line[64];
+          if (readline(ctrl_in, line, sizeof(line)) == 0 || strcmp(line, "STOP") == 0) {
+               cout << "Stopped by coordinator" << endl;
+               done = 1;
+          }
+     }
+}
+
 /**
    Monitor host for a given period
 
@@ -359,31 +986,54 @@ static pid_t mymonitor_thr(string &h, long ut, long rt, long dt) {
 }
 
 
+/** What a worker thread is started with */
+struct worker_arg {
+     int clientid; ///< The clientid for the thread
+     unsigned int seed; ///< The random seed for the thread
+     int startdelay; ///< msec after the start before the first transaction (--dstart of an agent)
+};
+
 /**
    Worker thread start function
 
-   @param \a resultparam is a resultset_t*
+   @param \a param is a worker_arg*, the thread returns its resultset_t*
  */
-static void* start_new(void* resultparam) {
-     resultset_t* res = (resultset_t*) resultparam;
+static void* start_new(void* param) {
+     // allocated by the thread itself, so that its results and histograms
+     // are first touched on the numa node it is pinned to
+     struct worker_arg* arg = (struct worker_arg*) param;
+     resultset_t* res = new resultset_t(arg->clientid);
+     res->seed = arg->seed;
+     int startdelay = arg->startdelay;
+     delete arg;
      srand(res->seed);
 
      //hack to disable libmysqlclient's debug since it spends almost 25% of total running time
      extern int _no_db_;
      _no_db_ = 1;
 
-     MYSQL dbase;
-     mysql_init(&dbase);
+     // one connection to every backend, opened before the start so it is not measured
+     struct connection {
+          MYSQL db; ///< The connection
+          MYSQL_STMT* stmt; ///< The prepared select, kept for reuse
+     };
+     connection* conns = new connection[backends.size()];
      ABORTIF(pthread_mutex_lock(&sync_m));
      
-     if (!mysql_real_connect(&dbase, host, user, pass, database, 0, mysqlsock, 0)) {
-         cout << mysql_error(&dbase) << endl;
-         MSGABORT("Connection failed to database");
+     for (unsigned int b = 0; b < backends.size(); b++) {
+          MYSQL& dbase = conns[b].db;
+          conns[b].stmt = NULL;
+          mysql_init(&dbase);
+          if (!mysql_real_connect(&dbase, backends[b].host.c_str(), user, pass, database, backends[b].port,
+                                  backends[b].sock.empty() ? NULL : backends[b].sock.c_str(), 0)) {
+               cout << mysql_error(&dbase) << endl;
+               MSGABORT("Connection failed to database " << backends[b].name);
+          }
      }
 
      cout << "." << flush;
 
-     if (!delayedstart) {
+     if (!delayedstart || ctrl_out) {
           //     cout << "Starting " << getpid() << endl;
 //          ABORTIF(pthread_mutex_lock(&sync_m));
           sync_i--;
@@ -396,14 +1046,38 @@ static void* start_new(void* resultparam) {
      else {
           ABORTIF(pthread_mutex_unlock(&sync_m));
      }
+     if (startdelay) {
+          struct timeval until = start_tv;
+          until.tv_sec += startdelay / 1000;
+          until.tv_usec += startdelay % 1000 * 1000;
+          if (until.tv_usec >= 1000000) {
+               until.tv_sec++;
+               until.tv_usec -= 1000000;
+          }
+          // in slices, the signals that set done go to the main thread
+          struct timeval now, left;
+          while (!done) {
+               gettimeofday(&now, NULL);
+               gettimediffs(left, until, now);
+               if (left.tv_sec < 0)
+                    break;
+               usleep(left.tv_sec ? 100000 : min(left.tv_usec, 100000L));
+          }
+     }
 
-     class SQLGenerator gen(&dbase);
+     class SQLGenerator gen(&conns[0].db);
 
-     mysql_autocommit(&dbase, 0);
+     for (unsigned int b = 0; b < backends.size(); b++)
+          mysql_autocommit(&conns[b].db, 0);
 
+     unsigned int rseed = res->seed; // for the backoff jitter
      while (true) {
 
           struct timeval t_start, t_end;
+          struct timeval txn_start; // first statement of the current transaction
+          bool intxn = 0; // txn_start is set
+          int attempt = 0; // restarts of the current transaction
+          int cur = 0; // backend of the current transaction
           bool pending = 0;
           int sleeptime;
           while(true) {
@@ -413,21 +1087,34 @@ static void* start_new(void* resultparam) {
                int row = 0;
 
                //catch uncompleted transactions
-               if (pending && gen.last_stm_was_new_tid())
-                    mysql_rollback(&dbase);
+               if (gen.last_stm_was_new_tid()) {
+                    if (pending)
+                         mysql_rollback(&conns[cur].db);
+                    intxn = 0;
+                    attempt = 0;
+               }
+               if (!intxn)
+                    cur = route_txn(gen.current());
+               MYSQL& dbase = conns[cur].db;
 
                MYSQL_RES  *result = 0;
+               unsigned int err = 0; // server error of the statement
                gettimeofday(&t_start, NULL);
+               if (!intxn) {
+                    txn_start = t_start;
+                    intxn = 1;
+               }
                switch (q->t) {
                case BEGIN:
                     // mysql doc says it is an implicit commit
                     pending = 0;
                     if (mysql_query(&dbase, "begin"))
-                         MABORT();
+                         err = mysql_errno(&dbase);
                     break;
                case COMMIT:
                     pending = 0;
-                    mysql_commit(&dbase);
+                    if (mysql_commit(&dbase))
+                         err = mysql_errno(&dbase);
                     break;
                case ROLLBACK:
                     pending = 0;
@@ -447,10 +1134,8 @@ static void* start_new(void* resultparam) {
                         mysql_free_result(result);
                     } else {
                         //cout << q->q.c_str();
-                        static MYSQL_STMT *stmt[10] = { NULL, NULL, NULL, NULL,
-                                                        NULL, NULL, NULL, NULL,
-                                                        NULL, NULL };
-                        int id = res->clientid;
+                        MYSQL_STMT **stmt = &conns[cur].stmt;
+                        int id = 0;
                         if (!stmt[id]) {
                             stmt[id] = mysql_prepare(&dbase, q->q.c_str(), strlen(q->q.c_str()));
                         }
@@ -475,7 +1160,9 @@ static void* start_new(void* resultparam) {
                         int column_count = mysql_num_fields(result);
                         assert(column_count == 4);
                         if (mysql_execute(stmt[id])) {
-                            MABORT();
+                            err = mysql_stmt_errno(stmt[id]);
+                            mysql_free_result(result);
+                            break;
                         }
                         MYSQL_BIND result_bind[4];
                         int result_data[4];
@@ -507,16 +1194,20 @@ static void* start_new(void* resultparam) {
                     break;
                case TEMPTPL:
                     pending = 1;
-                    if (mysql_query(&dbase, q->q.c_str()))
-                         MABORT();
+                    if (mysql_query(&dbase, q->q.c_str())) {
+                         err = mysql_errno(&dbase);
+                         break;
+                    }
                     result = mysql_store_result(&dbase);
                     mysql_free_result(result);
                     break;
                case WRITE:
                     pending = 1;
                     if (allowwrite) {
-                         if (mysql_query(&dbase, q->q.c_str()))
-                              MABORT();
+                         if (mysql_query(&dbase, q->q.c_str())) {
+                              err = mysql_errno(&dbase);
+                              break;
+                         }
                          result = mysql_store_result(&dbase);
                          mysql_free_result(result);
                     }
@@ -524,7 +1215,35 @@ static void* start_new(void* resultparam) {
                }
 
                gettimeofday(&t_end, NULL);
-               res->update(new struct result(q, dbase.last_used_con->host, t_start, t_end));
+               if (err) {
+                    if (!retryable(err)) {
+                         cout << "Fatal error " << err << " in " << stm_names[q->t] << " \"" << q->q << "\": ";
+                         MABORT();
+                    }
+                    // the server rolled back the transaction (or the statement), run it again
+                    mysql_rollback(&dbase);
+                    pending = 0;
+                    res->failed(err, attempt < maxretries);
+                    if (attempt < maxretries) {
+                         attempt++;
+                         backoff(attempt, &rseed);
+                         gen.restart();
+                    }
+                    else {
+                         attempt = 0;
+                         intxn = 0;
+                         gen.skip();
+                    }
+                    if (done == 1)
+                         break;
+                    continue;
+               }
+               res->update(new struct result(q, dbase.last_used_con->host, t_start, t_end), cur);
+               if (q->t == COMMIT || q->t == ROLLBACK) {
+                    res->txn(q->t, txn_start, t_end, cur);
+                    intxn = 0;
+                    attempt = 0;
+               }
 
                if (sleeptime != -1)
                     usleep(sleeptime);
@@ -533,14 +1252,16 @@ static void* start_new(void* resultparam) {
           } //for queries
 
           if (pending)
-               mysql_rollback(&dbase);
+               mysql_rollback(&conns[cur].db);
           if (!repeatlog && !done)
                done = 2;
           if (done)
                break;
           gen.reinit();
      }
-     mysql_close(&dbase);
+     for (unsigned int b = 0; b < backends.size(); b++)
+          mysql_close(&conns[b].db);
+     delete[] conns;
      return (void*)res;
 }
 
@@ -561,6 +1282,153 @@ void gettimediffs(struct timeval& res, struct timeval &now, struct timeval &last
      }
 }
 
+static vector<int> worker_cpus; ///< cpus the workers may be pinned to, see --cpus
+static vector<int> reserved_cpus; ///< cpus of the main thread and the monitors, see --reserve
+static bool numaplace = 0; ///< spread the workers evenly over the numa nodes
+static vector<int> placement; ///< cpu of each worker thread, round robin (empty = not pinned)
+
+/**
+   Parse a cpu list like "0-3,8,10-11" as found in sysfs
+
+   @return false if \a list is malformed
+*/
+static bool parse_cpulist(const char* list, vector<int>& cpus) {
+     const char* p = list;
+     while (*p && *p != '\n') {
+          char* end;
+          long lo = strtol(p, &end, 10), hi = lo;
+          if (end == p || lo < 0)
+               return false;
+          if (*end == '-') {
+               p = end + 1;
+               hi = strtol(p, &end, 10);
+               if (end == p || hi < lo)
+                    return false;
+          }
+          for (long c = lo; c <= hi && c < CPU_SETSIZE; c++)
+               cpus.push_back(c);
+          p = end;
+          if (*p == ',')
+               p++;
+          else if (*p && *p != '\n')
+               return false;
+     }
+     return true;
+}
+
+/** @return the numa node of every cpu, all on node 0 without numa support */
+static vector<int> cpu_nodes() {
+     vector<int> node(CPU_SETSIZE, 0);
+     DIR* d = opendir("/sys/devices/system/node");
+     if (!d)
+          return node;
+     struct dirent* e;
+     while ((e = readdir(d))) {
+          int n;
+          if (sscanf(e->d_name, "node%d", &n) != 1)
+               continue;
+          char fname[300], buf[4096];
+          snprintf(fname, sizeof(fname), "/sys/devices/system/node/%s/cpulist", e->d_name);
+          FILE* f = fopen(fname, "r");
+          if (!f)
+               continue;
+          vector<int> cpus;
+          if (fgets(buf, sizeof(buf), f) && parse_cpulist(buf, cpus))
+               for (unsigned int i = 0; i < cpus.size(); i++)
+                    node[cpus[i]] = n;
+          fclose(f);
+     }
+     closedir(d);
+     return node;
+}
+
+/**
+   Decide which cpu each worker runs on and move the main thread, and so
+   the monitors it forks, to the reserved cpus
+
+   Without --cpus the workers use every cpu we may run on except the
+   reserved ones. With --numa consecutive workers go to different nodes,
+   so each node gets the same share of them.
+*/
+static void place_threads(std::ostream& logfile) {
+     if (worker_cpus.empty() && reserved_cpus.empty() && !numaplace)
+          return;
+
+     cpu_set_t allowed;
+     CPU_ZERO(&allowed);
+     ERR(sched_getaffinity(0, sizeof(allowed), &allowed), "Can not get cpu affinity");
+     vector<int> cpus = worker_cpus;
+     if (cpus.empty())
+          for (int c = 0; c < CPU_SETSIZE; c++)
+               if (CPU_ISSET(c, &allowed) &&
+                   find(reserved_cpus.begin(), reserved_cpus.end(), c) == reserved_cpus.end())
+                    cpus.push_back(c);
+     if (cpus.empty())
+          MSGABORT("No cpus left for the workers");
+
+     vector<int> node = cpu_nodes();
+     if (numaplace) {
+          // deal the cpus out node by node
+          vector< vector<int> > bynode;
+          for (unsigned int i = 0; i < cpus.size(); i++) {
+               if ((unsigned int)node[cpus[i]] >= bynode.size())
+                    bynode.resize(node[cpus[i]] + 1);
+               bynode[node[cpus[i]]].push_back(cpus[i]);
+          }
+          unsigned int total = cpus.size();
+          cpus.clear();
+          for (unsigned int k = 0; cpus.size() < total; k++)
+               for (unsigned int n = 0; n < bynode.size(); n++)
+                    if (k < bynode[n].size())
+                         cpus.push_back(bynode[n][k]);
+     }
+     placement = cpus;
+     for (int i = 0; i < NRTHR; i++) {
+          int c = placement[i % placement.size()];
+          logfile << "thread " << i << ": cpu " << c << " node " << node[c] << endl;
+     }
+
+     if (!reserved_cpus.empty()) {
+          cpu_set_t set;
+          CPU_ZERO(&set);
+          for (unsigned int i = 0; i < reserved_cpus.size(); i++)
+               CPU_SET(reserved_cpus[i], &set);
+          ERR(sched_setaffinity(0, sizeof(set), &set), "Can not pin main thread to reserved cpus");
+          logfile << "reserved cpus:";
+          for (unsigned int i = 0; i < reserved_cpus.size(); i++)
+               logfile << " " << reserved_cpus[i];
+          logfile << endl;
+     }
+}
+
+/**
+   Start a worker thread, pinned to its cpu if there is a placement
+
+   @param thr where to store the thread
+   @param i the clientid of the thread
+   @param seed the random seed of the thread
+   @param startdelay msec after the start before its first transaction
+   @return the status of pthread_create
+*/
+static int create_worker(pthread_t* thr, int i, unsigned int seed, int startdelay) {
+     struct worker_arg* arg = new worker_arg;
+     arg->clientid = i;
+     arg->seed = seed;
+     arg->startdelay = startdelay;
+
+     pthread_attr_t attr;
+     ABORTIF(pthread_attr_init(&attr));
+     if (!placement.empty()) {
+          cpu_set_t set;
+          CPU_ZERO(&set);
+          CPU_SET(placement[i % placement.size()], &set);
+          ABORTIF(pthread_attr_setaffinity_np(&attr, sizeof(set), &set));
+     }
+     int status = pthread_create(thr, &attr, start_new, arg);
+     pthread_attr_destroy(&attr);
+     return status;
+}
+
 /**
    Our signal handler, which is being used to catch SIGTERM and SIGINT with.
 
@@ -595,6 +1463,198 @@ static void signal_handler(int signal)
      }
 }
 
+/**
+   Write the statistics of a whole run to the output directory and summarize them
+
+   @param st statistics merged over all threads (and agents)
+   @param logfile the params.log of the run
+*/
+static void write_stats(const runstats& st, std::ostream& logfile) {
+     ofstream hfile("histogram", ios::out | ios::trunc);
+     st.write_histogram(hfile);
+     hfile.close();
+     ofstream tfile("timeline", ios::out | ios::trunc);
+     st.write_timeline(tfile);
+     tfile.close();
+     st.summary(cout);
+     st.summary(logfile);
+}
+
+/**
+   Tell the agents to stop (those still running end their run early and
+   the others give up waiting) and close the connections to them
+
+   @param ins, outs the connections to the agents, emptied
+*/
+static void stop_agents(vector<FILE*>& ins, vector<FILE*>& outs) {
+     for (unsigned int i = 0; i < outs.size(); i++) {
+          fprintf(outs[i], "STOP\n");
+          fclose(outs[i]);
+          fclose(ins[i]);
+     }
+     ins.clear();
+     outs.clear();
+}
+
+/**
+   Run as coordinator: split the trace and the schedule across nagents
+   agents, release them all at the same instant and merge what they
+   measured.
+
+   Agents connect and say "HELLO <threads>". Each is sent "SCHED <index>
+   <agents> <first tid> <end tid> <rampup> <runtime> <rampdown> <seed>
+   <first thread>", connects its workers and answers "READY". When all
+   are ready they are sent "GO <sec> <usec>", the wall clock instant to
+   start at, so the clocks of the load machines must be synchronized.
+   At the end each agent sends "STATS <last tid>", its raw counters and
+   "END". "STOP" ends the run of every agent early.
+
+   @return exit code of the program
+*/
+static int run_coordinator(long rampuptime, long runtime, long rampdowntime,
+                           unsigned int seed, ofstream& logfile) {
+     load_trace();
+     unsigned int ntrans = queries.size();
+
+     int lfd = socket(AF_INET, SOCK_STREAM, 0);
+     if (lfd == -1)
+          EABORT();
+     int one = 1;
+     setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+     struct sockaddr_in addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_ANY);
+     addr.sin_port = htons(coordport);
+     ERR(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)), "Can not bind to port " << coordport);
+     ERR(listen(lfd, nagents), "Can not listen");
+
+     cout << "Waiting for " << nagents << " agents on port " << coordport << endl;
+     vector<FILE*> ins, outs;
+     vector<unsigned int> nthreads;
+     char line[256];
+     while ((int)ins.size() < nagents) {
+          int fd = accept(lfd, NULL, NULL);
+          if (done) {
+               if (fd != -1)
+                    close(fd);
+               close(lfd);
+               stop_agents(ins, outs);
+               cout << "Early finish" << endl;
+               logfile << "Early finish" << endl;
+               logfile.close();
+               return 1;
+          }
+          if (fd == -1) {
+               if (errno == EINTR)
+                    continue;
+               EABORT();
+          }
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          FILE* in = fdopen(fd, "r");
+          FILE* out = fdopen(dup(fd), "w");
+          unsigned int n;
+          if (readline(in, line, sizeof(line)) <= 0 || sscanf(line, "HELLO %u", &n) != 1) {
+               cout << "Ignored agent saying " << line << endl;
+               fclose(in);
+               fclose(out);
+               continue;
+          }
+          ins.push_back(in);
+          outs.push_back(out);
+          nthreads.push_back(n);
+          cout << "." << flush;
+     }
+     close(lfd);
+     cout << endl;
+
+     unsigned int threadbase = 0;
+     for (int i = 0; i < nagents; i++) {
+          unsigned int lo = (unsigned long long)ntrans * i / nagents;
+          unsigned int hi = (unsigned long long)ntrans * (i + 1) / nagents;
+          fprintf(outs[i], "SCHED %d %d %u %u %ld %ld %ld %u %u\n", i, nagents, lo, hi,
+                  rampuptime, runtime, rampdowntime, seed, threadbase);
+          fflush(outs[i]);
+          logfile << "agent " << i << ": threads " << threadbase << "-" << threadbase + nthreads[i] - 1
+                  << " transactions " << lo << "-" << hi << endl;
+          threadbase += nthreads[i];
+     }
+     logfile << "nr_threads total: " << threadbase << endl;
+
+     for (int i = 0; i < nagents; i++) {
+          int rc;
+          while ((rc = readline(ins[i], line, sizeof(line))) < 0 && !done)
+               ;
+          if (done || rc == 0 || strcmp(line, "READY")) {
+               if (done) {
+                    cout << "Early finish" << endl;
+                    logfile << "Early finish" << endl;
+               }
+               else {
+                    cout << "Agent " << i << " did not get ready" << endl;
+                    logfile << "Agent " << i << " did not get ready" << endl;
+               }
+               stop_agents(ins, outs);
+               logfile.close();
+               return 1;
+          }
+     }
+
+     // leave the agents enough time to receive GO before the instant arrives
+     gettimeofday(&start_tv, NULL);
+     start_tv.tv_usec += 500000;
+     if (start_tv.tv_usec >= 1000000) {
+          start_tv.tv_sec++;
+          start_tv.tv_usec -= 1000000;
+     }
+     for (int i = 0; i < nagents; i++) {
+          fprintf(outs[i], "GO %ld %ld\n", (long)start_tv.tv_sec, (long)start_tv.tv_usec);
+          fflush(outs[i]);
+     }
+     cout << "Starting test" << endl;
+
+     runstats total;
+     bool stopped = 0;
+     for (int i = 0; i < nagents; i++) {
+          runstats* st = new runstats;
+          while (true) {
+               int rc = readline(ins[i], line, sizeof(line));
+               if (rc < 0) {
+                    if (done && !stopped) {
+                         cout << "Early finish" << endl;
+                         logfile << "Early finish" << endl;
+                         for (int j = 0; j < nagents; j++) {
+                              fprintf(outs[j], "STOP\n");
+                              fflush(outs[j]);
+                         }
+                         stopped = 1;
+                    }
+                    continue;
+               }
+               if (rc == 0) {
+                    cout << "Lost agent " << i << endl;
+                    logfile << "Lost agent " << i << endl;
+                    break;
+               }
+               unsigned int last;
+               if (sscanf(line, "STATS %u", &last) == 1)
+                    logfile << "agent " << i << ": last tid requested " << last << endl;
+               else if (strcmp(line, "END") == 0)
+                    break;
+               else if (!st->recv(line))
+                    cout << "Ignored line from agent " << i << ": " << line << endl;
+          }
+          total.merge(*st);
+          delete st;
+          fclose(ins[i]);
+          fclose(outs[i]);
+     }
+
+     write_stats(total, logfile);
+     logfile.close();
+     return 0;
+}
+
 int main(int argc, char** argv) {
      unsigned int seed = time(NULL);
      char pathname[2048];
@@ -617,6 +1677,7 @@ int main(int argc, char** argv) {
      long rampuptime = 0;
      long runtime = 0;
      long rampdowntime = 0;
+     struct timeval measure_tv = { 0, 0 }; // end of the rampup
 
      vector<string> monitor_hosts;
      char* outputdir=NULL;
@@ -647,6 +1708,50 @@ int main(int argc, char** argv) {
                pass = argv[++i];
           else if (strcmp(argv[i], "--database") == 0)
                database = argv[++i];
+          else if (strcmp(argv[i], "--retries") == 0)
+               maxretries = atoi(argv[++i]);
+          else if (strcmp(argv[i], "--backoff") == 0)
+               backoffms = atoi(argv[++i]);
+          else if (strcmp(argv[i], "--retryable") == 0) {
+               char * tmp = strdup(argv[++i]);
+               char* tok = strtok(tmp, ",");
+               while(tok) {
+                    retry_errors.push_back(atoi(tok));
+                    tok = strtok(NULL, ",");
+               }
+               free(tmp);
+          }
+          else if (strcmp(argv[i], "--backends") == 0) {
+               if (!parse_backends(argv[++i]))
+                    MSGABORT("Bad backend list " << argv[i]);
+          }
+          else if (strcmp(argv[i], "--route") == 0) {
+               ++i;
+               if (strcmp(argv[i], "hash") == 0)
+                    route = ROUTE_HASH;
+               else if (strcmp(argv[i], "rw") == 0)
+                    route = ROUTE_RW;
+               else
+                    MSGABORT("Unknown routing " << argv[i] << ", use hash or rw");
+          }
+          else if (strcmp(argv[i], "--shardkey") == 0)
+               shardkey = argv[++i];
+          else if (strcmp(argv[i], "--cpus") == 0) {
+               if (!parse_cpulist(argv[++i], worker_cpus))
+                    MSGABORT("Bad cpu list " << argv[i]);
+          }
+          else if (strcmp(argv[i], "--reserve") == 0) {
+               if (!parse_cpulist(argv[++i], reserved_cpus))
+                    MSGABORT("Bad cpu list " << argv[i]);
+          }
+          else if (strcmp(argv[i], "--numa") == 0)
+               numaplace = 1;
+          else if (strcmp(argv[i], "--coordinator") == 0)
+               coordport = atoi(argv[++i]);
+          else if (strcmp(argv[i], "--agents") == 0)
+               nagents = atoi(argv[++i]);
+          else if (strcmp(argv[i], "--agent") == 0)
+               coordhost = argv[++i];
           else if (strcmp(argv[i], "--monitor") == 0) {
                char * tmp = strdup(argv[++i]);
                char* tok = strtok(tmp, ":");
@@ -674,10 +1779,35 @@ int main(int argc, char** argv) {
           }
      }
      sync_i = NRTHR;
-
-     if (!rampuptime || !runtime || !rampdowntime || !outputdir || !monitor_hosts.size()) {
+     if (backends.empty()) {
+          backend b;
+          b.name = b.host = host;
+          b.port = 0;
+          b.sock = mysqlsock;
+          backends.push_back(b);
+     }
+     build_ring();
+     if (backends.size() > 1) {
+          if (regcomp(&shardkey_re, shardkey, REG_EXTENDED))
+               MSGABORT("Bad shard key regex " << shardkey);
+          shardkeys = true;
+     }
+     if (retry_errors.empty())
+          retry_errors.assign(default_retry_errors,
+                              default_retry_errors + sizeof(default_retry_errors) / sizeof(default_retry_errors[0]));
+     if (coordport && !nagents)
+          nagents = 1;
+     for (unsigned int i = 0; i < reserved_cpus.size(); i++)
+          if (find(worker_cpus.begin(), worker_cpus.end(), reserved_cpus[i]) != worker_cpus.end())
+               MSGABORT("Cpu " << reserved_cpus[i] << " is both in --cpus and --reserve");
+
+     // agents are told the schedule by the coordinator
+     if ((!coordhost && (!rampuptime || !runtime || !rampdowntime)) || !outputdir ||
+         (!coordport && !coordhost && !monitor_hosts.size())) {
           cout << "Need at least rampuptime runtime rampdown in sec a outputdir and something to monitor (disabled by now)" << endl;
           cout << "Usage: " << argv[0] << " rampup runtime rampdown output_dir" << endl;
+          cout << "       " << argv[0] << " --coordinator port --agents n rampup runtime rampdown output_dir" << endl;
+          cout << "       " << argv[0] << " --agent host:port output_dir" << endl;
           cout << rampuptime << " " << runtime << " " << rampdowntime << " " << outputdir << " " << monitor_hosts.size() << endl;
           exit(1);
      }
@@ -708,11 +1838,39 @@ int main(int argc, char** argv) {
      ERR(sigaction(SIGHUP, &sa, 0), "Error setting signal handler");
      ERR(sigaction(SIGUSR1, &sa, 0), "Error setting signal handler");
 
+     unsigned int threadbase = 0; // number of worker threads run by lower numbered agents
+     if (coordhost) {
+          int fd = connect_coordinator(coordhost);
+          ctrl_in = fdopen(fd, "r");
+          ctrl_out = fdopen(dup(fd), "w");
+          fprintf(ctrl_out, "HELLO %d\n", NRTHR);
+          fflush(ctrl_out);
+
+          char line[256];
+          int idx, n;
+          int rc = readline(ctrl_in, line, sizeof(line));
+          if (done || (rc > 0 && strcmp(line, "STOP") == 0)) {
+               cout << (done ? "Early finish" : "Stopped by coordinator") << endl;
+               return 1;
+          }
+          if (rc <= 0 ||
+              sscanf(line, "SCHED %d %d %u %u %ld %ld %ld %u %u", &idx, &n, &tid_lo, &tid_hi,
+                     &rampuptime, &runtime, &rampdowntime, &seed, &threadbase) != 9)
+               MSGABORT("No schedule from coordinator " << coordhost);
+          gtid = tid_lo;
+          cout << "Agent " << idx << " of " << n << " running transactions "
+               << tid_lo << "-" << tid_hi << endl;
+     }
+
      ofstream logfile("params.log", ios::out | ios::trunc);
      logfile << "nr_threads: " << NRTHR << endl;
      logfile << "repeat: " << repeatlog << endl;
      logfile << "using delayed start: " << delayedstart << endl;
      logfile << "using writes: " << allowwrite << endl;
+     logfile << "retries: " << maxretries << " backoff: " << backoffms << " msec on errors";
+     for (unsigned int i = 0; i < retry_errors.size(); i++)
+          logfile << " " << retry_errors[i];
+     logfile << endl;
      {
           char temp_buf[15];
           snprintf(temp_buf, 15, "%d", sleeptimeg);
@@ -724,12 +1882,28 @@ int main(int argc, char** argv) {
      for (unsigned int i = 0; i < monitor_hosts.size(); i++)
           logfile <<  "monitor: " <<  monitor_hosts[i].c_str() << endl;
      logfile << "db_host: " << host << endl;
+     for (unsigned int i = 0; i < backends.size(); i++)
+          logfile << "backend " << i << ": " << backends[i].name << endl;
+     if (backends.size() > 1)
+          logfile << "route: " << (route == ROUTE_RW ? "rw" : "hash") << " shard key: " << shardkey << endl;
      logfile << "db_user: " << user << endl;
      logfile << "db: " << database << endl;
      logfile << "rampuptime: " << rampuptime << endl;
      logfile << "runtime: " << runtime << endl;
      logfile << "rampdowntime: " << rampdowntime << endl;
 
+     if (coordport) {
+          logfile << "coordinator: port " << coordport << " agents " << nagents << endl;
+          return run_coordinator(rampuptime, runtime, rampdowntime, seed, logfile);
+     }
+     if (coordhost) {
+          logfile << "agent of: " << coordhost << endl;
+          logfile << "transactions: " << tid_lo << "-" << tid_hi << endl;
+          logfile << "first thread: " << threadbase << endl;
+     }
+
+     place_threads(logfile);
+
      pthread_t threads[NRTHR];
      vector<int> starttimes(NRTHR);
      if (delayedstart) {
@@ -738,11 +1912,12 @@ int main(int argc, char** argv) {
                starttimes[i] = static_cast<int>(1000.0*rampuptime/2*rand()/(RAND_MAX+1.0));
           sort(starttimes.begin(), starttimes.end());
      }
-     else {
+     // an agent connects all its workers before it says READY, with
+     // --dstart they hold back their first transaction instead
+     if (!delayedstart || ctrl_out) {
           for (int i = 0; i < NRTHR; i++) {
-               resultset_t* res = new resultset_t(i);
-               res->seed = seed + i + 1;
-               int status = pthread_create(&threads[i], NULL, start_new, res);
+               int status = create_worker(&threads[i], i, seed + threadbase + i + 1,
+                                          delayedstart ? starttimes[i] : 0);
                ABORTIF(status);
           }
 
@@ -772,15 +1947,40 @@ int main(int argc, char** argv) {
      }
 #endif
 
-     if (!delayedstart) {
+     if (ctrl_out) {
+          char line[64];
+          long sec, usec;
+          int rc;
+          fprintf(ctrl_out, "READY\n");
+          fflush(ctrl_out);
+          while ((rc = readline(ctrl_in, line, sizeof(line))) < 0 && !done)
+               ;
+          if (rc > 0 && strcmp(line, "STOP") == 0) {
+               cout << "Stopped by coordinator" << endl;
+               done = 1;
+          }
+          else if (!done) {
+               if (rc == 0 || sscanf(line, "GO %ld %ld", &sec, &usec) != 2)
+                    MSGABORT("Coordinator did not start us");
+               start_tv.tv_sec = sec;
+               start_tv.tv_usec = usec;
+               sleep_until(start_tv);
+          }
+     }
+     if (!start_tv.tv_sec) // not an agent, or stopped before GO
+          gettimeofday(&start_tv, NULL);
+
+     if (!delayedstart || ctrl_out) {
           ABORTIF(pthread_mutex_lock(&cond_m));
           ABORTIF(pthread_cond_broadcast(&cond));
           ABORTIF(pthread_mutex_unlock(&cond_m));
      }
+     if (done)
+          goto early_finish;
 
      cout << "Starting test" << endl;
      //cout << "sleeping " << rampuptime << " milliseconds" << endl;
-     if (delayedstart) {
+     if (delayedstart && !ctrl_out) {
           struct timeval ts,tn;
           int thr = 0;
           gettimeofday(&ts, NULL);
@@ -793,9 +1993,7 @@ int main(int argc, char** argv) {
                     usleep((*it - t) * 1000);
                if (done)
                     goto early_finish;
-               resultset_t* res = new resultset_t(thr);
-               res->seed = seed + thr + 1;
-               int status = pthread_create(&threads[thr], NULL, start_new, res);
+               int status = create_worker(&threads[thr], thr, seed + threadbase + thr + 1, 0);
                ABORTIF(status);
                thr++;
           }
@@ -805,22 +2003,23 @@ int main(int argc, char** argv) {
           usleep(tn.tv_sec*1000000 + tn.tv_usec);
      }
      else {
-          sleep(rampuptime);
+          phase_sleep(rampuptime);
           if (done)
                goto early_finish;
      }
      cout << "rampup finished" << endl;
 
      rampupdone = 1;
+     gettimeofday(&measure_tv, NULL);
 
      // We can recieve a SIGCLD, so that our sleep is interrupted
      //cout << "sleeping " << runtime << " milliseconds" << endl;
-     sleep(runtime);
+     phase_sleep(runtime);
      if (done)
           goto early_finish;
      cout << "running finished" << endl;
      //cout << "sleeping " << rampdowntime << " milliseconds" << endl;
-     sleep(rampdowntime);
+     phase_sleep(rampdowntime);
      if (done)
           goto early_finish;
      cout << "rampdown finished" << endl;
@@ -833,6 +2032,9 @@ early_finish:
           }
      }
      done = 1;
+     struct timeval window;
+     gettimeofday(&window, NULL);
+     gettimediffs(window, window, measure_tv);
 
      for (int i = 0; i < monitor_threads_len; i++) {
           wait(NULL);
@@ -840,16 +2042,30 @@ early_finish:
 
      cout << "Waiting for threads to finish" << endl;
      ofstream qfile("queries", ios::out | ios::trunc);
+     runstats total;
      for (int i = 0; i < NRTHR; i++) {
           resultset_t* res;
           int status = pthread_join(threads[i], (void**)&res);
           ABORTIF(status);
           qfile << *res << endl;
+          total.merge(res->stats);
      }
      qfile.close();
+     if (rampupdone)
+          total.window = window.tv_sec + window.tv_usec / 1000000.0;
 
      cout << "Last tid requested " << gtid << endl;
      logfile << "Last tid requested " << gtid << endl;
+     if (backends.size() > 1)
+          logfile << "transactions with a shard key: " << keyed_txns << " of " << txn_keys.size() << endl;
+     write_stats(total, logfile);
+
+     if (ctrl_out) {
+          fprintf(ctrl_out, "STATS %u\n", gtid);
+          total.send(ctrl_out);
+          fprintf(ctrl_out, "END\n");
+          fflush(ctrl_out);
+     }
 
      if (delayedstart) {
           int thr = 0;
@@ -859,8 +2075,8 @@ early_finish:
 
      logfile.close();
 
-     cout << "Plot graphs with the command: " << endl;
-     cout << pathname << "/gen_graphs.sh " << outputdir << endl;
+     cout << "Analyze the run with the command: " << endl;
+     cout << pathname << "/analyze " << outputdir << endl;
 
      return 0;
 }
@@ -0,0 +1,88 @@
+#!/bin/sh
+#
+# Compression throughput of pbzip2 over generated corpora, for a range of
+# thread counts (-p) and block sizes (-b), with the queue and output
+# statistics of the instrumented build (pbzip2-0.9.4-stats.patch).
+#
+# Everything is set from the environment, e.g.
+#
+#   CORPORA="text random" SIZES="10m 1g" THREADS="1 2 4 8" BLOCKS="1 9" ./bench.sh
+#
+# Every run appends its raw statistics line to $STATS. The table shows,
+# as a share of the wall time of the compression:
+#
+#   cpu    consumers inside BZ2_bzBuffToBuffCompress (per thread)
+#   lock   blocked on fifo->mut (per thread, producer included)
+#   full   producer waiting for room in the queue
+#   empty  consumers waiting for a block (per thread)
+#   stall  output thread waiting for the next block
+#   order  ... while later blocks were already compressed
+#
+# and 'bound' guesses what holds the run back.
+
+PBZIP2=${PBZIP2:-./pbzip2-0.9.4/pbzip2}
+CORPORA=${CORPORA:-"text random"}
+SIZES=${SIZES:-"10m 100m 1g"}
+THREADS=${THREADS:-"1 2 4 8"}
+BLOCKS=${BLOCKS:-"9"}
+CORPUS_DIR=${CORPUS_DIR:-/tmp/pbzip2-corpus}
+STATS=${STATS:-$(pwd)/pbzip2-stats.txt}
+
+if [ ! -x $PBZIP2 ]; then
+	echo "$PBZIP2 not found, build it with 'make pbzip2-stats' first (see INSTALL)"
+	exit 1
+fi
+
+mkdir -p $CORPUS_DIR
+GENCORPUS=$CORPUS_DIR/gencorpus
+if [ ! -x $GENCORPUS ]; then
+	cc -O2 -o $GENCORPUS $(dirname $0)/gencorpus.c || exit 1
+fi
+
+now() {
+	date +%s.%N
+}
+
+printf "%-7s %6s %3s %3s %8s %8s %5s %5s %5s %5s %5s %5s %5s  %s\n" \
+	corpus size -p -b MB/s total_s cpu lock full empty depth stall order bound
+for kind in $CORPORA; do
+	for size in $SIZES; do
+		file=$CORPUS_DIR/$kind-$size
+		if [ ! -f $file ]; then
+			$GENCORPUS $kind $size $file || exit 1
+		fi
+		for b in $BLOCKS; do
+			for n in $THREADS; do
+				t0=$(now)
+				if ! PBZIP_STATS=$STATS $PBZIP2 -q -c -p$n -b$b $file >/dev/null; then
+					echo "pbzip2 failed on $file"
+					exit 1
+				fi
+				t1=$(now)
+				tail -1 $STATS | awk -v kind=$kind -v size=$size -v total="$t0 $t1" '{
+					for (i = 1; i <= NF; i++) {
+						split($i, kv, "=")
+						s[kv[1]] = kv[2]
+					}
+					split(total, t, " ")
+					wall = s["wall"]; n = s["threads"]
+					cpu = s["compress"] / (wall * n)
+					lock = s["lock_wait"] / (wall * (n + 1))
+					full = s["full_wait"] / wall
+					empty = s["empty_wait"] / (wall * n)
+					stall = s["out_stall"] / wall
+					order = s["out_blocked"] / wall
+					if (lock > 0.1) bound = "queue lock"
+					else if (order > 0.2) bound = "in-order output"
+					else if (cpu > 0.8 || full > 0.5) bound = "cpu"
+					else if (empty > 0.3) bound = "input"
+					else bound = "-"
+					printf "%-7s %6s %3d %3d %8.1f %8.3f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f %5.2f  %s\n",
+						kind, size, n, s["blocksize"] / 100000,
+						s["insize"] / wall / 1048576, t[2] - t[1], cpu, lock,
+						full, empty, s["depth_mean"], stall, order, bound
+				}'
+			done
+		done
+	done
+done
@@ -0,0 +1,149 @@
+/*
+ * Corpus generator for the pbzip2 benchmark.
+ *
+ *   gencorpus text|random|mixed <size>[k|m|g] <file>
+ *
+ * 'text' is lines of words drawn with a skewed popularity from a fixed
+ * vocabulary and compresses about 3.5:1 with bzip2, 'random' does not
+ * compress at all, 'mixed' alternates 1MB of each. The output only
+ * depends on the arguments.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUF_SIZE (1 << 20)
+#define NWORDS 4096
+
+static uint64_t g_seed = 0x2545f4914f6cdd1dULL;
+static char* g_words[NWORDS];
+static size_t g_lens[NWORDS];
+
+static inline uint64_t next_rand(void)
+{
+	g_seed ^= g_seed >> 12;
+	g_seed ^= g_seed << 25;
+	g_seed ^= g_seed >> 27;
+	return g_seed * 0x2545f4914f6cdd1dULL;
+}
+
+static void make_words(void)
+{
+	static const char letters[] = "etaoinshrdlucmfwypvbgkqjxz";
+	unsigned int i, j;
+
+	for(i=0; i < NWORDS; ++i) {
+		size_t len = 2 + next_rand() % 9;
+		g_words[i] = malloc(len + 1);
+		/* frequent letters first, like in english */
+		for(j=0; j < len; ++j) {
+			uint64_t r = next_rand();
+			g_words[i][j] = letters[(r % 26) * (r / 26 % 26) / 26];
+		}
+		g_words[i][len] = '\0';
+		g_lens[i] = len;
+	}
+}
+
+static size_t fill_text(char* buf, size_t n)
+{
+	size_t len = 0, col = 0;
+
+	while(len + 12 < n) {
+		/* the smaller of two draws favors the first words */
+		uint64_t a = next_rand() % NWORDS, b = next_rand() % NWORDS;
+		unsigned int w = a < b ? a : b;
+		memcpy(buf + len, g_words[w], g_lens[w]);
+		len += g_lens[w];
+		col += g_lens[w] + 1;
+		if(col > 72) {
+			buf[len++] = '\n';
+			col = 0;
+		} else
+			buf[len++] = ' ';
+	}
+	while(len < n)
+		buf[len++] = '\n';
+	return len;
+}
+
+static void fill_random(char* buf, size_t n)
+{
+	size_t i;
+
+	for(i=0; i + 8 <= n; i += 8) {
+		uint64_t r = next_rand();
+		memcpy(buf + i, &r, 8);
+	}
+	for(; i < n; ++i)
+		buf[i] = (char)next_rand();
+}
+
+static int parse_size(const char* s, uint64_t* size)
+{
+	char* end;
+	uint64_t v = strtoull(s, &end, 10);
+
+	switch(*end) {
+	case 'k': case 'K': v <<= 10; end++; break;
+	case 'm': case 'M': v <<= 20; end++; break;
+	case 'g': case 'G': v <<= 30; end++; break;
+	}
+	if(end == s || *end)
+		return 0;
+	*size = v;
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t size, done = 0;
+	unsigned long chunk = 0;
+	char* buf;
+	FILE* fp;
+	int kind;
+
+	if(argc != 4 || !parse_size(argv[2], &size)) {
+		fprintf(stderr, "usage: %s text|random|mixed <size>[k|m|g] <file>\n", argv[0]);
+		return 1;
+	}
+	if(strcmp(argv[1], "text") == 0)
+		kind = 0;
+	else if(strcmp(argv[1], "random") == 0)
+		kind = 1;
+	else if(strcmp(argv[1], "mixed") == 0)
+		kind = 2;
+	else {
+		fprintf(stderr, "unknown corpus %s\n", argv[1]);
+		return 1;
+	}
+
+	fp = fopen(argv[3], "w");
+	if(!fp) {
+		perror(argv[3]);
+		return 1;
+	}
+	buf = malloc(BUF_SIZE);
+	make_words();
+	while(done < size) {
+		size_t n = size - done < BUF_SIZE ? size - done : BUF_SIZE;
+		if(kind == 0 || (kind == 2 && chunk % 2 == 0))
+			fill_text(buf, n);
+		else
+			fill_random(buf, n);
+		if(fwrite(buf, 1, n, fp) != n) {
+			perror(argv[3]);
+			return 1;
+		}
+		done += n;
+		chunk++;
+	}
+	if(fclose(fp) != 0) {
+		perror(argv[3]);
+		return 1;
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,122 @@
+// Per-operation cost of the locking policies of BasicStringBuffer.
+//
+// For each policy, one thread does append/length/erase on a buffer of
+// its own (the cost every call pays), then a writer thread does
+// erase/append while a reader calls length() on the same buffer (the
+// cost when it is shared). NoLock is only run alone.
+//
+// usage: bench [iterations alone] [seconds shared]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stringbuffer.hpp"
+
+static char abc[] = "abc";
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <class Buffer>
+static double alone(long iters) {
+  Buffer *b = new Buffer(64);
+  long sum = 0;
+  double start = now();
+  for (long i = 0; i < iters; i++) {
+    b->append(abc);
+    sum += b->length();
+    b->erase(0, 3);
+  }
+  double ns = (now() - start) * 1e9 / (iters * 3);
+  if (sum != iters * 3)
+    abort();
+  delete b;
+  return ns;
+}
+
+template <class Buffer>
+struct Shared {
+  Buffer *buffer;
+  volatile bool stop;
+  long writes;
+};
+
+template <class Buffer>
+static void *writer(void *arg) {
+  Shared<Buffer> *s = static_cast<Shared<Buffer> *>(arg);
+  long n = 0;
+  while (!s->stop) {
+    s->buffer->erase(0, 3);
+    s->buffer->append(abc);
+    n += 2;
+  }
+  s->writes = n;
+  return NULL;
+}
+
+template <class Buffer>
+static void shared(double seconds, double *reader_ns, double *writer_ns) {
+  Shared<Buffer> s;
+  pthread_t thd;
+  long reads = 0, sum = 0;
+
+  s.buffer = new Buffer(abc);
+  s.stop = false;
+  s.writes = 0;
+  pthread_create(&thd, NULL, writer<Buffer>, &s);
+  double start = now(), end;
+  do {
+    for (int i = 0; i < 1000; i++)
+      sum += s.buffer->length();
+    reads += 1000;
+  } while ((end = now()) - start < seconds);
+  s.stop = true;
+  pthread_join(thd, NULL);
+  if (sum < 0)
+    abort();
+  *reader_ns = (end - start) * 1e9 / reads;
+  *writer_ns = s.writes ? (end - start) * 1e9 / s.writes : 0;
+  delete s.buffer;
+}
+
+template <class Buffer>
+static void run(const char *name, long iters, double seconds, bool share) {
+  double reader_ns, writer_ns;
+
+  printf("%-12s %10.1f", name, alone<Buffer>(iters));
+  if (share) {
+    shared<Buffer>(seconds, &reader_ns, &writer_ns);
+    printf(" %10.1f %10.1f", reader_ns, writer_ns);
+  } else {
+    printf(" %10s %10s", "-", "-");
+  }
+  printf("\n");
+}
+
+static void *idle(void *arg) {
+  pause();
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  long iters = argc > 1 ? atol(argv[1]) : 10000000;
+  double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+  pthread_t thd;
+
+  // glibc skips the atomics of its mutex while there is one thread
+  pthread_create(&thd, NULL, idle, NULL);
+
+  printf("%-12s %10s %10s %10s\n", "policy", "alone_ns", "reader_ns",
+         "writer_ns");
+  run<UnsyncStringBuffer>("none", iters, seconds, false);
+  run<StringBuffer>("mutex", iters, seconds, true);
+  run<SpinStringBuffer>("spin-futex", iters, seconds, true);
+  run<SeqStringBuffer>("seqlock", iters, seconds, true);
+  return 0;
+}
@@ -0,0 +1,124 @@
+// Locking policies for BasicStringBuffer, chosen at compile time.
+//
+// A policy has Lock()/Unlock() for the calls that change or copy out
+// the buffer, and ReadBegin()/ReadRetry() for the calls that only read
+// a field: a reader loops while ReadRetry() says what it read may be
+// torn. All but SeqLock simply lock around the read.
+
+#ifndef LOCKPOLICY_HPP_
+#define LOCKPOLICY_HPP_
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// For buffers used by one thread only: no synchronization at all.
+class NoLock {
+ public:
+  void Lock() {}
+  void Unlock() {}
+  unsigned ReadBegin() { return 0; }
+  bool ReadRetry(unsigned /* seq */) { return false; }
+};
+
+// The pthread mutex of the original StringBuffer.
+class MutexLock {
+ public:
+  MutexLock() { pthread_mutex_init(&mutex_, NULL); }
+  ~MutexLock() { pthread_mutex_destroy(&mutex_); }
+
+  void Lock() { pthread_mutex_lock(&mutex_); }
+  void Unlock() { pthread_mutex_unlock(&mutex_); }
+  unsigned ReadBegin() { Lock(); return 0; }
+  bool ReadRetry(unsigned /* seq */) { Unlock(); return false; }
+
+ private:
+  pthread_mutex_t mutex_;
+};
+
+// Spins a while for the lock, then sleeps on a futex. The state is 0
+// free, 1 locked, 2 locked with sleepers (Drepper, "Futexes Are
+// Tricky"), so that an uncontended Unlock() makes no system call.
+class SpinFutexLock {
+ public:
+  SpinFutexLock() : state_(0) {}
+
+  void Lock() {
+    int c = 0;
+    if (__atomic_compare_exchange_n(&state_, &c, 1, false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+      return;
+    // spin on loads, which do not take the line away from the owner
+    for (int i = 0; i < kSpins && c != 2; i++) {
+      cpu_relax();
+      c = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+      if (c == 0 && __atomic_compare_exchange_n(&state_, &c, 1, false,
+                                                __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED))
+        return;
+    }
+    c = __atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+      syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+      c = __atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE);
+    }
+  }
+
+  void Unlock() {
+    if (__atomic_fetch_sub(&state_, 1, __ATOMIC_RELEASE) != 1) {
+      __atomic_store_n(&state_, 0, __ATOMIC_RELEASE);
+      syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+  }
+
+  unsigned ReadBegin() { Lock(); return 0; }
+  bool ReadRetry(unsigned /* seq */) { Unlock(); return false; }
+
+ private:
+  static const int kSpins = 100;
+  int state_;
+};
+
+// Writers serialize on a SpinFutexLock and make the sequence odd while
+// they change the buffer; readers take no lock and retry if the
+// sequence moved under them, so they never write a shared cache line.
+class SeqLock {
+ public:
+  SeqLock() : seq_(0) {}
+
+  void Lock() {
+    writer_.Lock();
+    __atomic_store_n(&seq_, seq_ + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+  void Unlock() {
+    __atomic_store_n(&seq_, seq_ + 1, __ATOMIC_RELEASE);
+    writer_.Unlock();
+  }
+
+  unsigned ReadBegin() {
+    unsigned seq;
+    while ((seq = __atomic_load_n(&seq_, __ATOMIC_ACQUIRE)) & 1)
+      cpu_relax();
+    return seq;
+  }
+
+  bool ReadRetry(unsigned seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&seq_, __ATOMIC_RELAXED) != seq;
+  }
+
+ private:
+  SpinFutexLock writer_;
+  unsigned seq_;
+};
+
+#endif
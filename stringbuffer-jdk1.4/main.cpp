@@ -19,7 +19,8 @@ int main(int argc, char *argv[]) {
   rc = pthread_create(&thd, NULL, thread_main, NULL);
 
   while (1) {
-    StringBuffer *sb = new StringBuffer();
+    // only this thread sees it
+    UnsyncStringBuffer *sb = new UnsyncStringBuffer();
     sb->append(buffer);
   }
 
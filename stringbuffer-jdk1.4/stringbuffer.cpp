@@ -4,49 +4,71 @@
 #include "stringbuffer.hpp"
 
 #include <cassert>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-StringBuffer *StringBuffer::null_buffer = new StringBuffer("null");
+template <class LockPolicy>
+BasicStringBuffer<LockPolicy> *BasicStringBuffer<LockPolicy>::null_buffer =
+    new BasicStringBuffer<LockPolicy>("null");
 
-StringBuffer::StringBuffer() {
+template <class LockPolicy>
+BasicStringBuffer<LockPolicy>::BasicStringBuffer() {
   value = new char[16];
   value_length = 16;
   count = 0;
-  pthread_mutex_init(&mutex_lock, NULL);
+  spill_threshold = 0;
+  spill_fd = -1;
 }
 
-StringBuffer::StringBuffer(int length) {
+template <class LockPolicy>
+BasicStringBuffer<LockPolicy>::BasicStringBuffer(int length) {
   value = new char[length];
   value_length = length;
   count = 0;
-  pthread_mutex_init(&mutex_lock, NULL);
+  spill_threshold = 0;
+  spill_fd = -1;
 }
 
-StringBuffer::StringBuffer(char *str) {
+template <class LockPolicy>
+BasicStringBuffer<LockPolicy>::BasicStringBuffer(char *str) {
   int length = strlen(str) + 16;
   value = new char[length];
   value_length = length;
   count = 0;
-  pthread_mutex_init(&mutex_lock, NULL);
+  spill_threshold = 0;
+  spill_fd = -1;
   append(str);
 }
 
-StringBuffer::~StringBuffer() {
-  delete[] value;
+template <class LockPolicy>
+BasicStringBuffer<LockPolicy>::~BasicStringBuffer() {
+  freeValue();
 }
 
-int StringBuffer::length() {
-  pthread_mutex_lock(&mutex_lock);
-  int ret = count;
-  pthread_mutex_unlock(&mutex_lock);
+template <class LockPolicy>
+int BasicStringBuffer<LockPolicy>::length() {
+  int ret;
+  unsigned seq;
+  do {
+    seq = lock.ReadBegin();
+    ret = __atomic_load_n(&count, __ATOMIC_RELAXED);
+  } while (lock.ReadRetry(seq));
   return ret;
 }
 
-void StringBuffer::getChars(int srcBegin, int srcEnd,
-                            char *dst, int dstBegin) {
-  pthread_mutex_lock(&mutex_lock);
+// Copies out of value, which a writer may free: under Lock() for every
+// policy, the seqlock included.
+template <class LockPolicy>
+void BasicStringBuffer<LockPolicy>::getChars(int srcBegin, int srcEnd,
+                                             char *dst, int dstBegin) {
+  lock.Lock();
   if (srcBegin < 0) {
     assert(0);
   }
@@ -57,13 +79,16 @@ void StringBuffer::getChars(int srcBegin, int srcEnd,
     assert(0);
   }
   memcpy(dst + dstBegin, value + srcBegin, srcEnd - srcBegin);
-  pthread_mutex_unlock(&mutex_lock);
+  lock.Unlock();
 }
 
-StringBuffer *StringBuffer::append(StringBuffer *sb) {
-  pthread_mutex_lock(&mutex_lock);
+template <class LockPolicy>
+template <class OtherPolicy>
+BasicStringBuffer<LockPolicy> *BasicStringBuffer<LockPolicy>::append(
+    BasicStringBuffer<OtherPolicy> *sb) {
+  lock.Lock();
   if (sb == NULL) {
-    sb = null_buffer;
+    sb = BasicStringBuffer<OtherPolicy>::null_buffer;
   }
 
   int len = sb->length();
@@ -72,12 +97,14 @@ StringBuffer *StringBuffer::append(StringBuffer *sb) {
     expandCapacity(newcount);
   sb->getChars(0, len, value, count);
   count = newcount;
-  pthread_mutex_unlock(&mutex_lock);
+  lock.Unlock();
   return this;
 }
 
-StringBuffer *StringBuffer::append(char *str) {
-  pthread_mutex_lock(&mutex_lock);
+template <class LockPolicy>
+BasicStringBuffer<LockPolicy> *BasicStringBuffer<LockPolicy>::append(
+    char *str) {
+  lock.Lock();
   if (str == NULL) {
     str = "null";
   }
@@ -88,12 +115,14 @@ StringBuffer *StringBuffer::append(char *str) {
 	    expandCapacity(newcount);
   memcpy(value + count, str, len);
 	count = newcount;
-	pthread_mutex_unlock(&mutex_lock);
+	lock.Unlock();
 	return this;
 }
 
-StringBuffer *StringBuffer::erase(int start, int end) {
-  pthread_mutex_lock(&mutex_lock);
+template <class LockPolicy>
+BasicStringBuffer<LockPolicy> *BasicStringBuffer<LockPolicy>::erase(
+    int start, int end) {
+  lock.Lock();
   if (start < 0)
     assert(0);
   if (end > count)
@@ -106,18 +135,71 @@ StringBuffer *StringBuffer::erase(int start, int end) {
     memcpy(value + start, value + start + len, count - end);
     count -= len;
   }
-  pthread_mutex_unlock(&mutex_lock);
+  lock.Unlock();
   return this;
 }
 
-void StringBuffer::print() {
-  for (int i = 0; i < count; i++) {
-    printf("%c", *(value + i));
+// writev until all of iov is out: 0, or -1 with errno set
+static int writeFully(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
   }
-  printf("\n");
+  return 0;
 }
 
-void StringBuffer::expandCapacity(int minimumCapacity) {
+// One write of the whole contents (more only if fd takes less, like a
+// full pipe), under the lock so that no writer changes them midway.
+template <class LockPolicy>
+int BasicStringBuffer<LockPolicy>::writeTo(int fd) {
+  struct iovec iov;
+  lock.Lock();
+  iov.iov_base = value;
+  iov.iov_len = count;
+  int ret = writeFully(fd, &iov, 1);
+  lock.Unlock();
+  return ret;
+}
+
+template <class LockPolicy>
+void BasicStringBuffer<LockPolicy>::print() {
+  static char newline[] = "\n";
+  struct iovec iov[2];
+  fflush(stdout);
+  lock.Lock();
+  iov[0].iov_base = value;
+  iov[0].iov_len = count;
+  iov[1].iov_base = newline;
+  iov[1].iov_len = 1;
+  writeFully(STDOUT_FILENO, iov, 2);
+  lock.Unlock();
+}
+
+// A buffer that grows to bytes or more moves from the heap to a shared
+// mapping of an unlinked file in $TMPDIR (/tmp), whose pages the kernel
+// can write back instead of keeping them in memory; 0 turns it off.
+template <class LockPolicy>
+void BasicStringBuffer<LockPolicy>::setSpillThreshold(int bytes) {
+  lock.Lock();
+  spill_threshold = bytes;
+  lock.Unlock();
+}
+
+template <class LockPolicy>
+void BasicStringBuffer<LockPolicy>::expandCapacity(int minimumCapacity) {
   int newCapacity = (value_length + 1) * 2;
   if (newCapacity < 0) {
     newCapacity = INTEGER_MAX_VALUE;
@@ -125,10 +207,86 @@ void StringBuffer::expandCapacity(int minimumCapacity) {
     newCapacity = minimumCapacity;
   }
 
+  if (spill_threshold > 0 && newCapacity >= spill_threshold &&
+      spill(newCapacity))
+    return;
+
   char *newValue = new char[newCapacity];
   memcpy(newValue, value, count);
-  delete[] value;
+  freeValue();
   value = newValue;
   value_length = newCapacity;
 }
 
+// Moves value to a mapping of a temp file, or grows the mapping, which
+// needs no copy. False if the file or the mapping cannot be made.
+template <class LockPolicy>
+bool BasicStringBuffer<LockPolicy>::spill(int capacity) {
+  char *newValue;
+
+  if (spill_fd >= 0) {
+    if (ftruncate(spill_fd, capacity) < 0)
+      return false;
+    newValue = (char *)mremap(value, value_length, capacity, MREMAP_MAYMOVE);
+    if (newValue == MAP_FAILED)
+      return false;
+    value = newValue;
+    value_length = capacity;
+    return true;
+  }
+
+  const char *dir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/stringbuffer.XXXXXX",
+           dir && *dir ? dir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return false;
+  unlink(path);
+  if (ftruncate(fd, capacity) < 0) {
+    close(fd);
+    return false;
+  }
+  newValue = (char *)mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+  if (newValue == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  memcpy(newValue, value, count);
+  freeValue();
+  value = newValue;
+  value_length = capacity;
+  spill_fd = fd;
+  return true;
+}
+
+template <class LockPolicy>
+void BasicStringBuffer<LockPolicy>::freeValue() {
+  if (spill_fd >= 0) {
+    munmap(value, value_length);
+    close(spill_fd);
+    spill_fd = -1;
+  } else {
+    delete[] value;
+  }
+}
+
+#define INSTANTIATE_APPEND(P) \
+  template BasicStringBuffer<P> *BasicStringBuffer<P>::append( \
+      BasicStringBuffer<NoLock> *sb); \
+  template BasicStringBuffer<P> *BasicStringBuffer<P>::append( \
+      BasicStringBuffer<MutexLock> *sb); \
+  template BasicStringBuffer<P> *BasicStringBuffer<P>::append( \
+      BasicStringBuffer<SpinFutexLock> *sb); \
+  template BasicStringBuffer<P> *BasicStringBuffer<P>::append( \
+      BasicStringBuffer<SeqLock> *sb);
+
+template class BasicStringBuffer<NoLock>;
+template class BasicStringBuffer<MutexLock>;
+template class BasicStringBuffer<SpinFutexLock>;
+template class BasicStringBuffer<SeqLock>;
+INSTANTIATE_APPEND(NoLock)
+INSTANTIATE_APPEND(MutexLock)
+INSTANTIATE_APPEND(SpinFutexLock)
+INSTANTIATE_APPEND(SeqLock)
@@ -6,31 +6,53 @@
 
 #include <pthread.h>
 
+#include "lockpolicy.hpp"
+
 #define INTEGER_MAX_VALUE 0x7fffffff
 
-class StringBuffer {
+// The locking is a compile time policy (see lockpolicy.hpp): a buffer
+// only one thread uses can be a BasicStringBuffer<NoLock> and pay
+// nothing for it. The definitions are in stringbuffer.cpp, instantiated
+// there for the four policies.
+template <class LockPolicy>
+class BasicStringBuffer {
  public:
-  StringBuffer();
-  explicit StringBuffer(int length);
-  explicit StringBuffer(char *str);
-  ~StringBuffer();
+  BasicStringBuffer();
+  explicit BasicStringBuffer(int length);
+  explicit BasicStringBuffer(char *str);
+  ~BasicStringBuffer();
 
   int length();
   void getChars(int srcBegin, int srcEnd, char *dst, int dstBegin);
-  StringBuffer *append(StringBuffer *sb);
-  StringBuffer *append(char *str);
-  StringBuffer *erase(int start, int end);
+  template <class OtherPolicy>
+  BasicStringBuffer *append(BasicStringBuffer<OtherPolicy> *sb);
+  BasicStringBuffer *append(char *str);
+  BasicStringBuffer *erase(int start, int end);
+  int writeTo(int fd);
   void print();
+  void setSpillThreshold(int bytes);
 
  private:
+  template <class OtherPolicy> friend class BasicStringBuffer;
+
   char *value;
   int value_length;
   int count;
-  pthread_mutex_t mutex_lock;
+  int spill_threshold;  // capacity from which value is a file mapping, 0 never
+  int spill_fd;         // the file of the mapping, -1 on the heap
+  LockPolicy lock;
 
-  static StringBuffer *null_buffer;
+  static BasicStringBuffer *null_buffer;
 
   void expandCapacity(int minimumCapacity);
+  bool spill(int capacity);
+  void freeValue();
 };
 
+// The buffer of the bug, locked with a pthread mutex like the original.
+typedef BasicStringBuffer<MutexLock> StringBuffer;
+typedef BasicStringBuffer<NoLock> UnsyncStringBuffer;
+typedef BasicStringBuffer<SpinFutexLock> SpinStringBuffer;
+typedef BasicStringBuffer<SeqLock> SeqStringBuffer;
+
 #endif
@@ -0,0 +1,717 @@
+/*
+ * HTTP/1.1 load generator.
+ *
+ * The triggers of the web server bugs fork a wget or a shell client for
+ * every request, so most of the time goes to creating processes. This
+ * one keeps persistent connections open instead and drives thousands of
+ * them from a few threads through epoll, with optional pipelining and
+ * extra request headers (e.g. the If-Modified-Since of the Cherokee
+ * trigger). It reports throughput, status codes and latency percentiles.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lathist.h"
+
+#define MAX_HEADERS 32
+#define MAX_URLS 64
+
+unsigned int g_threads = 2;
+unsigned int g_conns = 100;		/* total, spread over the threads */
+unsigned int g_depth = 1;		/* requests in flight per connection */
+unsigned int g_duration = 10;		/* seconds, unless g_requests is set */
+uint64_t g_requests = 0;
+bool g_keepalive = true;
+const char* g_method = "GET";
+const char* g_headers[MAX_HEADERS];
+unsigned int g_nheaders = 0;
+
+static char g_host[256];
+static char g_port[8] = "80";
+static struct sockaddr_storage g_addr;
+static socklen_t g_addrlen;
+
+/* one prepared request per URL, used round robin */
+static char* g_reqs[MAX_URLS];
+static size_t g_reqlens[MAX_URLS];
+static unsigned int g_nreqs = 0;
+
+static volatile bool g_stop = false;
+static uint64_t g_issued = 0;
+
+enum phase {
+	P_STATUS,
+	P_HEADERS,
+	P_BODY,
+	P_CHUNK_SIZE,
+	P_CHUNK_DATA,
+	P_TRAILER,
+	P_UNTIL_CLOSE
+};
+
+struct thread_ctx;
+
+struct conn {
+	int fd;
+	bool connecting;
+	bool polling_out;
+	struct thread_ctx* th;
+	uint64_t retry_at;		/* ns, when fd < 0 */
+	uint64_t backoff;		/* ns */
+	unsigned int next_req;
+
+	char* wbuf;
+	size_t wlen, woff, wcap;
+	char* rbuf;
+	size_t rlen, rcap;
+	uint64_t* sent;			/* ring of g_depth send times */
+	unsigned int qhead, qcount;
+
+	/* response parser */
+	enum phase phase;
+	int status;
+	long long body_left;
+	bool chunked;
+	bool have_length;
+	bool closing;
+};
+
+struct thread_ctx {
+	pthread_t tid;
+	unsigned int nconns;
+	int epfd;
+	struct conn* conns;
+	struct lathist hist;
+	uint64_t status[6];		/* by first digit */
+	uint64_t bytes;
+	uint64_t opened;
+	uint64_t connect_errors;
+	uint64_t resets;
+	uint64_t unanswered;		/* pipelined requests lost to a close */
+};
+
+static void die(const char* what)
+{
+	perror(what);
+	exit(1);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* split http://host[:port]/path, all URLs have to name the same server */
+static void add_url(const char* url)
+{
+	const char* p = url;
+	const char* slash;
+	const char* colon;
+	char host[256], port[8] = "80";
+	char* req;
+	size_t hlen, n, cap;
+	unsigned int i;
+
+	if(strncmp(p, "http://", 7) == 0)
+		p += 7;
+	slash = strchr(p, '/');
+	if(!slash)
+		slash = p + strlen(p);
+	colon = memchr(p, ':', slash - p);
+	hlen = (colon ? colon : slash) - p;
+	if(hlen == 0 || hlen >= sizeof(host)) {
+		fprintf(stderr, "bad url %s\n", url);
+		exit(1);
+	}
+	memcpy(host, p, hlen);
+	host[hlen] = '\0';
+	if(colon) {
+		n = slash - colon - 1;
+		if(n == 0 || n >= sizeof(port)) {
+			fprintf(stderr, "bad url %s\n", url);
+			exit(1);
+		}
+		memcpy(port, colon + 1, n);
+		port[n] = '\0';
+	}
+	if(g_nreqs == 0) {
+		strcpy(g_host, host);
+		strcpy(g_port, port);
+	} else if(strcmp(g_host, host) || strcmp(g_port, port)) {
+		fprintf(stderr, "all urls have to be on %s:%s\n", g_host, g_port);
+		exit(1);
+	}
+	if(g_nreqs == MAX_URLS) {
+		fprintf(stderr, "too many urls\n");
+		exit(1);
+	}
+
+	cap = strlen(g_method) + strlen(slash) + strlen(host) + strlen(port) + 64;
+	for(i=0; i < g_nheaders; ++i)
+		cap += strlen(g_headers[i]) + 2;
+	req = malloc(cap);
+	n = sprintf(req, "%s %s HTTP/1.1\r\nHost: %s%s%s\r\n", g_method,
+		*slash ? slash : "/", host, strcmp(port, "80") ? ":" : "",
+		strcmp(port, "80") ? port : "");
+	for(i=0; i < g_nheaders; ++i)
+		n += sprintf(req + n, "%s\r\n", g_headers[i]);
+	if(!g_keepalive)
+		n += sprintf(req + n, "Connection: close\r\n");
+	n += sprintf(req + n, "\r\n");
+	g_reqs[g_nreqs] = req;
+	g_reqlens[g_nreqs] = n;
+	g_nreqs++;
+}
+
+static void resolve(void)
+{
+	struct addrinfo hints, *ai;
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(g_host, g_port, &hints, &ai);
+	if(rc) {
+		fprintf(stderr, "cannot resolve %s: %s\n", g_host, gai_strerror(rc));
+		exit(1);
+	}
+	memcpy(&g_addr, ai->ai_addr, ai->ai_addrlen);
+	g_addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+}
+
+static void set_events(struct conn* c, bool out)
+{
+	struct epoll_event ev;
+
+	if(out == c->polling_out)
+		return;
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if(epoll_ctl(c->th->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+		die("epoll_ctl");
+	c->polling_out = out;
+}
+
+static void reset_parser(struct conn* c)
+{
+	c->phase = P_STATUS;
+	c->rlen = 0;
+	c->wlen = c->woff = 0;
+	c->qhead = c->qcount = 0;
+}
+
+static void open_conn(struct conn* c)
+{
+	struct epoll_event ev;
+	int one = 1;
+
+	reset_parser(c);
+	c->fd = socket(g_addr.ss_family, SOCK_STREAM, 0);
+	if(c->fd < 0)
+		die("socket");
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->connecting = true;
+	c->polling_out = true;
+	if(connect(c->fd, (struct sockaddr*)&g_addr, g_addrlen) < 0 &&
+			errno != EINPROGRESS)
+		die("connect");
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	if(epoll_ctl(c->th->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+		die("epoll_ctl");
+	c->th->opened++;
+}
+
+/* drop the connection, a new one is opened right away or after a backoff */
+static void close_conn(struct conn* c, bool failed)
+{
+	c->th->unanswered += c->qcount;
+	close(c->fd);
+	c->fd = -1;
+	if(failed) {
+		c->backoff = c->backoff ? c->backoff * 2 : 10000000;
+		if(c->backoff > 1000000000)
+			c->backoff = 1000000000;
+		c->retry_at = now_ns() + c->backoff;
+	} else
+		c->retry_at = 0;
+}
+
+static bool may_issue(void)
+{
+	if(g_stop)
+		return false;
+	if(g_requests && __sync_fetch_and_add(&g_issued, 1) >= g_requests) {
+		g_stop = true;
+		return false;
+	}
+	return true;
+}
+
+static void flush_conn(struct conn* c)
+{
+	while(c->woff < c->wlen) {
+		ssize_t n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				break;
+			c->th->resets++;
+			close_conn(c, true);
+			return;
+		}
+		c->woff += n;
+	}
+	if(c->woff == c->wlen)
+		c->woff = c->wlen = 0;
+	set_events(c, c->wlen > 0);
+}
+
+static void fill_conn(struct conn* c)
+{
+	while(c->qcount < g_depth && !c->closing && may_issue()) {
+		unsigned int r = c->next_req++ % g_nreqs;
+		if(c->wlen + g_reqlens[r] > c->wcap) {
+			while(c->wlen + g_reqlens[r] > c->wcap)
+				c->wcap *= 2;
+			c->wbuf = realloc(c->wbuf, c->wcap);
+			if(!c->wbuf)
+				die("realloc");
+		}
+		memcpy(c->wbuf + c->wlen, g_reqs[r], g_reqlens[r]);
+		c->wlen += g_reqlens[r];
+		c->sent[(c->qhead + c->qcount) % g_depth] = now_ns();
+		c->qcount++;
+	}
+	flush_conn(c);
+}
+
+static void complete(struct conn* c)
+{
+	struct thread_ctx* th = c->th;
+
+	lathist_add(&th->hist, now_ns() - c->sent[c->qhead]);
+	th->status[c->status / 100 < 6 ? c->status / 100 : 0]++;
+	c->qhead = (c->qhead + 1) % g_depth;
+	c->qcount--;
+	c->phase = P_STATUS;
+	c->backoff = 0;
+}
+
+/* body-less response, see RFC 2616 4.4 */
+static bool no_body(int status)
+{
+	return strcmp(g_method, "HEAD") == 0 || status / 100 == 1 ||
+		status == 204 || status == 304;
+}
+
+/*
+ * Run the parser over the read buffer. Returns false if the response
+ * is malformed.
+ */
+static bool parse(struct conn* c)
+{
+	size_t off = 0;
+
+	while(off < c->rlen) {
+		char* p = c->rbuf + off;
+		size_t avail = c->rlen - off;
+		char* eol = NULL;
+		size_t len = 0;
+
+		if(c->phase != P_BODY && c->phase != P_CHUNK_DATA &&
+				c->phase != P_UNTIL_CLOSE) {
+			eol = memchr(p, '\n', avail);
+			if(!eol)
+				break;
+			len = eol - p + 1;
+			off += len;
+		}
+
+		switch(c->phase) {
+		case P_STATUS:
+			if(!c->qcount)
+				return false;
+			if(strncmp(p, "HTTP/1.", 7) != 0 || len < 13)
+				return false;
+			c->status = atoi(p + 9);
+			c->chunked = false;
+			c->have_length = false;
+			c->closing = !g_keepalive || p[7] == '0';
+			c->phase = P_HEADERS;
+			break;
+		case P_HEADERS:
+			if(len <= 2) {
+				if(c->status / 100 == 1) {
+					c->phase = P_STATUS;	/* 100 Continue and friends */
+					break;
+				}
+				if(no_body(c->status))
+					complete(c);
+				else if(c->chunked)
+					c->phase = P_CHUNK_SIZE;
+				else if(c->have_length) {
+					if(c->body_left)
+						c->phase = P_BODY;
+					else
+						complete(c);
+				} else {
+					c->phase = P_UNTIL_CLOSE;
+					c->closing = true;
+				}
+				if(c->phase == P_STATUS && c->closing)
+					goto out;
+			} else if(strncasecmp(p, "Content-Length:", 15) == 0) {
+				c->body_left = atoll(p + 15);
+				c->have_length = true;
+			} else if(strncasecmp(p, "Transfer-Encoding:", 18) == 0) {
+				if(memmem(p, len, "chunked", 7))
+					c->chunked = true;
+			} else if(strncasecmp(p, "Connection:", 11) == 0) {
+				if(memmem(p, len, "close", 5) || memmem(p, len, "Close", 5))
+					c->closing = true;
+				else if(memmem(p, len, "eep-", 4))
+					c->closing = false;
+			}
+			break;
+		case P_BODY:
+			if((long long)avail >= c->body_left) {
+				off += c->body_left;
+				c->body_left = 0;
+				complete(c);
+				if(c->closing)
+					goto out;
+			} else {
+				off += avail;
+				c->body_left -= avail;
+			}
+			break;
+		case P_CHUNK_SIZE:
+			c->body_left = strtoll(p, NULL, 16);
+			if(c->body_left < 0)
+				return false;
+			if(c->body_left == 0)
+				c->phase = P_TRAILER;
+			else {
+				c->body_left += 2;	/* CRLF after the data */
+				c->phase = P_CHUNK_DATA;
+			}
+			break;
+		case P_CHUNK_DATA:
+			if((long long)avail >= c->body_left) {
+				off += c->body_left;
+				c->body_left = 0;
+				c->phase = P_CHUNK_SIZE;
+			} else {
+				off += avail;
+				c->body_left -= avail;
+			}
+			break;
+		case P_TRAILER:
+			if(len <= 2) {
+				complete(c);
+				if(c->closing)
+					goto out;
+			}
+			break;
+		case P_UNTIL_CLOSE:
+			off += avail;
+			break;
+		}
+	}
+out:
+	if(off) {
+		memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+		c->rlen -= off;
+	}
+	return true;
+}
+
+static void read_conn(struct conn* c)
+{
+	for(;;) {
+		ssize_t n;
+		if(c->rcap - c->rlen < 4096) {
+			c->rcap *= 2;
+			c->rbuf = realloc(c->rbuf, c->rcap);
+			if(!c->rbuf)
+				die("realloc");
+		}
+		n = read(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				return;
+			c->th->resets++;
+			close_conn(c, true);
+			return;
+		}
+		if(n == 0) {
+			/* the end of a body delimited by the close */
+			if(c->phase == P_UNTIL_CLOSE && c->qcount)
+				complete(c);
+			else if(c->phase != P_STATUS || c->rlen || (c->qcount && !c->closing))
+				c->th->resets++;
+			close_conn(c, c->qcount && !c->closing);
+			return;
+		}
+		c->th->bytes += n;
+		c->rlen += n;
+		if(!parse(c)) {
+			fprintf(stderr, "malformed response\n");
+			c->th->resets++;
+			close_conn(c, true);
+			return;
+		}
+		if(c->closing && c->phase == P_STATUS && !c->rlen) {
+			close_conn(c, false);
+			return;
+		}
+	}
+}
+
+static void handle(struct conn* c, uint32_t events)
+{
+	if(c->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if(err) {
+			c->th->connect_errors++;
+			close_conn(c, true);
+			return;
+		}
+		if(!(events & (EPOLLOUT | EPOLLIN)))
+			return;
+		c->connecting = false;
+		c->closing = false;
+		fill_conn(c);
+		return;
+	}
+	if(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		read_conn(c);
+		if(c->fd < 0)
+			return;
+	}
+	fill_conn(c);
+}
+
+static void* worker(void* arg)
+{
+	struct thread_ctx* th = arg;
+	struct epoll_event events[256];
+	uint64_t drain_until = 0;
+	unsigned int i;
+	int n;
+
+	th->epfd = epoll_create(th->nconns);
+	if(th->epfd < 0)
+		die("epoll_create");
+	th->conns = calloc(th->nconns, sizeof(struct conn));
+	for(i=0; i < th->nconns; ++i) {
+		struct conn* c = &th->conns[i];
+		c->th = th;
+		c->fd = -1;
+		c->wcap = 4096;
+		c->wbuf = malloc(c->wcap);
+		c->rcap = 65536;
+		c->rbuf = malloc(c->rcap);
+		c->sent = calloc(g_depth, sizeof(uint64_t));
+		c->next_req = i;
+	}
+
+	for(;;) {
+		uint64_t now = now_ns();
+		unsigned int outstanding = 0;
+
+		for(i=0; i < th->nconns; ++i) {
+			struct conn* c = &th->conns[i];
+			if(c->fd < 0 && !g_stop && now >= c->retry_at)
+				open_conn(c);
+			if(c->fd >= 0)
+				outstanding += c->qcount;
+		}
+		if(g_stop) {
+			/* give the requests in flight a little time to finish */
+			if(!drain_until)
+				drain_until = now + 2000000000ULL;
+			if(!outstanding || now > drain_until)
+				break;
+		}
+
+		n = epoll_wait(th->epfd, events, 256, 10);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			die("epoll_wait");
+		}
+		for(i=0; i < (unsigned int)n; ++i)
+			handle(events[i].data.ptr, events[i].events);
+	}
+
+	for(i=0; i < th->nconns; ++i) {
+		struct conn* c = &th->conns[i];
+		if(c->fd >= 0) {
+			th->unanswered += c->qcount;
+			close(c->fd);
+		}
+		free(c->wbuf);
+		free(c->rbuf);
+		free(c->sent);
+	}
+	free(th->conns);
+	close(th->epfd);
+	return NULL;
+}
+
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return;
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if(rl.rlim_cur < g_conns + g_threads + 16)
+		fprintf(stderr, "warning: only %lu file descriptors for %u connections\n",
+			(unsigned long)rl.rlim_cur, g_conns);
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] url [url...]\n"
+		"  -t threads    threads (%u)\n"
+		"  -c conns      connections in total (%u)\n"
+		"  -d depth      pipelined requests per connection (%u)\n"
+		"  -n seconds    run time (%u)\n"
+		"  -r requests   run this many requests instead\n"
+		"  -H header     extra request header, e.g.\n"
+		"                -H 'If-Modified-Since: Sat Oct 1994 19:43:31 GMT'\n"
+		"  -m method     request method (%s)\n"
+		"  -K            no keep-alive, a new connection per request\n"
+		"The urls are requested round robin and have to be on one server.\n",
+		prog, g_threads, g_conns, g_depth, g_duration, g_method);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	struct thread_ctx* threads;
+	struct lathist total;
+	uint64_t status[6], bytes = 0, opened = 0, cerr = 0, resets = 0, lost = 0;
+	uint64_t start, requests;
+	double elapsed;
+	unsigned int i, j;
+	int opt;
+
+	while((opt = getopt(argc, argv, "t:c:d:n:r:H:m:K")) != -1) {
+		switch(opt) {
+		case 't': g_threads = atoi(optarg); break;
+		case 'c': g_conns = atoi(optarg); break;
+		case 'd': g_depth = atoi(optarg); break;
+		case 'n': g_duration = atoi(optarg); break;
+		case 'r': g_requests = strtoull(optarg, NULL, 10); break;
+		case 'H':
+			if(g_nheaders == MAX_HEADERS)
+				usage(argv[0]);
+			g_headers[g_nheaders++] = optarg;
+			break;
+		case 'm': g_method = optarg; break;
+		case 'K': g_keepalive = false; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind == argc || !g_threads || !g_conns || !g_depth ||
+			(!g_requests && !g_duration))
+		usage(argv[0]);
+	if(!g_keepalive)
+		g_depth = 1;
+	if(g_threads > g_conns)
+		g_threads = g_conns;
+	for(i=optind; i < (unsigned int)argc; ++i)
+		add_url(argv[i]);
+	resolve();
+	raise_fd_limit();
+	signal(SIGPIPE, SIG_IGN);
+
+	threads = calloc(g_threads, sizeof(struct thread_ctx));
+	start = now_ns();
+	for(i=0; i < g_threads; ++i) {
+		int err;
+		threads[i].nconns = g_conns / g_threads + (i < g_conns % g_threads);
+		err = pthread_create(&threads[i].tid, NULL, worker, &threads[i]);
+		if(err != 0) {
+			fprintf(stderr, "failed to create thread: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	if(!g_requests) {
+		struct timespec ts = { g_duration, 0 };
+		while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+		g_stop = true;
+	}
+
+	memset(&total, 0, sizeof(total));
+	memset(status, 0, sizeof(status));
+	for(i=0; i < g_threads; ++i) {
+		int err = pthread_join(threads[i].tid, NULL);
+		if(err != 0)
+			fprintf(stderr, "failed to join thread: %s\n", strerror(err));
+		lathist_merge(&total, &threads[i].hist);
+		for(j=0; j < 6; ++j)
+			status[j] += threads[i].status[j];
+		bytes += threads[i].bytes;
+		opened += threads[i].opened;
+		cerr += threads[i].connect_errors;
+		resets += threads[i].resets;
+		lost += threads[i].unanswered;
+	}
+	elapsed = (now_ns() - start) / 1e9;
+	requests = total.count;
+
+	printf("%s:%s, %u threads, %u connections, depth %u, %s\n", g_host, g_port,
+		g_threads, g_conns, g_depth, g_keepalive ? "keep-alive" : "close");
+	printf("%llu requests in %.3f s: %.0f req/s, %.2f MB/s\n",
+		(unsigned long long)requests, elapsed, requests / elapsed,
+		bytes / elapsed / (1 << 20));
+	printf("status 1xx: %llu 2xx: %llu 3xx: %llu 4xx: %llu 5xx: %llu other: %llu\n",
+		(unsigned long long)status[1], (unsigned long long)status[2],
+		(unsigned long long)status[3], (unsigned long long)status[4],
+		(unsigned long long)status[5], (unsigned long long)status[0]);
+	printf("connections opened: %llu, connect errors: %llu, resets: %llu, "
+		"unanswered: %llu\n", (unsigned long long)opened,
+		(unsigned long long)cerr, (unsigned long long)resets,
+		(unsigned long long)lost);
+	printf("latency (us) mean: %.1f p50: %.1f p90: %.1f p99: %.1f p99.9: %.1f "
+		"max: %.1f\n", lathist_mean(&total) / 1e3,
+		lathist_percentile(&total, 50) / 1e3,
+		lathist_percentile(&total, 90) / 1e3,
+		lathist_percentile(&total, 99) / 1e3,
+		lathist_percentile(&total, 99.9) / 1e3, total.max / 1e3);
+	return 0;
+}
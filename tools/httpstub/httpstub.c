@@ -0,0 +1,751 @@
+/*
+ * Local HTTP server that stands in for the download mirrors of the
+ * triggers.
+ *
+ * Every path is a generated file: /file/<size>[k|m|g] has that size,
+ * anything else the size given by -s. The content is a sequence of
+ * 16 byte lines, each holding its own offset in hex, so a downloaded
+ * copy can be checked (-c) for segments written to the wrong place.
+ * Single byte ranges are supported, and every connection can be capped
+ * in bandwidth (-b) and delayed before it gets its response (-l, -j).
+ *
+ * With -S the server also is a synthetic web site for crawlers: pages
+ * that link to each other and embed generated assets, the same for the
+ * same options (see site_path()).
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RBUF_SIZE 8192
+#define CHUNK (64 * 1024)
+
+const char* g_addr = "127.0.0.1";
+unsigned short g_port = 8080;
+unsigned int g_threads = 1;
+uint64_t g_default_size = 0;		/* 0 = only /file/<size> exists */
+uint64_t g_rate = 0;			/* bytes/s per connection, 0 = no cap */
+unsigned int g_latency = 0;		/* ms before every response */
+unsigned int g_jitter = 0;		/* ms, uniform on top of g_latency */
+unsigned int g_pages = 0;		/* pages of the site, 0 = no site */
+unsigned int g_fanout = 8;		/* links per page */
+unsigned int g_assets = 2;		/* assets per page */
+uint64_t g_asset_size = 16384;
+
+enum state {
+	S_READING,
+	S_WAITING,			/* injected latency */
+	S_SENDING
+};
+
+struct conn {
+	int fd;
+	enum state state;
+	bool polling_in;
+	bool polling_out;
+	bool close_after;
+	char rbuf[RBUF_SIZE];
+	size_t rlen;
+	char hdr[512];
+	size_t hlen, hoff;
+	uint64_t pos, end;		/* body still to send, [pos, end) */
+	char* body;			/* a page, NULL = generate() the body */
+	uint64_t timer;			/* ns, 0 = none */
+	double tokens;			/* bytes we may send, with g_rate */
+	uint64_t refilled;		/* ns */
+	struct conn* next;		/* all connections of the thread */
+	struct conn* prev;
+};
+
+struct thread_ctx {
+	pthread_t tid;
+	int epfd;
+	int lfd;
+	unsigned int seed;
+	struct conn* conns;
+	char chunk[CHUNK];
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t accepted;
+};
+
+static struct thread_ctx* g_ctx;
+
+static void die(const char* what)
+{
+	perror(what);
+	exit(1);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool parse_size(const char* s, uint64_t* size)
+{
+	char* end;
+	uint64_t v = strtoull(s, &end, 10);
+
+	switch(*end) {
+	case 'k': case 'K': v <<= 10; end++; break;
+	case 'm': case 'M': v <<= 20; end++; break;
+	case 'g': case 'G': v <<= 30; end++; break;
+	}
+	if(end == s || *end)
+		return false;
+	*size = v;
+	return true;
+}
+
+/* the bytes [off, off + n) of every generated file */
+static void generate(char* buf, uint64_t off, size_t n)
+{
+	static const char hex[] = "0123456789abcdef";
+	uint64_t line = off & ~(uint64_t)15;
+	size_t skip = off - line;
+
+	while(n) {
+		char l[16];
+		uint64_t v = line;
+		size_t i, len;
+		for(i=15; i > 0; --i) {
+			l[i - 1] = hex[v & 15];
+			v >>= 4;
+		}
+		l[15] = '\n';
+		len = 16 - skip < n ? 16 - skip : n;
+		memcpy(buf, l + skip, len);
+		buf += len;
+		n -= len;
+		skip = 0;
+		line += 16;
+	}
+}
+
+/* check a downloaded copy, returns the offset of the first bad line or -1 */
+static long long check_file(const char* path)
+{
+	static char buf[1 << 20], want[1 << 20];
+	uint64_t off = 0;
+	size_t n, i;
+	FILE* fp = fopen(path, "r");
+
+	if(!fp)
+		die(path);
+	while((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		generate(want, off, n);
+		if(memcmp(buf, want, n) != 0) {
+			for(i=0; buf[i] == want[i]; ++i)
+				;
+			fclose(fp);
+			return (off + i) & ~(uint64_t)15;
+		}
+		off += n;
+	}
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * Poll for output if out, and for input while the read buffer has room:
+ * a full one (pipelined requests) waits for a request to be consumed.
+ */
+static void set_out(struct thread_ctx* th, struct conn* c, bool out)
+{
+	struct epoll_event ev;
+	bool in = c->rlen < RBUF_SIZE;
+
+	if(out == c->polling_out && in == c->polling_in)
+		return;
+	ev.events = (in ? EPOLLIN : 0) | (out ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if(epoll_ctl(th->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+		die("epoll_ctl");
+	c->polling_in = in;
+	c->polling_out = out;
+}
+
+static void close_conn(struct thread_ctx* th, struct conn* c)
+{
+	close(c->fd);
+	free(c->body);
+	if(c->prev)
+		c->prev->next = c->next;
+	else
+		th->conns = c->next;
+	if(c->next)
+		c->next->prev = c->prev;
+	free(c);
+}
+
+static void respond(struct conn* c, int status, const char* reason, uint64_t size,
+		uint64_t from, uint64_t to, bool head, const char* type)
+{
+	size_t n;
+
+	n = snprintf(c->hdr, sizeof(c->hdr), "HTTP/1.1 %d %s\r\n"
+		"Server: httpstub\r\n"
+		"Accept-Ranges: bytes\r\n", status, reason);
+	if(status == 206)
+		n += snprintf(c->hdr + n, sizeof(c->hdr) - n,
+			"Content-Range: bytes %llu-%llu/%llu\r\n",
+			(unsigned long long)from, (unsigned long long)to - 1,
+			(unsigned long long)size);
+	else if(status == 416)
+		n += snprintf(c->hdr + n, sizeof(c->hdr) - n,
+			"Content-Range: bytes */%llu\r\n", (unsigned long long)size);
+	n += snprintf(c->hdr + n, sizeof(c->hdr) - n,
+		"Content-Type: %s\r\n"
+		"Content-Length: %llu\r\n"
+		"%s\r\n", type, (unsigned long long)(to - from),
+		c->close_after ? "Connection: close\r\n" : "");
+	c->hlen = n;
+	c->hoff = 0;
+	c->pos = head ? to : from;
+	c->end = to;
+}
+
+/* the k-th link of page n */
+static unsigned int link_target(unsigned int n, unsigned int k)
+{
+	uint64_t first = (uint64_t)n * g_fanout + 1;	/* first child of n */
+	unsigned int children, last, m, to;
+	uint32_t h;
+
+	/* the first links make a tree, so that every page is reachable */
+	if(first + k < g_pages)
+		return first + k;
+	/*
+	 * The others are a run of pages from a start hashed from n, among
+	 * [1, last] without n: not the index, n itself or its children,
+	 * and distinct as long as the site has enough pages.
+	 */
+	children = first < g_pages ? g_pages - first : 0;
+	last = first - 1 < g_pages - 1 ? first - 1 : g_pages - 1;
+	m = n ? last - 1 : 0;
+	if(!m) {
+		/* the index or a site of two pages, links can only repeat */
+		if(g_pages < 2)
+			return 0;
+		return n ? 0 : 1 + k % (g_pages - 1);
+	}
+	h = n * 2654435761u;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	to = 1 + ((uint64_t)h + k - children) % m;
+	return to >= n ? to + 1 : to;
+}
+
+static size_t build_page(char** body, unsigned int n)
+{
+	size_t cap = 256 + (size_t)(g_assets + g_fanout) * 64, len;
+	char* p = malloc(cap);
+	unsigned int k, to;
+
+	if(!p)
+		die("malloc");
+	len = snprintf(p, cap, "<html><head><title>page %u</title></head><body>\n"
+		"<h1>page %u</h1>\n", n, n);
+	for(k=0; k < g_assets; ++k)
+		len += snprintf(p + len, cap - len, "<img src=\"/a/%u-%u.png\">\n", n, k);
+	for(k=0; k < g_fanout; ++k) {
+		to = link_target(n, k);
+		len += snprintf(p + len, cap - len, "<a href=\"/p/%u.html\">page %u</a>\n", to, to);
+	}
+	len += snprintf(p + len, cap - len, "</body></html>\n");
+	*body = p;
+	return len;
+}
+
+/*
+ * The synthetic site: / (or /p/0.html) is the index, /p/<n>.html page n,
+ * /a/<n>-<k>.png asset k of page n. A page links to g_fanout pages and
+ * embeds g_assets assets, whose content is that of every generated file.
+ * Returns false if path is not in the site; *found is false for a page
+ * or asset past the end of it.
+ */
+static bool site_path(struct conn* c, const char* path, bool* found,
+		uint64_t* size, const char** type)
+{
+	unsigned int n, k;
+	int len = -1;
+
+	if(strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
+		n = 0;
+	} else if(sscanf(path, "/p/%u.html%n", &n, &len) == 1 && len > 0 && !path[len]) {
+		;
+	} else if(sscanf(path, "/a/%u-%u.png%n", &n, &k, &len) == 2 && len > 0 && !path[len]) {
+		*found = n < g_pages && k < g_assets;
+		*size = g_asset_size;
+		*type = "image/png";
+		return true;
+	} else
+		return false;
+
+	*found = n < g_pages;
+	if(*found)
+		*size = build_page(&c->body, n);
+	*type = "text/html";
+	return true;
+}
+
+/*
+ * Parse one request from the read buffer. Returns false if there is no
+ * complete one yet.
+ */
+static bool parse_request(struct thread_ctx* th, struct conn* c)
+{
+	char* end = memmem(c->rbuf, c->rlen, "\r\n\r\n", 4);
+	char *line, *next, *path, *sp;
+	char range[64] = "";
+	const char* type = "application/octet-stream";
+	uint64_t size = 0, from, to;
+	bool head, found, http10;
+	size_t len;
+
+	if(!end)
+		return false;
+	*end = '\0';
+	len = end + 4 - c->rbuf;
+	free(c->body);
+	c->body = NULL;
+
+	line = c->rbuf;
+	next = strstr(line, "\r\n");
+	if(next)
+		*next = '\0';
+	head = strncmp(line, "HEAD ", 5) == 0;
+	path = strchr(line, ' ');
+	path = path ? path + 1 : line + strlen(line);
+	sp = strchr(path, ' ');
+	http10 = sp && strncmp(sp + 1, "HTTP/1.0", 8) == 0;
+	if(sp)
+		*sp = '\0';
+	c->close_after = http10;
+
+	while(next) {
+		line = next + 2;
+		next = strstr(line, "\r\n");
+		if(next)
+			*next = '\0';
+		if(strncasecmp(line, "Range:", 6) == 0) {
+			line += 6;
+			while(*line == ' ')
+				line++;
+			snprintf(range, sizeof(range), "%s", line);
+		} else if(strncasecmp(line, "Connection:", 11) == 0) {
+			if(strcasestr(line, "close"))
+				c->close_after = true;
+			else if(strcasestr(line, "keep-alive"))
+				c->close_after = false;
+		}
+	}
+
+	if(g_pages && site_path(c, path, &found, &size, &type))
+		;
+	else if(strncmp(path, "/file/", 6) == 0)
+		found = parse_size(path + 6, &size);
+	else {
+		found = g_default_size != 0;
+		size = g_default_size;
+	}
+
+	if(!found) {
+		c->close_after = true;
+		respond(c, 404, "Not Found", 0, 0, 0, head, type);
+	} else if(range[0]) {
+		/* a single byte range, see RFC 2616 14.35 */
+		unsigned long long a = 0, b = 0;
+		bool ok = false;
+		/* the suffix form first, %llu would take its '-' for a sign */
+		if(strncmp(range, "bytes=-", 7) == 0) {
+			if(isdigit((unsigned char)range[7]) &&
+					sscanf(range + 7, "%llu", &b) == 1 && b > 0) {
+				a = b >= size ? 0 : size - b;
+				b = size - 1;
+				ok = size > 0;
+			}
+		} else if(!isdigit((unsigned char)range[6]))
+			;
+		else if(sscanf(range, "bytes=%llu-%llu", &a, &b) == 2)
+			ok = a <= b && a < size;
+		else if(sscanf(range, "bytes=%llu-", &a) == 1) {
+			b = size - 1;
+			ok = a < size;
+		}
+		if(!ok)
+			respond(c, 416, "Requested Range Not Satisfiable", size, 0, 0, head, type);
+		else {
+			from = a;
+			to = (b >= size ? size - 1 : b) + 1;
+			respond(c, 206, "Partial Content", size, from, to, head, type);
+		}
+	} else
+		respond(c, 200, "OK", size, 0, size, head, type);
+
+	memmove(c->rbuf, c->rbuf + len, c->rlen - len);
+	c->rlen -= len;
+	th->requests++;
+	return true;
+}
+
+static uint64_t latency_ns(struct thread_ctx* th)
+{
+	uint64_t ms = g_latency;
+
+	if(g_jitter)
+		ms += rand_r(&th->seed) % (g_jitter + 1);
+	return ms * 1000000;
+}
+
+/* start on the next request in the buffer, if there is one */
+static void next_request(struct thread_ctx* th, struct conn* c)
+{
+	if(!parse_request(th, c)) {
+		c->state = S_READING;
+		return;
+	}
+	c->tokens = 0;
+	c->refilled = now_ns();
+	if(g_latency || g_jitter) {
+		c->state = S_WAITING;
+		c->timer = c->refilled + latency_ns(th);
+	} else
+		c->state = S_SENDING;
+}
+
+/*
+ * Send as much of the response as the socket and the bandwidth cap allow.
+ * Returns false if the connection is gone.
+ */
+static bool send_response(struct thread_ctx* th, struct conn* c)
+{
+	uint64_t now = now_ns();
+
+	if(c->state == S_WAITING) {
+		if(now < c->timer)
+			return true;
+		c->state = S_SENDING;
+		c->refilled = now;
+	}
+	c->timer = 0;
+
+	while(c->state == S_SENDING) {
+		ssize_t n;
+
+		if(c->hoff < c->hlen) {
+			n = write(c->fd, c->hdr + c->hoff, c->hlen - c->hoff);
+		} else if(c->pos < c->end) {
+			size_t want = c->end - c->pos < CHUNK ? c->end - c->pos : CHUNK;
+			if(g_rate) {
+				/* token bucket, at most 1/20 s worth of burst */
+				double burst = g_rate / 20.0 > 1460 ? g_rate / 20.0 : 1460;
+				now = now_ns();
+				c->tokens += (now - c->refilled) / 1e9 * g_rate;
+				if(c->tokens > burst)
+					c->tokens = burst;
+				c->refilled = now;
+				if(c->tokens < 1460 && c->tokens < want) {
+					c->timer = now + (uint64_t)((1460 - c->tokens) / g_rate * 1e9);
+					set_out(th, c, false);
+					return true;
+				}
+				if(want > c->tokens)
+					want = (size_t)c->tokens;
+			}
+			if(c->body)
+				n = write(c->fd, c->body + c->pos, want);
+			else {
+				generate(th->chunk, c->pos, want);
+				n = write(c->fd, th->chunk, want);
+			}
+		} else {
+			if(c->close_after) {
+				close_conn(th, c);
+				return false;
+			}
+			next_request(th, c);
+			if(c->state == S_WAITING) {
+				set_out(th, c, false);
+				return true;
+			}
+			continue;
+		}
+
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EINTR) {
+				set_out(th, c, true);
+				return true;
+			}
+			close_conn(th, c);
+			return false;
+		}
+		if(c->hoff < c->hlen)
+			c->hoff += n;
+		else {
+			c->pos += n;
+			if(g_rate)
+				c->tokens -= n;
+		}
+		th->bytes += n;
+	}
+	set_out(th, c, false);
+	return true;
+}
+
+/* Returns false if the connection is gone. */
+static bool read_conn(struct thread_ctx* th, struct conn* c)
+{
+	while(c->rlen < RBUF_SIZE) {
+		ssize_t n = read(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				break;
+			close_conn(th, c);
+			return false;
+		}
+		if(n == 0) {
+			close_conn(th, c);
+			return false;
+		}
+		c->rlen += n;
+	}
+	if(c->rlen == RBUF_SIZE && !memmem(c->rbuf, c->rlen, "\r\n\r\n", 4)) {
+		close_conn(th, c);	/* header too large */
+		return false;
+	}
+	if(c->state == S_READING) {
+		next_request(th, c);
+		if(c->state == S_SENDING)
+			return send_response(th, c);
+	}
+	set_out(th, c, c->polling_out);
+	return true;
+}
+
+static void accept_conns(struct thread_ctx* th)
+{
+	for(;;) {
+		struct epoll_event ev;
+		struct conn* c;
+		int one = 1;
+		int fd = accept4(th->lfd, NULL, NULL, SOCK_NONBLOCK);
+
+		if(fd < 0) {
+			if(errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+				perror("accept");
+			return;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c = calloc(1, sizeof(struct conn));
+		c->fd = fd;
+		c->state = S_READING;
+		c->polling_in = true;
+		c->next = th->conns;
+		if(th->conns)
+			th->conns->prev = c;
+		th->conns = c;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if(epoll_ctl(th->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			die("epoll_ctl");
+		th->accepted++;
+	}
+}
+
+static void* worker(void* arg)
+{
+	struct thread_ctx* th = arg;
+	struct epoll_event events[256];
+	struct epoll_event ev;
+	int i, n, timeout;
+
+	th->epfd = epoll_create(256);
+	if(th->epfd < 0)
+		die("epoll_create");
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(th->epfd, EPOLL_CTL_ADD, th->lfd, &ev) < 0)
+		die("epoll_ctl");
+
+	for(;;) {
+		struct conn *c, *next;
+		uint64_t now = now_ns(), first = 0;
+
+		/* the connections are few, a scan beats keeping a timer heap */
+		for(c=th->conns; c; c=c->next)
+			if(c->timer && (!first || c->timer < first))
+				first = c->timer;
+		if(!first)
+			timeout = -1;
+		else if(first <= now)
+			timeout = 0;
+		else
+			timeout = (first - now + 999999) / 1000000;
+
+		n = epoll_wait(th->epfd, events, 256, timeout);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			die("epoll_wait");
+		}
+		for(i=0; i < n; ++i) {
+			c = events[i].data.ptr;
+			if(!c) {
+				accept_conns(th);
+				continue;
+			}
+			if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+				close_conn(th, c);
+				continue;
+			}
+			if((events[i].events & EPOLLIN) && !read_conn(th, c))
+				continue;
+			if(events[i].events & EPOLLOUT)
+				send_response(th, c);
+		}
+
+		now = now_ns();
+		for(c=th->conns; c; c=next) {
+			next = c->next;
+			if(c->timer && c->timer <= now)
+				send_response(th, c);
+		}
+	}
+	return NULL;
+}
+
+static int listen_socket(void)
+{
+	struct sockaddr_in sin;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(fd < 0)
+		die("socket");
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(g_port);
+	if(inet_pton(AF_INET, g_addr, &sin.sin_addr) != 1) {
+		fprintf(stderr, "bad address %s\n", g_addr);
+		exit(1);
+	}
+	if(bind(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0)
+		die("bind");
+	if(listen(fd, 1024) < 0)
+		die("listen");
+	return fd;
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"       %s -c file\n"
+		"  -a addr       address to listen on (%s)\n"
+		"  -p port       port (%u)\n"
+		"  -t threads    threads (%u)\n"
+		"  -s size       size of every path but /file/<size>, e.g. 64m\n"
+		"  -b rate       bandwidth cap per connection in bytes/s, e.g. 1m\n"
+		"  -l ms         latency before every response\n"
+		"  -j ms         random extra latency, up to this much\n"
+		"  -S pages      serve a synthetic site of that many pages\n"
+		"  -F links      links per page of the site (%u)\n"
+		"  -A assets     assets per page of the site (%u)\n"
+		"  -z size       size of an asset (%llu)\n"
+		"  -c file       check a downloaded file and exit\n",
+		prog, prog, g_addr, g_port, g_threads, g_fanout, g_assets,
+		(unsigned long long)g_asset_size);
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t requests = 0, bytes = 0, accepted = 0;
+	sigset_t set;
+	unsigned int i;
+	int opt, sig;
+
+	while((opt = getopt(argc, argv, "a:p:t:s:b:l:j:S:F:A:z:c:")) != -1) {
+		switch(opt) {
+		case 'a': g_addr = optarg; break;
+		case 'p': g_port = atoi(optarg); break;
+		case 't': g_threads = atoi(optarg); break;
+		case 's': if(!parse_size(optarg, &g_default_size)) usage(argv[0]); break;
+		case 'b': if(!parse_size(optarg, &g_rate)) usage(argv[0]); break;
+		case 'l': g_latency = atoi(optarg); break;
+		case 'j': g_jitter = atoi(optarg); break;
+		case 'S': g_pages = atoi(optarg); break;
+		case 'F': g_fanout = atoi(optarg); break;
+		case 'A': g_assets = atoi(optarg); break;
+		case 'z': if(!parse_size(optarg, &g_asset_size)) usage(argv[0]); break;
+		case 'c': {
+			long long bad = check_file(optarg);
+			if(bad < 0) {
+				printf("%s: ok\n", optarg);
+				return 0;
+			}
+			printf("%s: bad content at offset %lld\n", optarg, bad);
+			return 1;
+		}
+		default: usage(argv[0]);
+		}
+	}
+	if(!g_threads || optind != argc)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	g_ctx = calloc(g_threads, sizeof(struct thread_ctx));
+	for(i=0; i < g_threads; ++i) {
+		int err;
+		g_ctx[i].lfd = listen_socket();
+		g_ctx[i].seed = i + 1;
+		err = pthread_create(&g_ctx[i].tid, NULL, worker, &g_ctx[i]);
+		if(err != 0) {
+			fprintf(stderr, "failed to create thread: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	printf("listening on %s:%u\n", g_addr, g_port);
+	fflush(stdout);
+
+	sigwait(&set, &sig);
+	for(i=0; i < g_threads; ++i) {
+		requests += g_ctx[i].requests;
+		bytes += g_ctx[i].bytes;
+		accepted += g_ctx[i].accepted;
+	}
+	printf("%llu connections, %llu requests, %llu bytes sent\n",
+		(unsigned long long)accepted, (unsigned long long)requests,
+		(unsigned long long)bytes);
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Helpers for the LD_PRELOAD interposers of the tools.
+ *
+ * An interposer defines the function it wraps and calls the next
+ * definition of it through a pointer resolved on first use:
+ *
+ *   INTERPOSE(int, pthread_mutex_lock, (pthread_mutex_t*));
+ *
+ *   int pthread_mutex_lock(pthread_mutex_t* m)
+ *   {
+ *           INTERPOSE_RESOLVE(pthread_mutex_lock);
+ *           ...
+ *           return real_pthread_mutex_lock(m);
+ *   }
+ */
+
+#ifndef INTERPOSE_H
+#define INTERPOSE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INTERPOSE(ret, name, args) static ret (*real_##name) args
+
+#define INTERPOSE_RESOLVE(name) do { \
+	if(__builtin_expect(!real_##name, 0)) \
+		real_##name = (__typeof__(real_##name))interpose_next(#name); \
+} while(0)
+
+/* write a message without stdio, which may take the locks we wrap */
+static inline void interpose_msg(const char* a, const char* b)
+{
+	ssize_t rc;
+
+	rc = write(2, a, strlen(a));
+	rc = write(2, b, strlen(b));
+	rc = write(2, "\n", 1);
+	(void)rc;
+}
+
+/*
+ * The next definition of a symbol. For the pthread_cond functions
+ * dlsym finds the old GLIBC_2.2.5 ABI, ask for the current one.
+ */
+static inline void* interpose_next(const char* name)
+{
+	void* f = NULL;
+
+	if(strncmp(name, "pthread_cond_", 13) == 0)
+		f = dlvsym(RTLD_NEXT, name, "GLIBC_2.3.2");
+	if(!f)
+		f = dlsym(RTLD_NEXT, name);
+	if(!f) {
+		interpose_msg("interpose: cannot find ", name);
+		abort();
+	}
+	return f;
+}
+
+#endif
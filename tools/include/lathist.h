@@ -0,0 +1,93 @@
+/*
+ * Log-linear latency histogram shared by the tools.
+ *
+ * Values below 16 are counted exactly, every larger power of two is split
+ * into 16 buckets, so a reported percentile is off by less than 1/16 while
+ * the whole 64 bit range fits in under 8KB. The unit is up to the caller
+ * (the tools record nanoseconds).
+ */
+
+#ifndef LATHIST_H
+#define LATHIST_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define LATHIST_SUBBITS 4
+#define LATHIST_SUB (1 << LATHIST_SUBBITS)
+#define LATHIST_BUCKETS ((65 - LATHIST_SUBBITS) * LATHIST_SUB)
+
+struct lathist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t b[LATHIST_BUCKETS];
+};
+
+static inline unsigned int lathist_bucket(uint64_t v)
+{
+	unsigned int shift;
+
+	if(v < LATHIST_SUB)
+		return (unsigned int)v;
+	shift = 63 - __builtin_clzll(v) - LATHIST_SUBBITS;
+	return shift * LATHIST_SUB + (unsigned int)(v >> shift);
+}
+
+/* largest value counted in bucket i */
+static inline uint64_t lathist_highest(unsigned int i)
+{
+	unsigned int shift;
+
+	if(i < LATHIST_SUB)
+		return i;
+	shift = i / LATHIST_SUB - 1;
+	return ((uint64_t)(i - shift * LATHIST_SUB) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void lathist_add(struct lathist* h, uint64_t v)
+{
+	h->b[lathist_bucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if(v > h->max)
+		h->max = v;
+}
+
+static inline void lathist_merge(struct lathist* h, const struct lathist* o)
+{
+	unsigned int i;
+
+	for(i=0; i < LATHIST_BUCKETS; ++i)
+		h->b[i] += o->b[i];
+	h->count += o->count;
+	h->sum += o->sum;
+	if(o->max > h->max)
+		h->max = o->max;
+}
+
+static inline double lathist_mean(const struct lathist* h)
+{
+	return h->count ? (double)h->sum / h->count : 0.0;
+}
+
+/* value below which p percent of the recorded values fall */
+static inline uint64_t lathist_percentile(const struct lathist* h, double p)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if(!h->count)
+		return 0;
+	rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+	if(rank < 1)
+		rank = 1;
+	for(i=0; i < LATHIST_BUCKETS; ++i) {
+		seen += h->b[i];
+		if(seen >= rank)
+			return lathist_highest(i) < h->max ? lathist_highest(i) : h->max;
+	}
+	return h->max;
+}
+
+#endif
@@ -0,0 +1,624 @@
+/*
+ * Lock contention profiler, LD_PRELOAD'ed into the program to profile.
+ *
+ * Wraps the pthread mutex, rwlock and cond wait calls and, per lock and
+ * per call site (the return address of the wrapped call), counts the
+ * acquisitions, how many of them had to wait, the time spent waiting
+ * and the time the lock was then held. Every thread updates its own
+ * table, so the counting takes no lock and shares no cache line; a
+ * mutex that is free is taken with trylock without reading the clock,
+ * and only one hold in LOCKPROF_HOLD is timed. The tables of all
+ * threads are merged into a report ranked by wait time, at exit and
+ * whenever the signal arrives.
+ *
+ * Configured from the environment:
+ *
+ *   LOCKPROF_OUT     file the reports are appended to (stderr)
+ *   LOCKPROF_SIGNAL  signal number that asks for a report (SIGUSR2),
+ *                    0 for none; the report is written by the next
+ *                    thread that unlocks a lock
+ *   LOCKPROF_TOP     entries in a report (30)
+ *   LOCKPROF_HOLD    time one hold in that many per thread (64), 1
+ *                    for all, 0 for none; reading the clock is what
+ *                    most of the overhead is
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "interpose.h"
+
+#if defined(__has_include)
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#define SINGLE_THREADED() __libc_single_threaded
+#endif
+#endif
+#ifndef SINGLE_THREADED
+#define SINGLE_THREADED() 0
+#endif
+
+#define TABLE_SIZE 1024		/* entries per thread, a power of 2 */
+#define MAX_HELD 32		/* locks a thread holds at once, beyond not timed */
+#define MAX_REPORT 65536	/* distinct entries over all threads */
+
+enum kind {
+	K_MUTEX,
+	K_RDLOCK,
+	K_WRLOCK,
+	K_COND
+};
+
+static const char* kind_names[] = { "mutex", "rdlock", "wrlock", "cond" };
+
+struct entry {
+	const void* lock;	/* NULL: free slot */
+	const void* site;
+	unsigned long kind;
+	uint64_t acquires;
+	uint64_t contended;	/* acquisitions that waited, failed trylocks */
+	uint64_t wait;		/* ticks */
+	uint64_t max_wait;
+	uint64_t hold;		/* ticks, of the timed holds */
+	uint64_t holds;		/* timed holds */
+};
+
+struct held {
+	const void* lock;
+	struct entry* e;
+	uint64_t since;
+};
+
+/* per thread, never freed so that the report sees exited threads */
+struct table {
+	struct table* next;
+	struct entry* last;	/* entry of the last acquisition */
+	int hold_left;		/* acquisitions until the next timed hold */
+	struct entry entries[TABLE_SIZE];
+	struct entry overflow;
+	struct held held[MAX_HELD];
+	int nheld;
+};
+
+INTERPOSE(int, pthread_mutex_lock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_mutex_trylock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_mutex_timedlock, (pthread_mutex_t*, const struct timespec*));
+INTERPOSE(int, pthread_mutex_unlock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_rwlock_rdlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_tryrdlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_wrlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_trywrlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_unlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_cond_wait, (pthread_cond_t*, pthread_mutex_t*));
+INTERPOSE(int, pthread_cond_timedwait, (pthread_cond_t*, pthread_mutex_t*,
+	const struct timespec*));
+
+static int g_ready = 0;
+static int g_hold = 64;
+static int g_top = 30;
+static int g_out = 2;
+static struct table* volatile g_tables = NULL;
+static volatile int g_nthreads = 0;
+static volatile sig_atomic_t g_report = 0;
+static volatile int g_reporting = 0;
+static uint64_t g_start_ticks;
+static uint64_t g_start_ns;
+
+/* a preloaded library is there from the start, no __tls_get_addr */
+#define TLS __attribute__((tls_model("initial-exec"))) __thread
+
+static TLS struct table* t_table;
+static TLS int t_busy;		/* inside the profiler, e.g. allocating */
+
+static inline uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the tsc where there is one, converted with the rate over the run */
+static inline uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return clock_ns();
+#endif
+}
+
+static struct table* my_table(void)
+{
+	struct table* t = t_table;
+
+	if(__builtin_expect(t != NULL, 1))
+		return t;
+	if(t_busy)
+		return NULL;
+	t_busy = 1;
+	/* mmap rather than malloc, which may be what is being profiled */
+	t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(t == MAP_FAILED) {
+		t_busy = 0;
+		return NULL;
+	}
+	do
+		t->next = g_tables;
+	while(!__sync_bool_compare_and_swap(&g_tables, t->next, t));
+	__sync_fetch_and_add(&g_nthreads, 1);
+	t_table = t;
+	t_busy = 0;
+	return t;
+}
+
+static inline struct entry* find(struct table* t, const void* lock,
+		const void* site, enum kind kind)
+{
+	uintptr_t h;
+	unsigned int i, n;
+	struct entry* e = t->last;
+
+	/* a loop takes the same lock at the same site over and over */
+	if(e && e->lock == lock && e->site == site && e->kind == kind)
+		return e;
+	h = ((uintptr_t)lock ^ ((uintptr_t)site * 0x9e3779b97f4a7c15ULL)) >> 4;
+	for(n=0; n < TABLE_SIZE; ++n) {
+		i = (h + n) & (TABLE_SIZE - 1);
+		e = &t->entries[i];
+		if(e->lock == lock && e->site == site && e->kind == kind)
+			return t->last = e;
+		if(!e->lock) {
+			e->site = site;
+			e->kind = kind;
+			e->lock = lock;
+			return t->last = e;
+		}
+	}
+	return &t->overflow;
+}
+
+static inline void push_held(struct table* t, const void* lock, struct entry* e)
+{
+	if(!g_hold || --t->hold_left > 0 || t->nheld == MAX_HELD)
+		return;
+	t->hold_left = g_hold;
+	t->held[t->nheld].lock = lock;
+	t->held[t->nheld].e = e;
+	t->held[t->nheld].since = ticks();
+	t->nheld++;
+}
+
+static inline void pop_held(struct table* t, const void* lock)
+{
+	int i;
+
+	for(i=t->nheld - 1; i >= 0; --i) {
+		if(t->held[i].lock != lock)
+			continue;
+		t->held[i].e->hold += ticks() - t->held[i].since;
+		t->held[i].e->holds++;
+		t->nheld--;
+		if(i != t->nheld)
+			memmove(&t->held[i], &t->held[i + 1], (t->nheld - i) * sizeof(t->held[0]));
+		return;
+	}
+}
+
+static inline struct entry* count(struct table* t, const void* lock, const void* site,
+		enum kind kind, uint64_t wait, int contended)
+{
+	struct entry* e = find(t, lock, site, kind);
+
+	e->acquires++;
+	if(contended) {
+		e->contended++;
+		e->wait += wait;
+		if(wait > e->max_wait)
+			e->max_wait = wait;
+	}
+	return e;
+}
+
+static inline void acquired(struct table* t, const void* lock, const void* site,
+		enum kind kind, uint64_t wait, int contended)
+{
+	push_held(t, lock, count(t, lock, site, kind, wait, contended));
+}
+
+/* merges the entries of all threads and writes the ranked report */
+static void report(void)
+{
+	struct entry* all;
+	struct table* t;
+	uint64_t end_ticks = ticks(), end_ns = clock_ns();
+	uint64_t acquires = 0, contended = 0, wait = 0;
+	double ns_per_tick;
+	size_t size = MAX_REPORT * sizeof(struct entry) + 2 * MAX_REPORT * sizeof(int);
+	char line[512];
+	int n = 0, i, j, len;
+	uintptr_t h, k;
+	int* index;
+
+	if(__sync_lock_test_and_set(&g_reporting, 1))
+		return;
+	ns_per_tick = end_ticks > g_start_ticks ?
+		(double)(end_ns - g_start_ns) / (end_ticks - g_start_ticks) : 1;
+	all = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(all == MAP_FAILED) {
+		__sync_lock_release(&g_reporting);
+		return;
+	}
+	/* where each lock, site and kind is in all[] */
+	index = (int*)(all + MAX_REPORT);
+	memset(index, 0xff, 2 * MAX_REPORT * sizeof(int));
+
+	for(t=g_tables; t; t=t->next) {
+		for(i=0; i <= TABLE_SIZE; ++i) {
+			struct entry* e = i < TABLE_SIZE ? &t->entries[i] : &t->overflow;
+			if(!e->acquires && !e->contended)
+				continue;
+			h = ((uintptr_t)e->lock ^ ((uintptr_t)e->site * 0x9e3779b97f4a7c15ULL)) >> 4;
+			for(k=0; ; ++k) {
+				j = index[(h + k) & (2 * MAX_REPORT - 1)];
+				if(j < 0 || (all[j].lock == e->lock && all[j].site == e->site &&
+						all[j].kind == e->kind))
+					break;
+			}
+			if(j < 0) {
+				if(n == MAX_REPORT)
+					continue;
+				j = index[(h + k) & (2 * MAX_REPORT - 1)] = n;
+				all[n] = *e;
+				all[n].acquires = all[n].contended = all[n].wait = 0;
+				all[n].max_wait = all[n].hold = all[n].holds = 0;
+				n++;
+			}
+			all[j].acquires += e->acquires;
+			all[j].contended += e->contended;
+			all[j].wait += e->wait;
+			all[j].hold += e->hold;
+			all[j].holds += e->holds;
+			if(e->max_wait > all[j].max_wait)
+				all[j].max_wait = e->max_wait;
+			acquires += e->acquires;
+			contended += e->contended;
+			wait += e->wait;
+		}
+	}
+
+	/* by wait time, insertion sort of the top entries only */
+	for(i=0; i < n && i < g_top; ++i) {
+		int best = i;
+		for(j=i + 1; j < n; ++j)
+			if(all[j].wait > all[best].wait)
+				best = j;
+		if(best != i) {
+			struct entry tmp = all[i];
+			all[i] = all[best];
+			all[best] = tmp;
+		}
+	}
+
+	len = snprintf(line, sizeof(line),
+		"lockprof: %.3f s, %d threads, %llu acquisitions, %.2f%% contended, %.3f s waited\n",
+		(end_ns - g_start_ns) / 1e9, g_nthreads, (unsigned long long)acquires,
+		acquires ? 100.0 * contended / acquires : 0, wait * ns_per_tick / 1e9);
+	if(write(g_out, line, len) < 0)
+		goto out;
+	len = snprintf(line, sizeof(line), "%4s %10s %6s %10s %10s %9s %9s %10s %9s %-6s %-18s %s\n",
+		"rank", "wait_ms", "%wait", "acquires", "contended", "avg_w_us", "max_w_us",
+		"hold_ms", "avg_h_us", "kind", "lock", "site");
+	if(write(g_out, line, len) < 0)
+		goto out;
+	for(i=0; i < n && i < g_top; ++i) {
+		struct entry* e = &all[i];
+		/* the timed holds stand for all of them */
+		double avg_hold = e->holds ? e->hold * ns_per_tick / e->holds : 0;
+		char site[256];
+		Dl_info info;
+
+		if(dladdr(e->site, &info) && info.dli_sname)
+			snprintf(site, sizeof(site), "%s+0x%lx", info.dli_sname,
+				(unsigned long)((const char*)e->site - (const char*)info.dli_saddr));
+		else if(dladdr(e->site, &info) && info.dli_fname)
+			snprintf(site, sizeof(site), "%s+0x%lx (addr2line)",
+				strrchr(info.dli_fname, '/') ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname,
+				(unsigned long)((const char*)e->site - (const char*)info.dli_fbase));
+		else
+			snprintf(site, sizeof(site), "%p", e->site);
+		len = snprintf(line, sizeof(line),
+			"%4d %10.3f %6.2f %10llu %10llu %9.2f %9.2f %10.3f %9.2f %-6s %-18p %s\n",
+			i + 1, e->wait * ns_per_tick / 1e6, wait ? 100.0 * e->wait / wait : 0,
+			(unsigned long long)e->acquires, (unsigned long long)e->contended,
+			e->contended ? e->wait * ns_per_tick / e->contended / 1e3 : 0,
+			e->max_wait * ns_per_tick / 1e3, avg_hold * e->acquires / 1e6,
+			avg_hold / 1e3,
+			e->lock ? kind_names[e->kind] : "other", e->lock, site);
+		if(write(g_out, line, len) < 0)
+			goto out;
+	}
+out:
+	munmap(all, size);
+	__sync_lock_release(&g_reporting);
+}
+
+static inline void maybe_report(void)
+{
+	if(__builtin_expect(g_report, 0)) {
+		g_report = 0;
+		report();
+	}
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	g_report = 1;
+}
+
+__attribute__((constructor))
+static void lockprof_init(void)
+{
+	const char* v;
+	int sig = SIGUSR2;
+
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	INTERPOSE_RESOLVE(pthread_mutex_trylock);
+	INTERPOSE_RESOLVE(pthread_mutex_timedlock);
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_rdlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_tryrdlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_wrlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_trywrlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_unlock);
+	INTERPOSE_RESOLVE(pthread_cond_wait);
+	INTERPOSE_RESOLVE(pthread_cond_timedwait);
+
+	if((v = getenv("LOCKPROF_OUT")) && *v) {
+		g_out = open(v, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(g_out < 0) {
+			interpose_msg("lockprof: cannot open ", v);
+			g_out = 2;
+		}
+	}
+	if((v = getenv("LOCKPROF_SIGNAL")))
+		sig = atoi(v);
+	if((v = getenv("LOCKPROF_TOP")) && *v)
+		g_top = atoi(v);
+	if((v = getenv("LOCKPROF_HOLD")) && *v)
+		g_hold = atoi(v);
+	if(sig > 0) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_signal;
+		sa.sa_flags = SA_RESTART;
+		sigaction(sig, &sa, NULL);
+	}
+
+	g_start_ns = clock_ns();
+	g_start_ticks = ticks();
+	g_ready = 1;
+}
+
+__attribute__((destructor))
+static void lockprof_fini(void)
+{
+	if(!g_ready)
+		return;
+	report();
+	g_ready = 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t* m)
+{
+	const void* site = __builtin_return_address(0);
+	struct table* t;
+	uint64_t t0;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	if(!g_ready || !(t = my_table()))
+		return real_pthread_mutex_lock(m);
+	/* alone, glibc locks without atomics and nothing can contend */
+	if(SINGLE_THREADED()) {
+		rc = real_pthread_mutex_lock(m);
+		if(rc == 0)
+			acquired(t, m, site, K_MUTEX, 0, 0);
+		return rc;
+	}
+	if(real_pthread_mutex_trylock(m) == 0) {
+		acquired(t, m, site, K_MUTEX, 0, 0);
+		return 0;
+	}
+	t0 = ticks();
+	rc = real_pthread_mutex_lock(m);
+	if(rc == 0)
+		acquired(t, m, site, K_MUTEX, ticks() - t0, 1);
+	return rc;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* m)
+{
+	const void* site = __builtin_return_address(0);
+	struct table* t;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_trylock);
+	rc = real_pthread_mutex_trylock(m);
+	if(!g_ready || !(t = my_table()))
+		return rc;
+	if(rc == 0)
+		acquired(t, m, site, K_MUTEX, 0, 0);
+	else
+		find(t, m, site, K_MUTEX)->contended++;
+	return rc;
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t* m, const struct timespec* abstime)
+{
+	const void* site = __builtin_return_address(0);
+	struct table* t;
+	uint64_t t0;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_timedlock);
+	if(!g_ready || !(t = my_table()))
+		return real_pthread_mutex_timedlock(m, abstime);
+	if(real_pthread_mutex_trylock(m) == 0) {
+		acquired(t, m, site, K_MUTEX, 0, 0);
+		return 0;
+	}
+	t0 = ticks();
+	rc = real_pthread_mutex_timedlock(m, abstime);
+	if(rc == 0)
+		acquired(t, m, site, K_MUTEX, ticks() - t0, 1);
+	else {
+		struct entry* e = find(t, m, site, K_MUTEX);
+		e->contended++;
+		e->wait += ticks() - t0;
+	}
+	return rc;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* m)
+{
+	struct table* t = t_table;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+
+	if(t && t->nheld)
+		pop_held(t, m);
+	rc = real_pthread_mutex_unlock(m);
+	maybe_report();
+	return rc;
+}
+
+static int rwlock(pthread_rwlock_t* l, const void* site, enum kind kind)
+{
+	int (*try)(pthread_rwlock_t*) = kind == K_RDLOCK ?
+		real_pthread_rwlock_tryrdlock : real_pthread_rwlock_trywrlock;
+	int (*lock)(pthread_rwlock_t*) = kind == K_RDLOCK ?
+		real_pthread_rwlock_rdlock : real_pthread_rwlock_wrlock;
+	struct table* t;
+	uint64_t t0;
+	int rc;
+
+	if(!g_ready || !(t = my_table()))
+		return lock(l);
+	if(try(l) == 0) {
+		acquired(t, l, site, kind, 0, 0);
+		return 0;
+	}
+	t0 = ticks();
+	rc = lock(l);
+	if(rc == 0)
+		acquired(t, l, site, kind, ticks() - t0, 1);
+	return rc;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t* l)
+{
+	INTERPOSE_RESOLVE(pthread_rwlock_rdlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_tryrdlock);
+	return rwlock(l, __builtin_return_address(0), K_RDLOCK);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t* l)
+{
+	INTERPOSE_RESOLVE(pthread_rwlock_wrlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_trywrlock);
+	return rwlock(l, __builtin_return_address(0), K_WRLOCK);
+}
+
+static int tryrwlock(pthread_rwlock_t* l, const void* site, enum kind kind, int rc)
+{
+	struct table* t;
+
+	if(!g_ready || !(t = my_table()))
+		return rc;
+	if(rc == 0)
+		acquired(t, l, site, kind, 0, 0);
+	else
+		find(t, l, site, kind)->contended++;
+	return rc;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t* l)
+{
+	INTERPOSE_RESOLVE(pthread_rwlock_tryrdlock);
+	return tryrwlock(l, __builtin_return_address(0), K_RDLOCK,
+		real_pthread_rwlock_tryrdlock(l));
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t* l)
+{
+	INTERPOSE_RESOLVE(pthread_rwlock_trywrlock);
+	return tryrwlock(l, __builtin_return_address(0), K_WRLOCK,
+		real_pthread_rwlock_trywrlock(l));
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t* l)
+{
+	struct table* t = t_table;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_rwlock_unlock);
+
+	if(t && t->nheld)
+		pop_held(t, l);
+	rc = real_pthread_rwlock_unlock(l);
+	maybe_report();
+	return rc;
+}
+
+/*
+ * The time in a cond wait is counted as the wait of the cond at that
+ * site; the mutex is not held meanwhile, and taken again at the same
+ * site when the wait returns.
+ */
+static int cond_wait(pthread_cond_t* c, pthread_mutex_t* m,
+		const struct timespec* abstime, const void* site)
+{
+	struct table* t;
+	uint64_t t0, t1;
+	int rc;
+
+	if(!g_ready || !(t = my_table()))
+		return abstime ? real_pthread_cond_timedwait(c, m, abstime) :
+			real_pthread_cond_wait(c, m);
+	if(t->nheld)
+		pop_held(t, m);
+	t0 = ticks();
+	rc = abstime ? real_pthread_cond_timedwait(c, m, abstime) :
+		real_pthread_cond_wait(c, m);
+	t1 = ticks();
+	count(t, c, site, K_COND, t1 - t0, 1);
+	acquired(t, m, site, K_MUTEX, 0, 0);
+	return rc;
+}
+
+int pthread_cond_wait(pthread_cond_t* c, pthread_mutex_t* m)
+{
+	INTERPOSE_RESOLVE(pthread_cond_wait);
+	return cond_wait(c, m, NULL, __builtin_return_address(0));
+}
+
+int pthread_cond_timedwait(pthread_cond_t* c, pthread_mutex_t* m,
+		const struct timespec* abstime)
+{
+	INTERPOSE_RESOLVE(pthread_cond_timedwait);
+	return cond_wait(c, m, abstime, __builtin_return_address(0));
+}
@@ -0,0 +1,415 @@
+/*
+ * Schedule perturbation for reproducing concurrency bugs, LD_PRELOAD'ed
+ * into the program under test.
+ *
+ * Instead of the sleep(1) the patches put at the racy spots, or of
+ * looping a trigger until the timing happens to work out, this makes
+ * threads give way briefly at their synchronization points, following
+ * PCT (Burckhardt et al., "A randomized scheduler with probabilistic
+ * guarantees of finding bugs", ASPLOS 2010): every thread gets a random
+ * priority, at d-1 random steps the thread taking the step drops below
+ * all others, and at every point a thread that is not the most important
+ * live one yields or sleeps for a time that grows with its rank. A run
+ * takes milliseconds longer instead of seconds, and every seed explores
+ * another schedule.
+ *
+ * Configured from the environment:
+ *
+ *   PERTURB_SEED       seed, default from the time and pid
+ *   PERTURB_DEPTH      d, the bug depth PCT aims at (3)
+ *   PERTURB_STEPS      steps (points) a run is expected to take, the
+ *                      change points are spread over them (10000)
+ *   PERTURB_DELAY      longest preemption in us, 0 = only yield (50)
+ *   PERTURB_RATE       percent of the points that are perturbed (100)
+ *   PERTURB_POINTS     comma separated points to perturb, out of lock,
+ *                      trylock, unlock, wait, signal, create and sleep
+ *                      (all)
+ *   PERTURB_SLEEP_MAX  shorten sleep, usleep and nanosleep to at most
+ *                      this many us (not set = keep them)
+ *   PERTURB_VERBOSE    print the seed and a summary to stderr
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "interpose.h"
+
+#define MAX_THREADS 4096
+#define MAX_DEPTH 16
+
+enum point {
+	PT_LOCK = 1,
+	PT_TRYLOCK = 2,
+	PT_UNLOCK = 4,
+	PT_WAIT = 8,
+	PT_SIGNAL = 16,
+	PT_CREATE = 32,
+	PT_SLEEP = 64
+};
+
+static const char* point_names[] = {
+	"lock", "trylock", "unlock", "wait", "signal", "create", "sleep", NULL
+};
+
+INTERPOSE(int, pthread_mutex_lock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_mutex_trylock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_mutex_unlock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_cond_wait, (pthread_cond_t*, pthread_mutex_t*));
+INTERPOSE(int, pthread_cond_timedwait, (pthread_cond_t*, pthread_mutex_t*,
+	const struct timespec*));
+INTERPOSE(int, pthread_cond_signal, (pthread_cond_t*));
+INTERPOSE(int, pthread_cond_broadcast, (pthread_cond_t*));
+INTERPOSE(int, pthread_create, (pthread_t*, const pthread_attr_t*,
+	void* (*)(void*), void*));
+INTERPOSE(unsigned int, sleep, (unsigned int));
+INTERPOSE(int, usleep, (useconds_t));
+INTERPOSE(int, nanosleep, (const struct timespec*, struct timespec*));
+
+static int g_ready = 0;
+static uint64_t g_seed;
+static unsigned int g_depth = 3;
+static uint64_t g_steps_expected = 10000;
+static unsigned int g_delay = 50;
+static unsigned int g_rate = 100;
+static unsigned int g_points = ~0U;
+static long g_sleep_max = -1;
+static int g_verbose = 0;
+
+/* step counter and the steps at which the priority of a thread drops */
+static volatile uint64_t g_steps = 0;
+static uint64_t g_change[MAX_DEPTH];
+static volatile unsigned int g_next_change = 0;
+static volatile uint64_t g_delays = 0;
+
+/* live threads and their priorities, the higher the more important */
+struct slot {
+	volatile int live;
+	volatile uint64_t prio;
+};
+
+static struct slot g_slots[MAX_THREADS];
+static volatile unsigned int g_nslots = 0;
+static volatile int g_slot_lock = 0;
+static volatile unsigned int g_registered = 0;
+static pthread_key_t g_key;
+
+static __thread int t_slot = -1;
+static __thread uint64_t t_rand;
+
+static inline uint64_t mix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static inline uint64_t next_rand(void)
+{
+	t_rand ^= t_rand >> 12;
+	t_rand ^= t_rand << 25;
+	t_rand ^= t_rand >> 27;
+	return t_rand * 0x2545f4914f6cdd1dULL;
+}
+
+static void thread_gone(void* arg)
+{
+	(void)arg;
+	if(t_slot >= 0)
+		g_slots[t_slot].live = 0;
+	t_slot = -1;
+}
+
+/*
+ * Give the calling thread a slot and a random priority above all the
+ * ones change points hand out. The n-th thread to register always gets
+ * the same priority for a seed.
+ */
+static void register_thread(void)
+{
+	unsigned int n, i;
+
+	n = __sync_fetch_and_add(&g_registered, 1);
+	t_rand = mix64(g_seed ^ mix64(n + 1)) | 1;
+
+	while(__sync_lock_test_and_set(&g_slot_lock, 1))
+		sched_yield();
+	for(i=0; i < g_nslots && g_slots[i].live; ++i)
+		;
+	if(i == g_nslots && g_nslots < MAX_THREADS)
+		g_nslots++;
+	if(i < MAX_THREADS) {
+		g_slots[i].prio = g_depth + (next_rand() >> 8);
+		g_slots[i].live = 1;
+		t_slot = i;
+	}
+	__sync_lock_release(&g_slot_lock);
+
+	/* a value, so that thread_gone runs at thread exit */
+	pthread_setspecific(g_key, &g_slots[0]);
+}
+
+/* yield or sleep depending on how many live threads are more important */
+static void give_way(void)
+{
+	uint64_t mine = g_slots[t_slot].prio;
+	unsigned int i, live = 0, rank = 0;
+	struct timespec ts;
+	unsigned int us;
+
+	for(i=0; i < g_nslots; ++i) {
+		if(!g_slots[i].live)
+			continue;
+		live++;
+		if(g_slots[i].prio > mine)
+			rank++;
+	}
+	if(!rank)
+		return;
+	__sync_fetch_and_add(&g_delays, 1);
+	us = g_delay * rank / (live - 1);
+	if(!us) {
+		sched_yield();
+		return;
+	}
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	real_nanosleep(&ts, NULL);
+}
+
+static void point(enum point kind)
+{
+	uint64_t step;
+	unsigned int c;
+
+	if(!g_ready || !(g_points & kind))
+		return;
+	if(t_slot < 0) {
+		register_thread();
+		if(t_slot < 0)
+			return;
+	}
+
+	step = __sync_add_and_fetch(&g_steps, 1);
+	c = g_next_change;
+	if(c < g_depth - 1 && step >= g_change[c] &&
+			__sync_bool_compare_and_swap(&g_next_change, c, c + 1))
+		g_slots[t_slot].prio = g_depth - 2 - c;
+
+	if(g_rate < 100 && next_rand() % 100 >= g_rate)
+		return;
+	give_way();
+}
+
+static unsigned long env_ulong(const char* name, unsigned long def)
+{
+	const char* v = getenv(name);
+	return v && *v ? strtoul(v, NULL, 10) : def;
+}
+
+static void parse_points(const char* spec)
+{
+	char buf[256];
+	char* tok;
+	unsigned int i;
+
+	g_points = 0;
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for(tok=strtok(buf, ","); tok; tok=strtok(NULL, ",")) {
+		for(i=0; point_names[i] && strcmp(tok, point_names[i]); ++i)
+			;
+		if(point_names[i])
+			g_points |= 1U << i;
+		else
+			interpose_msg("perturb: unknown point ", tok);
+	}
+}
+
+__attribute__((constructor))
+static void perturb_init(void)
+{
+	const char* v;
+	unsigned int i, j;
+	struct timeval tv;
+
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	INTERPOSE_RESOLVE(pthread_mutex_trylock);
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+	INTERPOSE_RESOLVE(pthread_cond_wait);
+	INTERPOSE_RESOLVE(pthread_cond_timedwait);
+	INTERPOSE_RESOLVE(pthread_cond_signal);
+	INTERPOSE_RESOLVE(pthread_cond_broadcast);
+	INTERPOSE_RESOLVE(pthread_create);
+	INTERPOSE_RESOLVE(sleep);
+	INTERPOSE_RESOLVE(usleep);
+	INTERPOSE_RESOLVE(nanosleep);
+
+	gettimeofday(&tv, NULL);
+	g_seed = env_ulong("PERTURB_SEED", tv.tv_sec * 1000003ULL ^ tv.tv_usec ^ getpid());
+	g_depth = env_ulong("PERTURB_DEPTH", g_depth);
+	if(g_depth < 1)
+		g_depth = 1;
+	if(g_depth > MAX_DEPTH)
+		g_depth = MAX_DEPTH;
+	g_steps_expected = env_ulong("PERTURB_STEPS", g_steps_expected);
+	if(!g_steps_expected)
+		g_steps_expected = 1;
+	g_delay = env_ulong("PERTURB_DELAY", g_delay);
+	g_rate = env_ulong("PERTURB_RATE", g_rate);
+	if((v = getenv("PERTURB_POINTS")) && *v)
+		parse_points(v);
+	if((v = getenv("PERTURB_SLEEP_MAX")) && *v)
+		g_sleep_max = strtol(v, NULL, 10);
+	g_verbose = getenv("PERTURB_VERBOSE") != NULL;
+
+	/* d-1 change points, uniform over the expected steps and sorted */
+	t_rand = mix64(g_seed) | 1;
+	for(i=0; i + 1 < g_depth; ++i) {
+		uint64_t s = 1 + next_rand() % g_steps_expected;
+		for(j=i; j > 0 && g_change[j - 1] > s; --j)
+			g_change[j] = g_change[j - 1];
+		g_change[j] = s;
+	}
+
+	pthread_key_create(&g_key, thread_gone);
+	if(g_verbose) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "%llu", (unsigned long long)g_seed);
+		interpose_msg("perturb: seed ", msg);
+	}
+	g_ready = 1;
+}
+
+__attribute__((destructor))
+static void perturb_fini(void)
+{
+	char msg[128];
+
+	if(!g_verbose)
+		return;
+	snprintf(msg, sizeof(msg), "%llu steps, %llu preemptions, %u threads",
+		(unsigned long long)g_steps, (unsigned long long)g_delays,
+		g_registered);
+	interpose_msg("perturb: ", msg);
+}
+
+int pthread_mutex_lock(pthread_mutex_t* m)
+{
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	point(PT_LOCK);
+	return real_pthread_mutex_lock(m);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* m)
+{
+	INTERPOSE_RESOLVE(pthread_mutex_trylock);
+	point(PT_TRYLOCK);
+	return real_pthread_mutex_trylock(m);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* m)
+{
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+	rc = real_pthread_mutex_unlock(m);
+	point(PT_UNLOCK);
+	return rc;
+}
+
+int pthread_cond_wait(pthread_cond_t* c, pthread_mutex_t* m)
+{
+	INTERPOSE_RESOLVE(pthread_cond_wait);
+	point(PT_WAIT);
+	return real_pthread_cond_wait(c, m);
+}
+
+int pthread_cond_timedwait(pthread_cond_t* c, pthread_mutex_t* m,
+		const struct timespec* abstime)
+{
+	INTERPOSE_RESOLVE(pthread_cond_timedwait);
+	point(PT_WAIT);
+	return real_pthread_cond_timedwait(c, m, abstime);
+}
+
+int pthread_cond_signal(pthread_cond_t* c)
+{
+	INTERPOSE_RESOLVE(pthread_cond_signal);
+	point(PT_SIGNAL);
+	return real_pthread_cond_signal(c);
+}
+
+int pthread_cond_broadcast(pthread_cond_t* c)
+{
+	INTERPOSE_RESOLVE(pthread_cond_broadcast);
+	point(PT_SIGNAL);
+	return real_pthread_cond_broadcast(c);
+}
+
+int pthread_create(pthread_t* t, const pthread_attr_t* attr,
+		void* (*start)(void*), void* arg)
+{
+	INTERPOSE_RESOLVE(pthread_create);
+	point(PT_CREATE);
+	return real_pthread_create(t, attr, start, arg);
+}
+
+/* sleep at most g_sleep_max us if that is set, returns what is left */
+static int capped_sleep(const struct timespec* req, struct timespec* rem)
+{
+	struct timespec ts = *req;
+	long long us = (long long)req->tv_sec * 1000000 + req->tv_nsec / 1000;
+
+	point(PT_SLEEP);
+	if(g_sleep_max < 0 || us <= g_sleep_max)
+		return real_nanosleep(req, rem);
+	ts.tv_sec = g_sleep_max / 1000000;
+	ts.tv_nsec = (g_sleep_max % 1000000) * 1000;
+	if(rem)
+		rem->tv_sec = rem->tv_nsec = 0;
+	return real_nanosleep(&ts, NULL);
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+	struct timespec ts = { seconds, 0 }, rem = { 0, 0 };
+
+	INTERPOSE_RESOLVE(sleep);
+	INTERPOSE_RESOLVE(nanosleep);
+	if(g_sleep_max < 0) {
+		point(PT_SLEEP);
+		return real_sleep(seconds);
+	}
+	if(capped_sleep(&ts, &rem) < 0 && errno == EINTR)
+		return rem.tv_sec;
+	return 0;
+}
+
+int usleep(useconds_t usec)
+{
+	struct timespec ts = { usec / 1000000, (usec % 1000000) * 1000 };
+
+	INTERPOSE_RESOLVE(usleep);
+	INTERPOSE_RESOLVE(nanosleep);
+	if(g_sleep_max < 0) {
+		point(PT_SLEEP);
+		return real_usleep(usec);
+	}
+	return capped_sleep(&ts, NULL);
+}
+
+int nanosleep(const struct timespec* req, struct timespec* rem)
+{
+	INTERPOSE_RESOLVE(nanosleep);
+	return capped_sleep(req, rem);
+}
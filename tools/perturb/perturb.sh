@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Run a command many times under libperturb.so, each time with the next
+# seed, several at once, and print the seeds it failed with. A failure is
+# a non-zero exit, a signal or a hang (longer than -t seconds). Rerunning
+# with PERTURB_SEED set to a printed seed replays that attempt with the
+# same priorities and change points.
+#
+#   ./perturb.sh -n 1000 -j 8 -- ../../stringbuffer-jdk1.4/main
+#
+# The PERTURB_* variables of the environment are passed on, see
+# perturb.c.
+
+LIB=$(cd $(dirname $0) && pwd)/libperturb.so
+ATTEMPTS=100
+JOBS=$(nproc 2>/dev/null || echo 1)
+TIMEOUT=10
+FIRST=1
+
+usage() {
+	echo "usage: $0 [-n attempts] [-j jobs] [-t timeout_s] [-s first_seed] [--] command [args]"
+	echo "  -n  attempts, default $ATTEMPTS"
+	echo "  -j  attempts at once, default $JOBS"
+	echo "  -t  seconds before an attempt counts as hung, default $TIMEOUT"
+	echo "  -s  seed of the first attempt, default $FIRST"
+	exit 1
+}
+
+while getopts n:j:t:s: opt; do
+	case $opt in
+	n) ATTEMPTS=$OPTARG ;;
+	j) JOBS=$OPTARG ;;
+	t) TIMEOUT=$OPTARG ;;
+	s) FIRST=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || usage
+
+if [ ! -f $LIB ]; then
+	echo "$LIB not found, build it with 'make' first (see INSTALL)"
+	exit 1
+fi
+
+FAILS=$(mktemp /tmp/perturb.XXXXXX)
+trap 'rm -f $FAILS' EXIT
+
+t0=$(date +%s.%N)
+seq $FIRST $((FIRST + ATTEMPTS - 1)) | xargs -P $JOBS -I{} sh -c '
+	t=$1
+	shift
+	PERTURB_SEED={} LD_PRELOAD=$0 timeout -s KILL $t "$@" >/dev/null 2>&1 </dev/null
+	rc=$?
+	case $rc in
+	0) ;;
+	137) echo "seed {}: hang" ;;
+	*) [ $rc -gt 128 ] && echo "seed {}: signal $((rc - 128))" || echo "seed {}: exit $rc" ;;
+	esac' $LIB $TIMEOUT "$@" | tee $FAILS
+t1=$(date +%s.%N)
+
+awk -v n=$ATTEMPTS -v f=$(wc -l <$FAILS) -v t="$t0 $t1" 'BEGIN {
+	split(t, s, " ")
+	printf "%d of %d attempts failed (%.1f%%), %.1f attempts/s, %.1f ms per attempt\n",
+		f, n, 100 * f / n, n / (s[2] - s[1]), 1000 * (s[2] - s[1]) / n
+}'
@@ -0,0 +1,942 @@
+/*
+ * Sampling data race detector.
+ *
+ * A runtime for the instrumentation gcc emits with -fsanitize=thread
+ * (__tsan_read4, __tsan_func_entry, __tsan_atomic32_load ...), linked
+ * in place of libtsan. Instead of checking every access against shadow
+ * memory, it samples one access in RACEDET_RATE (a random gap per
+ * thread) and puts a watch on its address: the access, its thread, its
+ * vector clock epoch and its stack go into a direct mapped table, and a
+ * bit is set in a small bitmap. Every other access only counts down and
+ * tests the bit of its address; when that is set, the access is checked
+ * against the watched one with happens-before (vector clocks, updated
+ * by the intercepted pthread calls and the atomics), and a write racing
+ * with an unordered access of another thread is reported with both
+ * stacks. A race is found with a probability of about the sampling
+ * rate per occurrence rather than its square, at a cost close to that
+ * of the instrumentation calls themselves.
+ *
+ * Configured from the environment:
+ *
+ *   RACEDET_RATE     sample one access in that many (1000), 1 watches
+ *                    every access
+ *   RACEDET_SEED     seed of the sampling gaps (from the time)
+ *   RACEDET_OUT      file the reports go to (stderr)
+ *   RACEDET_MAX      distinct races reported (100)
+ *
+ * Limitations: a granule is 8 bytes and an access is checked in the
+ * granule of its first byte, against the watched ones it overlaps; at
+ * most MAX_SLOTS threads run at once (slots of exited threads are
+ * reused, races between two threads of the same slot are missed);
+ * memcpy and friends are not checked;
+ * synchronization the runtime does not see (custom spinlocks with
+ * plain accesses, futexes) gives false reports.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "interpose.h"
+
+#define MAX_SLOTS 256		/* threads alive at once */
+#define MAX_DEPTH 64		/* shadow stack */
+#define SAVED_FRAMES 8		/* frames kept with a watched access */
+#define BITS_LOG 22		/* watch bitmap, 512KB */
+#define WATCH_LOG 16		/* watched granules */
+#define SYNC_BUCKETS 65536
+#define SYNC_CHUNK 1024		/* sync objects allocated at once */
+#define MAX_RACES 1024
+#define SEEN 4096		/* watches a thread remembers having checked */
+
+#define TLS __attribute__((tls_model("initial-exec"))) __thread
+
+typedef uint32_t epoch_t;
+
+/* a vector clock, one epoch per slot */
+struct vclock {
+	epoch_t c[MAX_SLOTS];
+};
+
+struct thr {
+	int slot;
+	uint64_t rand;
+	int depth;
+	void* stack[MAX_DEPTH];
+	/*
+	 * watch index and version checked last, and whether by a write:
+	 * clocks only grow, once ordered after a watched access a thread
+	 * stays so, and a race is reported once
+	 */
+	uint64_t seen[SEEN];
+	struct vclock vc;
+};
+
+struct access {
+	uint16_t slot;
+	uint8_t size;
+	uint8_t offset;		/* in the granule */
+	uint8_t valid;
+	epoch_t epoch;
+	int nframes;
+	void* frames[SAVED_FRAMES];
+};
+
+/* the last sampled write and read of a granule */
+struct watch {
+	volatile int lock;
+	volatile uint32_t version;	/* bumped when an access is watched */
+	uintptr_t granule;
+	uint32_t bit;
+	struct access write;
+	struct access read;
+};
+
+/* what a lock, cond, atomic or finished thread releases */
+struct sync {
+	struct sync* next;
+	uintptr_t addr;
+	volatile int lock;
+	struct vclock vc;
+};
+
+struct bucket {
+	volatile int lock;
+	struct sync* head;
+};
+
+struct start {
+	void* (*fn)(void*);
+	void* arg;
+	struct vclock vc;
+};
+
+INTERPOSE(int, pthread_create, (pthread_t*, const pthread_attr_t*,
+	void* (*)(void*), void*));
+INTERPOSE(int, pthread_join, (pthread_t, void**));
+INTERPOSE(int, pthread_mutex_lock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_mutex_trylock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_mutex_unlock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_rwlock_rdlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_wrlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_tryrdlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_trywrlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_unlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_cond_wait, (pthread_cond_t*, pthread_mutex_t*));
+INTERPOSE(int, pthread_cond_timedwait, (pthread_cond_t*, pthread_mutex_t*,
+	const struct timespec*));
+INTERPOSE(int, pthread_cond_signal, (pthread_cond_t*));
+INTERPOSE(int, pthread_cond_broadcast, (pthread_cond_t*));
+INTERPOSE(int, sem_wait, (sem_t*));
+INTERPOSE(int, sem_trywait, (sem_t*));
+INTERPOSE(int, sem_post, (sem_t*));
+
+extern void __libc_free(void*);
+
+static int g_ready = 0;
+static unsigned int g_rate = 1000;
+static uint64_t g_seed;
+static int g_out = 2;
+static unsigned int g_max_races = 100;
+
+static uint64_t g_bits[(1 << BITS_LOG) / 64];
+static struct watch* g_watches;
+static struct bucket g_buckets[SYNC_BUCKETS];
+static volatile int g_pool_lock = 0;
+static struct sync* g_pool = NULL;
+static int g_pool_left = 0;
+
+/* thread slots */
+static volatile int g_slot_lock = 0;
+static int g_slot_used[MAX_SLOTS];
+static epoch_t g_slot_epoch[MAX_SLOTS];	/* last epoch of the slot's previous thread */
+static volatile int g_nslots = 0;	/* highest slot used + 1 */
+static pthread_key_t g_key;
+
+/* reported pairs of sites */
+static volatile int g_race_lock = 0;
+static void* g_races[MAX_RACES][2];
+static unsigned int g_nraces = 0;
+
+static volatile uint64_t g_samples = 0;
+static volatile uint64_t g_checks = 0;
+
+static TLS struct thr* t_thr;
+static TLS uint32_t t_countdown;
+
+static inline void spin_lock(volatile int* l)
+{
+	while(__sync_lock_test_and_set(l, 1))
+		while(*l)
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#else
+			;
+#endif
+}
+
+static inline void spin_unlock(volatile int* l)
+{
+	__sync_lock_release(l);
+}
+
+static inline uint32_t granule_bit(uintptr_t g)
+{
+	return (uint32_t)((g * 0x9e3779b97f4a7c15ULL) >> (64 - BITS_LOG));
+}
+
+static inline uint64_t next_rand(struct thr* t)
+{
+	t->rand ^= t->rand >> 12;
+	t->rand ^= t->rand << 25;
+	t->rand ^= t->rand >> 27;
+	return t->rand * 0x2545f4914f6cdd1dULL;
+}
+
+static void* alloc(size_t size)
+{
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(p == MAP_FAILED) {
+		interpose_msg("racedet: ", "out of memory");
+		abort();
+	}
+	return p;
+}
+
+/*
+ * Vector clocks
+ */
+
+static inline void vc_join(struct vclock* to, const struct vclock* from)
+{
+	int i, n = g_nslots;
+
+	for(i=0; i < n; ++i)
+		if(from->c[i] > to->c[i])
+			to->c[i] = from->c[i];
+}
+
+static struct sync* find_sync(const void* addr)
+{
+	uintptr_t a = (uintptr_t)addr;
+	struct bucket* b = &g_buckets[(a * 0x9e3779b97f4a7c15ULL) >> 48];
+	struct sync* s;
+
+	spin_lock(&b->lock);
+	for(s=b->head; s; s=s->next)
+		if(s->addr == a)
+			break;
+	if(!s) {
+		spin_lock(&g_pool_lock);
+		if(!g_pool_left) {
+			g_pool = alloc(SYNC_CHUNK * sizeof(struct sync));
+			g_pool_left = SYNC_CHUNK;
+		}
+		s = g_pool++;
+		g_pool_left--;
+		spin_unlock(&g_pool_lock);
+		s->addr = a;
+		s->next = b->head;
+		b->head = s;
+	}
+	spin_unlock(&b->lock);
+	return s;
+}
+
+/* what the thread did so far happens before whoever acquires addr */
+static void release(const void* addr)
+{
+	struct thr* t = t_thr;
+	struct sync* s;
+
+	/* threads the runtime does not know, or no more, are not tracked */
+	if(!t)
+		return;
+	s = find_sync(addr);
+	spin_lock(&s->lock);
+	vc_join(&s->vc, &t->vc);
+	spin_unlock(&s->lock);
+	t->vc.c[t->slot]++;
+}
+
+static void acquire(const void* addr)
+{
+	struct thr* t = t_thr;
+	struct sync* s;
+
+	if(!t)
+		return;
+	s = find_sync(addr);
+	spin_lock(&s->lock);
+	vc_join(&t->vc, &s->vc);
+	spin_unlock(&s->lock);
+}
+
+/*
+ * Threads
+ */
+
+static void thread_gone(void* arg)
+{
+	struct thr* t = t_thr;
+	struct sync* s;
+
+	(void)arg;
+	if(!t)
+		return;
+	/* for pthread_join */
+	s = find_sync((void*)pthread_self());
+	spin_lock(&s->lock);
+	vc_join(&s->vc, &t->vc);
+	spin_unlock(&s->lock);
+
+	spin_lock(&g_slot_lock);
+	g_slot_epoch[t->slot] = t->vc.c[t->slot];
+	g_slot_used[t->slot] = 0;
+	spin_unlock(&g_slot_lock);
+	t_thr = NULL;
+	munmap(t, sizeof(*t));
+}
+
+static struct thr* thread_init(const struct vclock* parent)
+{
+	static volatile uint64_t n = 0;
+	struct thr* t;
+	int slot;
+
+	t = alloc(sizeof(*t));
+	spin_lock(&g_slot_lock);
+	for(slot=0; slot < MAX_SLOTS && g_slot_used[slot]; ++slot)
+		;
+	if(slot == MAX_SLOTS) {
+		spin_unlock(&g_slot_lock);
+		interpose_msg("racedet: ", "too many threads");
+		abort();
+	}
+	g_slot_used[slot] = 1;
+	if(slot >= g_nslots)
+		g_nslots = slot + 1;
+	spin_unlock(&g_slot_lock);
+
+	t->slot = slot;
+	if(parent)
+		t->vc = *parent;
+	t->vc.c[slot] = g_slot_epoch[slot] + 1;
+	t->rand = (g_seed ^ (__sync_add_and_fetch(&n, 1) * 0x9e3779b97f4a7c15ULL)) | 1;
+	t_countdown = 1 + next_rand(t) % (2 * g_rate);
+	t_thr = t;
+	pthread_setspecific(g_key, t);
+	return t;
+}
+
+static void* thread_start(void* arg)
+{
+	struct start st = *(struct start*)arg;
+
+	__libc_free(arg);
+	thread_init(&st.vc);
+	return st.fn(st.arg);
+}
+
+/*
+ * Reports
+ */
+
+static int format_frame(char* buf, size_t size, int i, void* pc)
+{
+	Dl_info info;
+	const char* obj;
+
+	if(!dladdr(pc, &info) || !info.dli_fname)
+		return snprintf(buf, size, "    #%d %p\n", i, pc);
+	obj = strrchr(info.dli_fname, '/') ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname;
+	if(info.dli_sname)
+		return snprintf(buf, size, "    #%d %s+0x%lx (%s+0x%lx)\n", i, info.dli_sname,
+			(unsigned long)((char*)pc - (char*)info.dli_saddr), obj,
+			(unsigned long)((char*)pc - (char*)info.dli_fbase));
+	return snprintf(buf, size, "    #%d %s+0x%lx\n", i, obj,
+		(unsigned long)((char*)pc - (char*)info.dli_fbase));
+}
+
+static void save_stack(struct thr* t, void* pc, struct access* a)
+{
+	int i;
+
+	a->frames[0] = pc;
+	for(i=1; i < SAVED_FRAMES && i <= t->depth; ++i)
+		a->frames[i] = t->stack[t->depth - i];
+	a->nframes = i;
+}
+
+static void report(uintptr_t addr, const struct access* old, int old_write,
+		const struct access* cur, int cur_write)
+{
+	char buf[4096];
+	int len, i;
+
+	/* once per pair of sites */
+	spin_lock(&g_race_lock);
+	for(i=0; i < (int)g_nraces; ++i)
+		if(g_races[i][0] == old->frames[0] && g_races[i][1] == cur->frames[0])
+			break;
+	if(i < (int)g_nraces || g_nraces >= g_max_races || g_nraces == MAX_RACES) {
+		spin_unlock(&g_race_lock);
+		return;
+	}
+	g_races[g_nraces][0] = old->frames[0];
+	g_races[g_nraces][1] = cur->frames[0];
+	g_nraces++;
+
+	len = snprintf(buf, sizeof(buf), "racedet: race on %p\n  %s of %d bytes by thread %d:\n",
+		(void*)addr, old_write ? "write" : "read", old->size, old->slot);
+	for(i=0; i < old->nframes && len < (int)sizeof(buf) - 256; ++i)
+		len += format_frame(buf + len, sizeof(buf) - len, i, old->frames[i]);
+	len += snprintf(buf + len, sizeof(buf) - len, "  %s of %d bytes by thread %d, now:\n",
+		cur_write ? "write" : "read", cur->size, cur->slot);
+	for(i=0; i < cur->nframes && len < (int)sizeof(buf) - 256; ++i)
+		len += format_frame(buf + len, sizeof(buf) - len, i, cur->frames[i]);
+	if(write(g_out, buf, len) < 0)
+		len = 0;
+	spin_unlock(&g_race_lock);
+}
+
+/*
+ * Accesses
+ */
+
+/* whether the thread is ordered after a, whatever bytes it touches */
+static inline int after(const struct thr* t, const struct access* a)
+{
+	return !a->valid || a->slot == t->slot || t->vc.c[a->slot] >= a->epoch;
+}
+
+/* whether an access of the thread at offset..offset+size cannot race with a */
+static inline int ordered(const struct thr* t, const struct access* a, int offset, int size)
+{
+	return after(t, a) || a->offset + a->size <= offset || offset + size <= a->offset;
+}
+
+/* checks an access against the watch of its granule, samples it if asked */
+static void __attribute__((noinline)) slow_access(uintptr_t addr, int size, int is_write,
+		void* pc, int sample)
+{
+	uintptr_t g = addr >> 3;
+	uint32_t bit = granule_bit(g);
+	uint32_t idx = bit & ((1 << WATCH_LOG) - 1);
+	struct watch* w = &g_watches[idx];
+	struct thr* t = t_thr;
+	struct access cur;
+	uint64_t* seen;
+	uint64_t key;
+	int racy_write = 0, racy_read = 0;
+
+	if(!t) {
+		t_countdown = 0;
+		return;
+	}
+	seen = &t->seen[idx & (SEEN - 1)];
+	if(sample)
+		t_countdown = 1 + next_rand(t) % (2 * g_rate);
+	else {
+		/* a write also checks the watched read, a read does not */
+		key = ((uint64_t)idx << 33) | ((uint64_t)w->version << 1);
+		if(w->granule != g || *seen == (key | is_write) || (!is_write && *seen == (key | 1)))
+			return;
+	}
+	/* skip rather than wait, it is only a sample */
+	if(__sync_lock_test_and_set(&w->lock, 1))
+		return;
+	if(w->granule == g) {
+		__sync_fetch_and_add(&g_checks, 1);
+		racy_write = !ordered(t, &w->write, addr & 7, size);
+		racy_read = is_write && !ordered(t, &w->read, addr & 7, size);
+		/* remember the granule only when no offset in it can race */
+		key = ((uint64_t)idx << 33) | ((uint64_t)w->version << 1);
+		if(after(t, &w->write) && (!is_write || after(t, &w->read)) &&
+				(is_write || *seen != (key | 1)))
+			*seen = key | is_write;
+	}
+	if(racy_write || racy_read || sample) {
+		cur.slot = t->slot;
+		cur.size = size;
+		cur.offset = addr & 7;
+		cur.valid = 1;
+		cur.epoch = t->vc.c[t->slot];
+		save_stack(t, pc, &cur);
+	}
+	if(racy_write)
+		report(addr, &w->write, 1, &cur, is_write);
+	if(racy_read)
+		report(addr, &w->read, 0, &cur, is_write);
+
+	if(sample) {
+		__sync_fetch_and_add(&g_samples, 1);
+		if(w->granule != g) {
+			if(w->granule)
+				__sync_fetch_and_and(&g_bits[w->bit >> 6], ~(1ULL << (w->bit & 63)));
+			w->granule = g;
+			w->bit = bit;
+			w->write.valid = w->read.valid = 0;
+			__sync_fetch_and_or(&g_bits[bit >> 6], 1ULL << (bit & 63));
+		}
+		if(is_write)
+			w->write = cur;
+		else
+			w->read = cur;
+		w->version++;
+	}
+	__sync_lock_release(&w->lock);
+}
+
+static inline void on_access(const volatile void* p, int size, int is_write, void* pc)
+{
+	uintptr_t addr = (uintptr_t)p;
+	uint32_t bit;
+
+	if(__builtin_expect(--t_countdown == 0, 0)) {
+		slow_access(addr, size, is_write, pc, 1);
+		return;
+	}
+	bit = granule_bit(addr >> 3);
+	if(__builtin_expect(g_bits[bit >> 6] & (1ULL << (bit & 63)), 0))
+		slow_access(addr, size, is_write, pc, 0);
+}
+
+#define ACCESS(name, size, is_write) \
+	void __tsan_##name(void* p) \
+	{ \
+		on_access(p, size, is_write, __builtin_return_address(0)); \
+	}
+
+ACCESS(read1, 1, 0)
+ACCESS(read2, 2, 0)
+ACCESS(read4, 4, 0)
+ACCESS(read8, 8, 0)
+ACCESS(read16, 16, 0)
+ACCESS(write1, 1, 1)
+ACCESS(write2, 2, 1)
+ACCESS(write4, 4, 1)
+ACCESS(write8, 8, 1)
+ACCESS(write16, 16, 1)
+ACCESS(unaligned_read2, 2, 0)
+ACCESS(unaligned_read4, 4, 0)
+ACCESS(unaligned_read8, 8, 0)
+ACCESS(unaligned_read16, 16, 0)
+ACCESS(unaligned_write2, 2, 1)
+ACCESS(unaligned_write4, 4, 1)
+ACCESS(unaligned_write8, 8, 1)
+ACCESS(unaligned_write16, 16, 1)
+ACCESS(volatile_read1, 1, 0)
+ACCESS(volatile_read2, 2, 0)
+ACCESS(volatile_read4, 4, 0)
+ACCESS(volatile_read8, 8, 0)
+ACCESS(volatile_read16, 16, 0)
+ACCESS(volatile_write1, 1, 1)
+ACCESS(volatile_write2, 2, 1)
+ACCESS(volatile_write4, 4, 1)
+ACCESS(volatile_write8, 8, 1)
+ACCESS(volatile_write16, 16, 1)
+
+/* a range is checked at its start only */
+void __tsan_read_range(void* p, unsigned long size)
+{
+	if(size)
+		on_access(p, size > 255 ? 255 : size, 0, __builtin_return_address(0));
+}
+
+void __tsan_write_range(void* p, unsigned long size)
+{
+	if(size)
+		on_access(p, size > 255 ? 255 : size, 1, __builtin_return_address(0));
+}
+
+void __tsan_vptr_read(void** p)
+{
+	on_access(p, 8, 0, __builtin_return_address(0));
+}
+
+void __tsan_vptr_update(void** p, void* v)
+{
+	/* setting the same vptr again, as constructors do, is no race */
+	if(*p != v)
+		on_access(p, 8, 1, __builtin_return_address(0));
+}
+
+void __tsan_func_entry(void* pc)
+{
+	struct thr* t = t_thr;
+
+	if(__builtin_expect(t != NULL, 1)) {
+		if(t->depth < MAX_DEPTH)
+			t->stack[t->depth] = pc;
+		t->depth++;
+	}
+}
+
+void __tsan_func_exit(void)
+{
+	struct thr* t = t_thr;
+
+	if(__builtin_expect(t != NULL, 1) && t->depth > 0)
+		t->depth--;
+}
+
+/*
+ * Atomics: performed sequentially consistent whatever the order asked,
+ * and acquire and release on their address unless relaxed.
+ */
+
+#define MO_RELAXED 0
+#define MO_CONSUME 1
+#define MO_ACQUIRE 2
+#define MO_RELEASE 3
+
+static inline void atomic_before(const volatile void* p, int mo)
+{
+	if(mo >= MO_RELEASE)
+		release((const void*)p);
+}
+
+static inline void atomic_after(const volatile void* p, int mo)
+{
+	if(mo != MO_RELAXED && mo != MO_RELEASE)
+		acquire((const void*)p);
+}
+
+#define ATOMIC_RMW(bits, type, op, builtin) \
+	type __tsan_atomic##bits##_##op(volatile type* p, type v, int mo) \
+	{ \
+		type r; \
+		atomic_before(p, mo); \
+		r = builtin(p, v, __ATOMIC_SEQ_CST); \
+		atomic_after(p, mo); \
+		return r; \
+	}
+
+#define ATOMICS(bits, type) \
+	type __tsan_atomic##bits##_load(const volatile type* p, int mo) \
+	{ \
+		type r = __atomic_load_n(p, __ATOMIC_SEQ_CST); \
+		atomic_after(p, mo); \
+		return r; \
+	} \
+	void __tsan_atomic##bits##_store(volatile type* p, type v, int mo) \
+	{ \
+		atomic_before(p, mo); \
+		__atomic_store_n(p, v, __ATOMIC_SEQ_CST); \
+	} \
+	ATOMIC_RMW(bits, type, exchange, __atomic_exchange_n) \
+	ATOMIC_RMW(bits, type, fetch_add, __atomic_fetch_add) \
+	ATOMIC_RMW(bits, type, fetch_sub, __atomic_fetch_sub) \
+	ATOMIC_RMW(bits, type, fetch_and, __atomic_fetch_and) \
+	ATOMIC_RMW(bits, type, fetch_or, __atomic_fetch_or) \
+	ATOMIC_RMW(bits, type, fetch_xor, __atomic_fetch_xor) \
+	ATOMIC_RMW(bits, type, fetch_nand, __atomic_fetch_nand) \
+	int __tsan_atomic##bits##_compare_exchange_strong(volatile type* p, type* c, type v, \
+			int mo, int fmo) \
+	{ \
+		int r; \
+		(void)fmo; \
+		atomic_before(p, mo); \
+		r = __atomic_compare_exchange_n(p, c, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+		atomic_after(p, mo); \
+		return r; \
+	} \
+	int __tsan_atomic##bits##_compare_exchange_weak(volatile type* p, type* c, type v, \
+			int mo, int fmo) \
+	{ \
+		return __tsan_atomic##bits##_compare_exchange_strong(p, c, v, mo, fmo); \
+	} \
+	type __tsan_atomic##bits##_compare_exchange_val(volatile type* p, type c, type v, \
+			int mo, int fmo) \
+	{ \
+		__tsan_atomic##bits##_compare_exchange_strong(p, &c, v, mo, fmo); \
+		return c; \
+	}
+
+ATOMICS(8, uint8_t)
+ATOMICS(16, uint16_t)
+ATOMICS(32, uint32_t)
+ATOMICS(64, uint64_t)
+/* no 128 bit ones, they would need libatomic */
+
+void __tsan_atomic_thread_fence(int mo)
+{
+	(void)mo;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void __tsan_atomic_signal_fence(int mo)
+{
+	(void)mo;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Synchronization
+ */
+
+int pthread_create(pthread_t* th, const pthread_attr_t* attr,
+		void* (*fn)(void*), void* arg)
+{
+	struct start* st;
+	struct thr* t;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_create);
+	t = t_thr;
+	if(!t)
+		return real_pthread_create(th, attr, fn, arg);
+	st = malloc(sizeof(*st));
+	st->fn = fn;
+	st->arg = arg;
+	st->vc = t->vc;
+	t->vc.c[t->slot]++;
+	rc = real_pthread_create(th, attr, thread_start, st);
+	if(rc != 0)
+		free(st);
+	return rc;
+}
+
+int pthread_join(pthread_t th, void** ret)
+{
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_join);
+	rc = real_pthread_join(th, ret);
+	if(rc == 0)
+		acquire((void*)th);
+	return rc;
+}
+
+int pthread_mutex_lock(pthread_mutex_t* m)
+{
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	rc = real_pthread_mutex_lock(m);
+	if(rc == 0)
+		acquire(m);
+	return rc;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* m)
+{
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_trylock);
+	rc = real_pthread_mutex_trylock(m);
+	if(rc == 0)
+		acquire(m);
+	return rc;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* m)
+{
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+	release(m);
+	return real_pthread_mutex_unlock(m);
+}
+
+#define RWLOCK(name) \
+	int pthread_rwlock_##name(pthread_rwlock_t* l) \
+	{ \
+		int rc; \
+		INTERPOSE_RESOLVE(pthread_rwlock_##name); \
+		rc = real_pthread_rwlock_##name(l); \
+		if(rc == 0) \
+			acquire(l); \
+		return rc; \
+	}
+
+RWLOCK(rdlock)
+RWLOCK(wrlock)
+RWLOCK(tryrdlock)
+RWLOCK(trywrlock)
+
+int pthread_rwlock_unlock(pthread_rwlock_t* l)
+{
+	INTERPOSE_RESOLVE(pthread_rwlock_unlock);
+	release(l);
+	return real_pthread_rwlock_unlock(l);
+}
+
+int pthread_cond_wait(pthread_cond_t* c, pthread_mutex_t* m)
+{
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_cond_wait);
+	release(m);
+	rc = real_pthread_cond_wait(c, m);
+	acquire(m);
+	acquire(c);
+	return rc;
+}
+
+int pthread_cond_timedwait(pthread_cond_t* c, pthread_mutex_t* m,
+		const struct timespec* abstime)
+{
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_cond_timedwait);
+	release(m);
+	rc = real_pthread_cond_timedwait(c, m, abstime);
+	acquire(m);
+	acquire(c);
+	return rc;
+}
+
+int pthread_cond_signal(pthread_cond_t* c)
+{
+	INTERPOSE_RESOLVE(pthread_cond_signal);
+	release(c);
+	return real_pthread_cond_signal(c);
+}
+
+int pthread_cond_broadcast(pthread_cond_t* c)
+{
+	INTERPOSE_RESOLVE(pthread_cond_broadcast);
+	release(c);
+	return real_pthread_cond_broadcast(c);
+}
+
+int sem_wait(sem_t* s)
+{
+	int rc;
+
+	INTERPOSE_RESOLVE(sem_wait);
+	rc = real_sem_wait(s);
+	if(rc == 0)
+		acquire(s);
+	return rc;
+}
+
+int sem_trywait(sem_t* s)
+{
+	int rc;
+
+	INTERPOSE_RESOLVE(sem_trywait);
+	rc = real_sem_trywait(s);
+	if(rc == 0)
+		acquire(s);
+	return rc;
+}
+
+int sem_post(sem_t* s)
+{
+	INTERPOSE_RESOLVE(sem_post);
+	release(s);
+	return real_sem_post(s);
+}
+
+/*
+ * Freed memory is not watched any more, its next owner did not race
+ * with the previous one (the allocator orders them with locks we do
+ * not see).
+ */
+void free(void* p)
+{
+	size_t size, off;
+
+	if(p && g_ready) {
+		size = malloc_usable_size(p);
+		if(size > 4096)
+			size = 4096;
+		for(off=0; off < size; off += 8) {
+			uintptr_t g = ((uintptr_t)p + off) >> 3;
+			uint32_t bit = granule_bit(g);
+			struct watch* w;
+
+			if(!(g_bits[bit >> 6] & (1ULL << (bit & 63))))
+				continue;
+			w = &g_watches[bit & ((1 << WATCH_LOG) - 1)];
+			spin_lock(&w->lock);
+			if(w->granule == g) {
+				__sync_fetch_and_and(&g_bits[bit >> 6], ~(1ULL << (bit & 63)));
+				w->granule = 0;
+			}
+			spin_unlock(&w->lock);
+		}
+	}
+	__libc_free(p);
+}
+
+/*
+ * Setup
+ */
+
+void __tsan_init(void)
+{
+	const char* v;
+	struct timespec ts;
+
+	if(g_ready)
+		return;
+	INTERPOSE_RESOLVE(pthread_create);
+	INTERPOSE_RESOLVE(pthread_join);
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	INTERPOSE_RESOLVE(pthread_mutex_trylock);
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_rdlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_wrlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_tryrdlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_trywrlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_unlock);
+	INTERPOSE_RESOLVE(pthread_cond_wait);
+	INTERPOSE_RESOLVE(pthread_cond_timedwait);
+	INTERPOSE_RESOLVE(pthread_cond_signal);
+	INTERPOSE_RESOLVE(pthread_cond_broadcast);
+	INTERPOSE_RESOLVE(sem_wait);
+	INTERPOSE_RESOLVE(sem_trywait);
+	INTERPOSE_RESOLVE(sem_post);
+
+	if((v = getenv("RACEDET_RATE")) && atoi(v) > 0)
+		g_rate = atoi(v);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	g_seed = (v = getenv("RACEDET_SEED")) && *v ? strtoull(v, NULL, 10) :
+		(uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if((v = getenv("RACEDET_MAX")) && *v)
+		g_max_races = atoi(v);
+	if((v = getenv("RACEDET_OUT")) && *v) {
+		g_out = open(v, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(g_out < 0) {
+			interpose_msg("racedet: cannot open ", v);
+			g_out = 2;
+		}
+	}
+
+	g_watches = alloc(sizeof(struct watch) << WATCH_LOG);
+	pthread_key_create(&g_key, thread_gone);
+	thread_init(NULL);
+	g_ready = 1;
+}
+
+__attribute__((constructor))
+static void racedet_init(void)
+{
+	__tsan_init();
+}
+
+__attribute__((destructor))
+static void racedet_fini(void)
+{
+	char buf[256];
+	int len;
+
+	len = snprintf(buf, sizeof(buf),
+		"racedet: 1 in %u accesses sampled, %llu samples, %llu checks, %u races\n",
+		g_rate, (unsigned long long)g_samples, (unsigned long long)g_checks, g_nraces);
+	if(write(g_out, buf, len) < 0)
+		len = 0;
+}
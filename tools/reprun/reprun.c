@@ -0,0 +1,839 @@
+/*
+ * Runs many isolated attempts of a bug reproduction in parallel and
+ * reports how often, how fast and at what cpu cost the bug shows up.
+ *
+ * A repro is described by a spec file (reprun.conf in the bug
+ * directories), one setting per line:
+ *
+ *   dir       directory the commands run in, relative to the spec
+ *             (default: the directory of the spec)
+ *   setup     run to completion before the attempt
+ *   server    started in the background and watched, e.g. the server
+ *             the trigger talks to
+ *   ready     polled until it exits with 0 before the command starts,
+ *             or 'tcp <port>' / 'unix <path>': until that accepts
+ *   command   the trigger, the attempt ends when it exits
+ *   teardown  run after the attempt, whatever its outcome
+ *   timeout   seconds before the attempt counts as hung (60)
+ *   fail      a failure signature, one of
+ *               assert         SIGABRT (assert() or abort())
+ *               crash          SIGSEGV, SIGBUS, SIGFPE or SIGILL
+ *               hang           the timeout expired
+ *               exit           the command exited non-zero
+ *               output <re>    a line of the output matches the
+ *                              extended regex (wrong value)
+ *             may be repeated (default: assert and crash)
+ *
+ * The commands run with /bin/sh, with these substitutions so that the
+ * attempts running at the same time do not share anything:
+ *
+ *   %i  number of the attempt      %t  temp directory of the attempt
+ *   %j  slot (0 .. jobs-1)         %s  socket path in %t
+ *   %p  port of the slot           %d  absolute 'dir'
+ *   %%  a %
+ *
+ * (also exported as REPRUN_ATTEMPT, REPRUN_SLOT, REPRUN_PORT,
+ * REPRUN_TMP, REPRUN_SOCK). The output of server and command goes to
+ * %t/out.
+ *
+ * Every attempt is run by a supervisor process, made a child subreaper
+ * so that daemonized servers and orphans are still its children: it
+ * kills them all at the end and the cpu time of the whole tree counts.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <regex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FAILS 16
+#define MAX_JOBS 1024
+#define LINE_SIZE 4096
+
+enum sig {
+	SIG_ASSERT,
+	SIG_CRASH,
+	SIG_HANG,
+	SIG_EXIT,
+	SIG_OUTPUT,
+	NSIGS
+};
+
+static const char* sig_names[NSIGS] = {
+	"assert", "crash", "hang", "exit", "output"
+};
+
+struct spec {
+	char dir[PATH_MAX];
+	char* setup;
+	char* server;
+	char* ready;
+	char* command;
+	char* teardown;
+	int timeout;
+	unsigned int fails;	/* bit per enum sig */
+	regex_t outputs[MAX_FAILS];
+	char* output_res[MAX_FAILS];
+	int noutputs;
+};
+
+struct instance {
+	unsigned long attempt;
+	int slot;
+	int port;
+	char tmp[PATH_MAX];
+	char sock[PATH_MAX + 8];
+};
+
+/* what a supervisor reports, one line on the results pipe */
+struct result {
+	unsigned long attempt;
+	char outcome[64];	/* pass, error, cancel, a signature or other:... */
+	double ttf;		/* from the start of the command */
+	double wall;		/* the whole attempt */
+	double cpu;
+};
+
+static struct spec g_spec;
+static int g_jobs = 0;			/* parallel attempts */
+static unsigned long g_attempts = 100;	/* 0 = no limit */
+static double g_duration = 0;		/* seconds, 0 = no limit */
+static unsigned long g_max_fails = 0;	/* stop after that many, 0 = no limit */
+static int g_port_base = 20000;
+static int g_port_stride = 10;
+static char g_workdir[PATH_MAX - 64];
+static int g_keep = 10;			/* temp dirs of failures kept */
+static int g_verbose = 0;
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void die(const char* msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_stop(int sig)
+{
+	(void)sig;
+	g_stop = 1;
+}
+
+static char* trim(char* s)
+{
+	char* e;
+
+	while(*s == ' ' || *s == '\t')
+		s++;
+	e = s + strlen(s);
+	while(e > s && (e[-1] == '\n' || e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t'))
+		*--e = '\0';
+	return s;
+}
+
+static void load_spec(const char* path)
+{
+	char line[LINE_SIZE];
+	char dir[PATH_MAX] = "";
+	char base[PATH_MAX];
+	char* key;
+	char* val;
+	FILE* fp;
+	int n = 0;
+
+	fp = fopen(path, "r");
+	if(!fp)
+		die(path);
+	g_spec.timeout = 60;
+	while(fgets(line, sizeof(line), fp)) {
+		n++;
+		key = trim(line);
+		if(*key == '\0' || *key == '#')
+			continue;
+		val = key + strcspn(key, " \t");
+		if(*val)
+			*val++ = '\0';
+		val = trim(val);
+
+		if(strcmp(key, "dir") == 0)
+			snprintf(dir, sizeof(dir), "%s", val);
+		else if(strcmp(key, "setup") == 0)
+			g_spec.setup = strdup(val);
+		else if(strcmp(key, "server") == 0)
+			g_spec.server = strdup(val);
+		else if(strcmp(key, "ready") == 0)
+			g_spec.ready = strdup(val);
+		else if(strcmp(key, "command") == 0)
+			g_spec.command = strdup(val);
+		else if(strcmp(key, "teardown") == 0)
+			g_spec.teardown = strdup(val);
+		else if(strcmp(key, "timeout") == 0)
+			g_spec.timeout = atoi(val);
+		else if(strcmp(key, "fail") == 0) {
+			int s;
+
+			if(strncmp(val, "output", 6) == 0 && (val[6] == ' ' || val[6] == '\t')) {
+				char* re = trim(val + 6);
+				if(g_spec.noutputs == MAX_FAILS) {
+					fprintf(stderr, "%s:%d: too many output signatures\n", path, n);
+					exit(1);
+				}
+				if(regcomp(&g_spec.outputs[g_spec.noutputs], re, REG_EXTENDED | REG_NOSUB) != 0) {
+					fprintf(stderr, "%s:%d: bad regex %s\n", path, n, re);
+					exit(1);
+				}
+				g_spec.output_res[g_spec.noutputs++] = strdup(re);
+				g_spec.fails |= 1U << SIG_OUTPUT;
+				continue;
+			}
+			for(s=0; s < NSIGS && strcmp(val, sig_names[s]); ++s)
+				;
+			if(s == NSIGS || s == SIG_OUTPUT) {
+				fprintf(stderr, "%s:%d: unknown signature %s\n", path, n, val);
+				exit(1);
+			}
+			g_spec.fails |= 1U << s;
+		} else {
+			fprintf(stderr, "%s:%d: unknown setting %s\n", path, n, key);
+			exit(1);
+		}
+	}
+	fclose(fp);
+
+	if(!g_spec.command) {
+		fprintf(stderr, "%s: no command\n", path);
+		exit(1);
+	}
+	if(!g_spec.fails)
+		g_spec.fails = (1U << SIG_ASSERT) | (1U << SIG_CRASH);
+
+	/* dir is relative to the spec */
+	snprintf(base, sizeof(base), "%s", path);
+	if(dir[0] != '/') {
+		char tmp[PATH_MAX * 2];
+		snprintf(tmp, sizeof(tmp), "%s/%s", dirname(base), dir);
+		if(!realpath(tmp, g_spec.dir))
+			die(tmp);
+	} else if(!realpath(dir, g_spec.dir))
+		die(dir);
+}
+
+/* expands the % sequences of a command for an instance */
+static void subst(const char* in, const struct instance* inst, char* out, size_t size)
+{
+	size_t len = 0;
+	int n;
+
+	for(; *in && len + 1 < size; ++in) {
+		if(*in != '%' || !in[1]) {
+			out[len++] = *in;
+			continue;
+		}
+		++in;
+		switch(*in) {
+		case 'i': n = snprintf(out + len, size - len, "%lu", inst->attempt); break;
+		case 'j': n = snprintf(out + len, size - len, "%d", inst->slot); break;
+		case 'p': n = snprintf(out + len, size - len, "%d", inst->port); break;
+		case 't': n = snprintf(out + len, size - len, "%s", inst->tmp); break;
+		case 's': n = snprintf(out + len, size - len, "%s", inst->sock); break;
+		case 'd': n = snprintf(out + len, size - len, "%s", g_spec.dir); break;
+		case '%': n = snprintf(out + len, size - len, "%%"); break;
+		default: n = snprintf(out + len, size - len, "%%%c", *in); break;
+		}
+		if(n < 0 || (size_t)n >= size - len)
+			break;
+		len += n;
+	}
+	out[len] = '\0';
+}
+
+/* starts a command of the spec in its own process group */
+static pid_t start(const char* cmd, const struct instance* inst, int out_fd)
+{
+	char buf[LINE_SIZE * 2];
+	pid_t pid;
+
+	subst(cmd, inst, buf, sizeof(buf));
+	if(g_verbose)
+		fprintf(stderr, "[%lu] %s\n", inst->attempt, buf);
+	pid = fork();
+	if(pid < 0)
+		die("fork");
+	if(pid == 0) {
+		setpgid(0, 0);
+		if(chdir(g_spec.dir) < 0)
+			die(g_spec.dir);
+		if(out_fd >= 0) {
+			dup2(out_fd, 1);
+			dup2(out_fd, 2);
+			close(out_fd);
+		}
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", buf, (char*)NULL);
+		_exit(127);
+	}
+	setpgid(pid, pid);
+	return pid;
+}
+
+/* runs a command of the spec to completion, returns its wait status */
+static int run(const char* cmd, const struct instance* inst, int out_fd)
+{
+	pid_t pid = start(cmd, inst, out_fd);
+	int status;
+
+	while(waitpid(pid, &status, 0) < 0)
+		if(errno != EINTR)
+			return -1;
+	return status;
+}
+
+/* whether the server is up: the ready command succeeds or accepts */
+static int is_ready(const struct instance* inst)
+{
+	char buf[LINE_SIZE * 2];
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	int fd, rc;
+
+	if(strncmp(g_spec.ready, "tcp ", 4) && strncmp(g_spec.ready, "unix ", 5))
+		return run(g_spec.ready, inst, -1) == 0;
+
+	subst(g_spec.ready, inst, buf, sizeof(buf));
+	if(buf[0] == 't') {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(atoi(buf + 4));
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		rc = connect(fd, (struct sockaddr*)&sin, sizeof(sin));
+	} else {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", trim(buf + 5));
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		rc = connect(fd, (struct sockaddr*)&sun, sizeof(sun));
+	}
+	close(fd);
+	return rc == 0;
+}
+
+/* kills and reaps every process left below the supervisor */
+static void kill_all(pid_t* groups, int ngroups)
+{
+	char path[64];
+	char buf[512];
+	struct dirent* de;
+	int i, found;
+	DIR* d;
+
+	for(i=0; i < ngroups; ++i)
+		if(groups[i] > 0)
+			killpg(groups[i], SIGKILL);
+	/* daemons left the groups, but as a subreaper we are their parent */
+	do {
+		found = 0;
+		d = opendir("/proc");
+		if(!d)
+			break;
+		while((de = readdir(d))) {
+			char* p;
+			int fd, n;
+			pid_t pid = atoi(de->d_name);
+
+			if(pid <= 0)
+				continue;
+			snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+			fd = open(path, O_RDONLY);
+			if(fd < 0)
+				continue;
+			n = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			if(n <= 0)
+				continue;
+			buf[n] = '\0';
+			/* pid (comm) state ppid ..., comm may hold anything */
+			p = strrchr(buf, ')');
+			if(p && atoi(p + 4) == getpid()) {
+				kill(pid, SIGKILL);
+				found = 1;
+			}
+		}
+		closedir(d);
+		while(waitpid(-1, NULL, WNOHANG) > 0)
+			;
+		if(found)
+			usleep(1000);
+	} while(found);
+	while(waitpid(-1, NULL, 0) > 0)
+		;
+}
+
+static int output_matches(const char* path)
+{
+	char line[LINE_SIZE];
+	FILE* fp;
+	int i, found = 0;
+
+	if(!(g_spec.fails & (1U << SIG_OUTPUT)))
+		return 0;
+	fp = fopen(path, "r");
+	if(!fp)
+		return 0;
+	while(!found && fgets(line, sizeof(line), fp))
+		for(i=0; i < g_spec.noutputs; ++i)
+			if(regexec(&g_spec.outputs[i], line, 0, NULL, 0) == 0) {
+				found = 1;
+				break;
+			}
+	fclose(fp);
+	return found;
+}
+
+/* names what a wait status means, NULL for a clean exit */
+static const char* classify(int status, char* other, size_t size)
+{
+	/* the shell reports a command killed by a signal as 128 + signal */
+	int s = WIFSIGNALED(status) ? WTERMSIG(status) :
+		WIFEXITED(status) && WEXITSTATUS(status) > 128 ? WEXITSTATUS(status) - 128 : 0;
+
+	if(s) {
+		if(s == SIGABRT)
+			return sig_names[SIG_ASSERT];
+		if(s == SIGSEGV || s == SIGBUS || s == SIGFPE || s == SIGILL)
+			return sig_names[SIG_CRASH];
+		snprintf(other, size, "signal:%d", s);
+		return other;
+	}
+	if(WIFEXITED(status) && WEXITSTATUS(status) != 0)
+		return sig_names[SIG_EXIT];
+	return NULL;
+}
+
+static int is_failure(const char* outcome)
+{
+	int s;
+
+	for(s=0; s < NSIGS; ++s)
+		if(strcmp(outcome, sig_names[s]) == 0)
+			return (g_spec.fails >> s) & 1;
+	return 0;
+}
+
+/* one attempt, in the supervisor process */
+static void attempt(struct instance* inst, struct result* r)
+{
+	char out_path[PATH_MAX + 8];
+	char other[64];
+	const char* what = NULL;
+	pid_t groups[2] = { 0, 0 };
+	pid_t server = 0, cmd = 0, pid;
+	double t0, t_cmd = 0, deadline;
+	struct rusage ru;
+	int out_fd, status, done = 0;
+
+	t0 = now();
+	strcpy(r->outcome, "pass");
+	out_fd = open(strcat(strcpy(out_path, inst->tmp), "/out"),
+		O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(out_fd < 0)
+		die(out_path);
+
+	if(g_spec.setup) {
+		status = run(g_spec.setup, inst, out_fd);
+		if(status != 0) {
+			snprintf(r->outcome, sizeof(r->outcome), "error:setup");
+			goto out;
+		}
+	}
+
+	deadline = now() + g_spec.timeout;
+	if(g_spec.server) {
+		server = groups[0] = start(g_spec.server, inst, out_fd);
+		while(g_spec.ready && !g_stop) {
+			if(is_ready(inst))
+				break;
+			if(server && waitpid(server, &status, WNOHANG) == server) {
+				server = 0;
+				what = classify(status, other, sizeof(other));
+				/* exiting with 0 is daemonizing, the daemon is ours */
+				if(what) {
+					snprintf(r->outcome, sizeof(r->outcome), "%s",
+						strcmp(what, "exit") ? what : "error:server");
+					goto out;
+				}
+			}
+			if(now() > deadline) {
+				snprintf(r->outcome, sizeof(r->outcome), "error:ready");
+				goto out;
+			}
+			usleep(50000);
+		}
+	}
+
+	t_cmd = now();
+	cmd = groups[1] = start(g_spec.command, inst, out_fd);
+	deadline = t_cmd + g_spec.timeout;
+	while(!done) {
+		if(g_stop) {
+			strcpy(r->outcome, "cancel");
+			goto out;
+		}
+		while(!done && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			if(pid == cmd) {
+				cmd = 0;
+				what = classify(status, other, sizeof(other));
+				done = 1;
+			} else if(pid == server) {
+				/* the server failing ends the attempt too */
+				server = 0;
+				what = classify(status, other, sizeof(other));
+				if(what && strcmp(what, "exit") == 0)
+					what = "error:server";
+				done = what != NULL;
+			} else {
+				/* an orphan we adopted, e.g. a daemonized server */
+				what = classify(status, other, sizeof(other));
+				if(what && strcmp(what, "assert") && strcmp(what, "crash"))
+					what = NULL;
+				done = what != NULL;
+			}
+		}
+		if(done)
+			break;
+		if(now() > deadline) {
+			what = sig_names[SIG_HANG];
+			break;
+		}
+		usleep(2000);
+	}
+	r->ttf = now() - t_cmd;
+
+	/* a client failing is often the server crashing, give it time to die */
+	if(server && !cmd && what && !is_failure(what)) {
+		int i;
+
+		for(i=0; i < 20; ++i) {
+			if(waitpid(server, &status, WNOHANG) == server) {
+				const char* s = classify(status, other, sizeof(other));
+				if(s && is_failure(s))
+					what = s;
+				break;
+			}
+			usleep(50000);
+		}
+	}
+
+	/* a wrong value is printed by a command that otherwise looks fine */
+	if((!what || strcmp(what, "exit") == 0) && output_matches(out_path))
+		what = sig_names[SIG_OUTPUT];
+	if(what) {
+		if(strncmp(what, "error:", 6) == 0 || is_failure(what) || strncmp(what, "signal:", 7) == 0)
+			snprintf(r->outcome, sizeof(r->outcome), "%s", what);
+		else
+			snprintf(r->outcome, sizeof(r->outcome), "other:%s", what);
+	}
+
+out:
+	kill_all(groups, 2);
+	if(g_spec.teardown)
+		run(g_spec.teardown, inst, out_fd);
+	kill_all(NULL, 0);
+	close(out_fd);
+	getrusage(RUSAGE_CHILDREN, &ru);
+	r->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	r->wall = now() - t0;
+	if(!t_cmd)
+		r->ttf = 0;
+}
+
+static void supervise(unsigned long n, int slot, int result_fd)
+{
+	struct instance inst;
+	struct result r;
+	char env[32];
+	char line[256];
+	int len;
+
+	memset(&r, 0, sizeof(r));
+	r.attempt = n;
+	inst.attempt = n;
+	inst.slot = slot;
+	inst.port = g_port_base + slot * g_port_stride;
+	snprintf(inst.tmp, sizeof(inst.tmp), "%s/%lu", g_workdir, n);
+	snprintf(inst.sock, sizeof(inst.sock), "%s/sock", inst.tmp);
+	if(mkdir(inst.tmp, 0755) < 0)
+		die(inst.tmp);
+
+	snprintf(env, sizeof(env), "%lu", n);
+	setenv("REPRUN_ATTEMPT", env, 1);
+	snprintf(env, sizeof(env), "%d", slot);
+	setenv("REPRUN_SLOT", env, 1);
+	snprintf(env, sizeof(env), "%d", inst.port);
+	setenv("REPRUN_PORT", env, 1);
+	setenv("REPRUN_TMP", inst.tmp, 1);
+	setenv("REPRUN_SOCK", inst.sock, 1);
+
+	prctl(PR_SET_CHILD_SUBREAPER, 1);
+	attempt(&inst, &r);
+
+	/* less than PIPE_BUF, so the lines of the supervisors do not mix */
+	len = snprintf(line, sizeof(line), "%lu %s %.6f %.6f %.6f\n",
+		r.attempt, r.outcome, r.ttf, r.wall, r.cpu);
+	if(write(result_fd, line, len) != len)
+		die("write");
+	exit(0);
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	remove(path);
+	return 0;
+}
+
+/* per outcome, over the attempts */
+struct tally {
+	char outcome[64];
+	unsigned long count;
+	double ttf;
+	double cpu;
+};
+
+static struct tally g_tallies[64];
+static int g_ntallies = 0;
+
+static void count(const struct result* r)
+{
+	int i;
+
+	for(i=0; i < g_ntallies && strcmp(g_tallies[i].outcome, r->outcome); ++i)
+		;
+	if(i == g_ntallies) {
+		if(g_ntallies == 64)
+			i = 63;
+		else
+			strcpy(g_tallies[g_ntallies++].outcome, r->outcome);
+	}
+	g_tallies[i].count++;
+	g_tallies[i].ttf += r->ttf;
+	g_tallies[i].cpu += r->cpu;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s [options] <spec>\n", argv0);
+	fprintf(stderr, "  -j <n>    attempts at once, default: number of cpus\n");
+	fprintf(stderr, "  -n <n>    attempts, 0 for no limit, default: %lu\n", g_attempts);
+	fprintf(stderr, "  -d <s>    stop starting attempts after that many seconds\n");
+	fprintf(stderr, "  -f <n>    stop after that many reproductions\n");
+	fprintf(stderr, "  -p <port> port of slot 0, default: %d\n", g_port_base);
+	fprintf(stderr, "  -P <n>    ports between slots, default: %d\n", g_port_stride);
+	fprintf(stderr, "  -w <dir>  where the temp directories go, default: /tmp\n");
+	fprintf(stderr, "  -k <n>    temp directories of failures to keep, default: %d\n", g_keep);
+	fprintf(stderr, "  -v        print every attempt and command\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	pid_t slots[MAX_JOBS];
+	char buf[8192];
+	size_t buf_len = 0;
+	unsigned long started = 0, finished = 0, fails = 0, kept = 0;
+	double t0, total_wall = 0, total_cpu = 0;
+	const char* parent = "/tmp";
+	struct sigaction sa;
+	int fds[2];
+	int opt, i, running = 0;
+
+	while((opt = getopt(argc, argv, "j:n:d:f:p:P:w:k:v")) != -1) {
+		switch(opt) {
+		case 'j': g_jobs = atoi(optarg); break;
+		case 'n': g_attempts = strtoul(optarg, NULL, 10); break;
+		case 'd': g_duration = atof(optarg); break;
+		case 'f': g_max_fails = strtoul(optarg, NULL, 10); break;
+		case 'p': g_port_base = atoi(optarg); break;
+		case 'P': g_port_stride = atoi(optarg); break;
+		case 'w': parent = optarg; break;
+		case 'k': g_keep = atoi(optarg); break;
+		case 'v': g_verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1)
+		usage(argv[0]);
+	if(!g_attempts && !g_duration && !g_max_fails) {
+		fprintf(stderr, "no limit: give -n, -d or -f\n");
+		return 1;
+	}
+	if(g_jobs <= 0)
+		g_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if(g_jobs > MAX_JOBS)
+		g_jobs = MAX_JOBS;
+	load_spec(argv[optind]);
+
+	snprintf(g_workdir, sizeof(g_workdir), "%s/reprun.XXXXXX", parent);
+	if(!mkdtemp(g_workdir))
+		die(g_workdir);
+	if(pipe(fds) < 0)
+		die("pipe");
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("%s: %d at once, timeout %ds, in %s\n", g_spec.dir, g_jobs,
+		g_spec.timeout, g_workdir);
+	fflush(stdout);
+
+	for(i=0; i < g_jobs; ++i)
+		slots[i] = 0;
+	t0 = now();
+	for(;;) {
+		int stopping = g_stop ||
+			(g_attempts && started >= g_attempts) ||
+			(g_duration && now() - t0 >= g_duration) ||
+			(g_max_fails && fails >= g_max_fails);
+		pid_t pid;
+		int status;
+
+		for(i=0; !stopping && i < g_jobs; ++i) {
+			if(slots[i])
+				continue;
+			started++;
+			pid = fork();
+			if(pid < 0)
+				die("fork");
+			if(pid == 0) {
+				close(fds[0]);
+				supervise(started, i, fds[1]);
+			}
+			slots[i] = pid;
+			running++;
+			if(g_attempts && started >= g_attempts)
+				break;
+		}
+		if(!running)
+			break;
+		if(stopping)
+			for(i=0; i < g_jobs; ++i)
+				if(slots[i] && (g_stop || (g_max_fails && fails >= g_max_fails)))
+					kill(slots[i], SIGTERM);
+
+		pid = waitpid(-1, &status, 0);
+		if(pid < 0) {
+			if(errno == EINTR)
+				continue;
+			die("waitpid");
+		}
+		for(i=0; i < g_jobs && slots[i] != pid; ++i)
+			;
+		if(i == g_jobs)
+			continue;
+		slots[i] = 0;
+		running--;
+
+		/* the supervisor wrote its line before it exited */
+		for(;;) {
+			ssize_t n = read(fds[0], buf + buf_len, sizeof(buf) - buf_len - 1);
+			char* line;
+			char* nl;
+
+			if(n <= 0)
+				break;
+			buf_len += n;
+			buf[buf_len] = '\0';
+			line = buf;
+			while((nl = strchr(line, '\n'))) {
+				struct result r;
+				char dir[PATH_MAX];
+
+				*nl = '\0';
+				memset(&r, 0, sizeof(r));
+				sscanf(line, "%lu %63s %lf %lf %lf", &r.attempt,
+					r.outcome, &r.ttf, &r.wall, &r.cpu);
+				snprintf(dir, sizeof(dir), "%s/%lu", g_workdir, r.attempt);
+				if(r.attempt && strcmp(r.outcome, "cancel") != 0) {
+					int failed = is_failure(r.outcome);
+
+					finished++;
+					total_wall += r.wall;
+					total_cpu += r.cpu;
+					count(&r);
+					if(failed)
+						fails++;
+					if((failed || strcmp(r.outcome, "pass")) && kept < (unsigned long)g_keep) {
+						kept++;
+						printf("attempt %lu: %s after %.3fs, see %s/out\n",
+							r.attempt, r.outcome, r.ttf, dir);
+					} else {
+						if(g_verbose)
+							printf("attempt %lu: %s after %.3fs\n",
+								r.attempt, r.outcome, r.ttf);
+						nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+					}
+					fflush(stdout);
+				} else if(r.attempt)
+					nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+				line = nl + 1;
+			}
+			buf_len -= line - buf;
+			memmove(buf, line, buf_len);
+		}
+	}
+	t0 = now() - t0;
+	if(!kept)
+		rmdir(g_workdir);
+
+	printf("\n%lu attempts in %.1fs, %lu reproduced (%.1f%%)\n", finished, t0,
+		fails, finished ? 100.0 * fails / finished : 0);
+	printf("%-24s %8s %10s %10s\n", "outcome", "count", "mean_s", "cpu_s");
+	for(i=0; i < g_ntallies; ++i)
+		printf("%-24s %8lu %10.3f %10.3f\n", g_tallies[i].outcome,
+			g_tallies[i].count, g_tallies[i].ttf / g_tallies[i].count,
+			g_tallies[i].cpu / g_tallies[i].count);
+	if(fails) {
+		/* the passing attempts count, it is what a reproduction costs */
+		printf("mean time to failure      %10.3f s of one instance\n", total_wall / fails);
+		printf("cpu per reproduction      %10.3f s\n", total_cpu / fails);
+		printf("reproductions per hour    %10.1f with %d at once\n", fails * 3600 / t0, g_jobs);
+	} else
+		printf("not reproduced, %.3f cpu s spent\n", total_cpu);
+	return 0;
+}
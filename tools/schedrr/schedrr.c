@@ -0,0 +1,906 @@
+/*
+ * Record and replay of thread schedules, LD_PRELOAD'ed into the program
+ * of a bug.
+ *
+ * Recording: every wrapped call (mutex and rwlock lock, trylock and
+ * unlock, cond wait, signal and broadcast, thread create and join,
+ * srand/rand and srandom/random) takes the next number of a global
+ * sequence and appends it, with the kind of the call and its result,
+ * to a ring of its thread. A full ring is written to the log of the
+ * thread, SCHEDRR_DIR/<program>.<n>, n numbering the threads in
+ * creation order; the rings of all the threads are also written at
+ * exit and when the program crashes. The cost is an atomic increment
+ * and a 16 byte store per call.
+ *
+ * Replaying: every wrapped call waits until the sequence reaches the
+ * number its thread recorded for it, does what was recorded (a lock
+ * that was taken is taken, a trylock that failed fails, a cond wait
+ * returns when the turn of its wakeup comes, rand returns the recorded
+ * value) and moves the sequence on. When the log ends, a call differs
+ * from the recorded one or the sequence does not move for
+ * SCHEDRR_TIMEOUT seconds, all the threads run free.
+ *
+ * Configured from the environment:
+ *
+ *   SCHEDRR_MODE     record or replay; unset, nothing is wrapped
+ *   SCHEDRR_DIR      directory of the logs ($REPRUN_TMP/schedrr under
+ *                    tools/reprun, whose failed attempts keep theirs,
+ *                    schedrr otherwise)
+ *   SCHEDRR_TIMEOUT  seconds a replayed call waits for the sequence
+ *                    to move before giving up (10)
+ *
+ * The accesses between the wrapped calls are not ordered: a race on
+ * plain data replays only as far as the calls around it pin it down.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "interpose.h"
+
+#define RING 4096		/* events a thread buffers */
+#define MAX_THREADS 4096	/* threads logged, later ones run free */
+#define SPINS 2000		/* turns checked before sleeping on the futex */
+
+enum kind {
+	EV_LOCK = 1,
+	EV_TRYLOCK,
+	EV_TIMEDLOCK,
+	EV_UNLOCK,
+	EV_RDLOCK,
+	EV_TRYRDLOCK,
+	EV_WRLOCK,
+	EV_TRYWRLOCK,
+	EV_RWUNLOCK,
+	EV_WAIT,
+	EV_WOKEN,
+	EV_SIGNAL,
+	EV_BROADCAST,
+	EV_CREATE,
+	EV_JOIN,
+	EV_SRAND,
+	EV_RAND,
+	EV_SRANDOM,
+	EV_RANDOM,
+	EV_MAX
+};
+
+static const char* kind_names[] = { "?", "lock", "trylock", "timedlock",
+	"unlock", "rdlock", "tryrdlock", "wrlock", "trywrlock", "rwunlock",
+	"wait", "woken", "signal", "broadcast", "create", "join", "srand",
+	"rand", "srandom", "random" };
+
+struct event {
+	uint64_t seq;
+	uint32_t kind;
+	uint32_t value;		/* result, seed or number of the new thread */
+};
+
+/* per thread, never freed so that a crash can write every ring */
+struct thr {
+	int id;
+	int fd;			/* log, -1 until opened, -2 none, -3 not writable */
+	volatile int n;		/* events in the ring */
+	int pos;		/* next event to replay */
+	volatile int flushing;
+	struct event ring[RING];
+};
+
+enum mode {
+	M_OFF,
+	M_RECORD,
+	M_REPLAY
+};
+
+struct start {
+	void* (*fn)(void*);
+	void* arg;
+	int id;
+};
+
+INTERPOSE(int, pthread_mutex_lock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_mutex_trylock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_mutex_timedlock, (pthread_mutex_t*, const struct timespec*));
+INTERPOSE(int, pthread_mutex_unlock, (pthread_mutex_t*));
+INTERPOSE(int, pthread_rwlock_rdlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_tryrdlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_wrlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_trywrlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_rwlock_unlock, (pthread_rwlock_t*));
+INTERPOSE(int, pthread_cond_wait, (pthread_cond_t*, pthread_mutex_t*));
+INTERPOSE(int, pthread_cond_timedwait, (pthread_cond_t*, pthread_mutex_t*,
+	const struct timespec*));
+INTERPOSE(int, pthread_cond_signal, (pthread_cond_t*));
+INTERPOSE(int, pthread_cond_broadcast, (pthread_cond_t*));
+INTERPOSE(int, pthread_create, (pthread_t*, const pthread_attr_t*,
+	void* (*)(void*), void*));
+INTERPOSE(int, pthread_join, (pthread_t, void**));
+INTERPOSE(void, srand, (unsigned int));
+INTERPOSE(int, rand, (void));
+INTERPOSE(void, srandom, (unsigned int));
+INTERPOSE(long, random, (void));
+
+static enum mode g_mode = M_OFF;
+static char g_dir[PATH_MAX - 64] = "schedrr";
+static const char* g_prog;
+static int g_timeout = 10;
+static volatile uint64_t g_seq = 0;	/* record: next number to take */
+static volatile int g_stopped = 0;	/* record: the rings are being written for good */
+static volatile uint32_t g_turn = 0;	/* replay: number whose turn it is */
+static volatile int g_waiters = 0;
+static volatile int g_free = 0;		/* replay: over, everything runs free */
+static uint64_t g_last = 0;		/* replay: last number of the unbroken log */
+static volatile int g_nthreads = 0;
+static struct thr* g_threads[MAX_THREADS];
+static pthread_key_t g_key;
+
+static __thread struct thr* t_thr;
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline struct thr* self(void)
+{
+	return g_mode != M_OFF ? t_thr : NULL;
+}
+
+/* the thread number of a log name, -1 if it is not a log of the program */
+static int log_id(const char* name)
+{
+	size_t len = strlen(g_prog);
+	char* end;
+	long id;
+
+	if(strncmp(name, g_prog, len) != 0 || name[len] != '.' || !name[len + 1])
+		return -1;
+	id = strtol(name + len + 1, &end, 10);
+	return *end || id < 0 || id >= MAX_THREADS ? -1 : (int)id;
+}
+
+static void log_path(char* buf, size_t size, int id)
+{
+	snprintf(buf, size, "%s/%s.%d", g_dir, g_prog, id);
+}
+
+static struct thr* new_thr(int id)
+{
+	struct thr* t;
+
+	if(id < 0 || id >= MAX_THREADS)
+		return NULL;
+	/* mmap rather than malloc, the ring is large */
+	t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(t == MAP_FAILED)
+		return NULL;
+	t->id = id;
+	t->fd = -1;
+	g_threads[id] = t;
+	t_thr = t;
+	pthread_setspecific(g_key, t);
+	return t;
+}
+
+/*
+ * Recording
+ */
+
+/* appends the ring of t to its log */
+static void flush(struct thr* t)
+{
+	char path[PATH_MAX + 256];
+	ssize_t rc;
+	int n = t->n;
+
+	if(!n || t->fd == -3) {
+		t->n = 0;
+		return;
+	}
+	if(t->fd < 0) {
+		log_path(path, sizeof(path), t->id);
+		t->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(t->fd < 0 && errno == ENOENT && mkdir(g_dir, 0755) == 0)
+			t->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if(t->fd < 0) {
+			interpose_msg("schedrr: cannot create ", path);
+			t->fd = -3;
+			t->n = 0;
+			return;
+		}
+	}
+	rc = write(t->fd, t->ring, n * sizeof(struct event));
+	(void)rc;
+	t->n = 0;
+}
+
+static void rec(struct thr* t, enum kind kind, uint32_t value)
+{
+	struct event* e;
+
+	if(g_stopped)
+		return;
+	if(t->n == RING) {
+		t->flushing = 1;
+		flush(t);
+		t->flushing = 0;
+	}
+	e = &t->ring[t->n];
+	e->seq = __sync_fetch_and_add(&g_seq, 1);
+	e->kind = kind;
+	e->value = value;
+	t->n++;
+}
+
+/* the log ends here: writes every ring, later calls are not recorded */
+static void flush_all(void)
+{
+	int i, n = g_nthreads;
+
+	g_stopped = 1;
+	__sync_synchronize();
+	for(i=0; i < n && i < MAX_THREADS; ++i)
+		if(g_threads[i] && !g_threads[i]->flushing)
+			flush(g_threads[i]);
+}
+
+static void on_crash(int sig)
+{
+	flush_all();
+	/* the handler was reset, this gets the default action */
+	raise(sig);
+}
+
+static void remove_logs(void)
+{
+	char path[PATH_MAX + 256];
+	struct dirent* d;
+	DIR* dir;
+
+	if(!(dir = opendir(g_dir)))
+		return;
+	while((d = readdir(dir)))
+		if(log_id(d->d_name) >= 0) {
+			snprintf(path, sizeof(path), "%s/%s", g_dir, d->d_name);
+			unlink(path);
+		}
+	closedir(dir);
+}
+
+/*
+ * Replaying
+ */
+
+static void wake(void)
+{
+	syscall(SYS_futex, &g_turn, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void go_free(const char* why, uint64_t seq)
+{
+	char msg[256];
+
+	if(__sync_lock_test_and_set(&g_free, 1))
+		return;
+	snprintf(msg, sizeof(msg), "%s at event %llu, running free",
+		why, (unsigned long long)seq);
+	interpose_msg("schedrr: ", msg);
+	wake();
+}
+
+/* waits for the turn of seq, 0 if the replay is over */
+static int await(uint64_t seq)
+{
+	struct timespec ts = { 1, 0 };
+	uint32_t cur, last = g_turn;
+	int spins = 0, waited = 0, saved = errno;
+
+	while((cur = g_turn) != (uint32_t)seq && !g_free) {
+		if(++spins < SPINS) {
+			cpu_relax();
+			continue;
+		}
+		if(cur != last) {
+			last = cur;
+			waited = 0;
+		}
+		__sync_fetch_and_add(&g_waiters, 1);
+		if(syscall(SYS_futex, &g_turn, FUTEX_WAIT_PRIVATE, cur, &ts, NULL, 0) < 0 &&
+				errno == ETIMEDOUT && ++waited >= g_timeout)
+			go_free("no progress", cur);
+		__sync_fetch_and_sub(&g_waiters, 1);
+	}
+	errno = saved;
+	return !g_free;
+}
+
+/* the call of the current turn is done */
+static void advance(void)
+{
+	uint32_t turn = __sync_add_and_fetch(&g_turn, 1);
+
+	if(turn > g_last)
+		go_free("end of the log", turn);
+	else if(g_waiters)
+		wake();
+}
+
+static int refill(struct thr* t)
+{
+	char path[PATH_MAX + 256];
+	ssize_t rc;
+
+	if(t->fd == -1) {
+		log_path(path, sizeof(path), t->id);
+		if((t->fd = open(path, O_RDONLY)) < 0)
+			t->fd = -2;
+	}
+	if(t->fd < 0)
+		return 0;
+	rc = read(t->fd, t->ring, sizeof(t->ring));
+	t->n = rc > 0 ? rc / sizeof(struct event) : 0;
+	t->pos = 0;
+	return t->n > 0;
+}
+
+/* the recorded event of the call once it is its turn, NULL when running free */
+static struct event* next_event(struct thr* t, enum kind kind)
+{
+	struct event* e;
+	char msg[128];
+
+	if(g_free)
+		return NULL;
+	if(t->pos == t->n && !refill(t)) {
+		/* nothing more was recorded of this thread, let the others finish */
+		await(g_last + 1);
+		return NULL;
+	}
+	e = &t->ring[t->pos++];
+	if(e->seq > g_last) {
+		await(g_last + 1);
+		return NULL;
+	}
+	if(!await(e->seq))
+		return NULL;
+	if(e->kind != kind) {
+		snprintf(msg, sizeof(msg), "thread %d calls %s where it called %s",
+			t->id, kind_names[kind], e->kind < EV_MAX ? kind_names[e->kind] : "?");
+		go_free(msg, e->seq);
+		return NULL;
+	}
+	return e;
+}
+
+/* reads all the logs to find where the sequence first has a hole */
+static void scan_logs(void)
+{
+	char path[PATH_MAX + 256];
+	struct event* buf;
+	struct dirent* d;
+	struct stat st;
+	uint64_t total = 0, i;
+	uint8_t* seen;
+	ssize_t rc;
+	DIR* dir;
+	int fd;
+
+	g_free = 1;
+	if(!(dir = opendir(g_dir))) {
+		interpose_msg("schedrr: cannot open ", g_dir);
+		return;
+	}
+	while((d = readdir(dir)))
+		if(log_id(d->d_name) >= 0) {
+			snprintf(path, sizeof(path), "%s/%s", g_dir, d->d_name);
+			if(stat(path, &st) == 0)
+				total += st.st_size / sizeof(struct event);
+		}
+	/* e.g. a shell or timeout in front of the program */
+	if(!total) {
+		closedir(dir);
+		return;
+	}
+
+	/* total events with distinct numbers: the first hole is below total */
+	seen = calloc((total + 7) / 8, 1);
+	buf = malloc(sizeof(struct event) * RING);
+	if(!seen || !buf) {
+		closedir(dir);
+		free(seen);
+		free(buf);
+		return;
+	}
+	rewinddir(dir);
+	while((d = readdir(dir))) {
+		if(log_id(d->d_name) < 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", g_dir, d->d_name);
+		if((fd = open(path, O_RDONLY)) < 0)
+			continue;
+		while((rc = read(fd, buf, sizeof(struct event) * RING)) > 0)
+			for(i=0; i < rc / sizeof(struct event); ++i)
+				if(buf[i].seq < total)
+					seen[buf[i].seq >> 3] |= 1 << (buf[i].seq & 7);
+		close(fd);
+	}
+	closedir(dir);
+	for(i=0; i < total && (seen[i >> 3] & (1 << (i & 7))); ++i)
+		;
+	free(seen);
+	free(buf);
+	if(!i)
+		return;
+	g_last = i - 1;
+	if(g_last > UINT32_MAX - 1)
+		g_last = UINT32_MAX - 1;
+	g_free = 0;
+}
+
+/*
+ * Setup
+ */
+
+static void thread_gone(void* p)
+{
+	struct thr* t = p;
+
+	if(g_mode == M_RECORD)
+		flush(t);
+	if(t->fd >= 0) {
+		close(t->fd);
+		t->fd = g_mode == M_RECORD ? -1 : -2;
+	}
+}
+
+static void* start_thread(void* p)
+{
+	struct start s = *(struct start*)p;
+
+	free(p);
+	new_thr(s.id);
+	return s.fn(s.arg);
+}
+
+/* a child of fork() would append to the logs of its parent */
+static void forked(void)
+{
+	g_mode = M_OFF;
+}
+
+__attribute__((constructor))
+static void schedrr_init(void)
+{
+	static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT,
+		SIGTERM, SIGINT };
+	struct sigaction sa;
+	enum mode mode;
+	const char* v;
+	unsigned int i;
+
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	INTERPOSE_RESOLVE(pthread_mutex_trylock);
+	INTERPOSE_RESOLVE(pthread_mutex_timedlock);
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_rdlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_tryrdlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_wrlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_trywrlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_unlock);
+	INTERPOSE_RESOLVE(pthread_cond_wait);
+	INTERPOSE_RESOLVE(pthread_cond_timedwait);
+	INTERPOSE_RESOLVE(pthread_cond_signal);
+	INTERPOSE_RESOLVE(pthread_cond_broadcast);
+	INTERPOSE_RESOLVE(pthread_create);
+	INTERPOSE_RESOLVE(pthread_join);
+	INTERPOSE_RESOLVE(srand);
+	INTERPOSE_RESOLVE(rand);
+	INTERPOSE_RESOLVE(srandom);
+	INTERPOSE_RESOLVE(random);
+
+	if(!(v = getenv("SCHEDRR_MODE")) || !*v)
+		return;
+	if(strcmp(v, "record") == 0)
+		mode = M_RECORD;
+	else if(strcmp(v, "replay") == 0)
+		mode = M_REPLAY;
+	else {
+		interpose_msg("schedrr: unknown mode ", v);
+		return;
+	}
+	if((v = getenv("SCHEDRR_DIR")) && *v)
+		snprintf(g_dir, sizeof(g_dir), "%s", v);
+	else if((v = getenv("REPRUN_TMP")) && *v)
+		snprintf(g_dir, sizeof(g_dir), "%s/schedrr", v);
+	if((v = getenv("SCHEDRR_TIMEOUT")) && atoi(v) > 0)
+		g_timeout = atoi(v);
+	g_prog = program_invocation_short_name;
+
+	if(mode == M_RECORD) {
+		remove_logs();
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_crash;
+		sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+		sigemptyset(&sa.sa_mask);
+		for(i=0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); ++i)
+			sigaction(crash_signals[i], &sa, NULL);
+	} else
+		scan_logs();
+
+	pthread_key_create(&g_key, thread_gone);
+	pthread_atfork(NULL, NULL, forked);
+	g_nthreads = 1;
+	if(new_thr(0))
+		g_mode = mode;
+}
+
+__attribute__((destructor))
+static void schedrr_fini(void)
+{
+	if(g_mode == M_RECORD)
+		flush_all();
+}
+
+/*
+ * Wrappers. Recording takes the number after a call that acquires and
+ * before one that releases, so that the order of the numbers is one
+ * the calls could have happened in.
+ */
+
+/* replay: the recorded event, after waiting for its turn */
+static inline struct event* turn(struct thr* t, enum kind kind)
+{
+	return g_mode == M_REPLAY ? next_event(t, kind) : NULL;
+}
+
+/* record: logs the call; replay: ends the turn if it was taken */
+static inline void done(struct thr* t, enum kind kind, uint32_t value, struct event* e)
+{
+	if(g_mode == M_RECORD)
+		rec(t, kind, value);
+	else if(e)
+		advance();
+}
+
+int pthread_mutex_lock(pthread_mutex_t* m)
+{
+	struct thr* t = self();
+	struct event* e;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	if(!t)
+		return real_pthread_mutex_lock(m);
+	e = turn(t, EV_LOCK);
+	rc = real_pthread_mutex_lock(m);
+	done(t, EV_LOCK, rc, e);
+	return rc;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* m)
+{
+	struct thr* t = self();
+	struct event* e;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_trylock);
+	if(!t)
+		return real_pthread_mutex_trylock(m);
+	if((e = turn(t, EV_TRYLOCK))) {
+		/* taken then, so free now or about to be */
+		rc = e->value ? (int)e->value : real_pthread_mutex_lock(m);
+		advance();
+		return rc;
+	}
+	rc = real_pthread_mutex_trylock(m);
+	done(t, EV_TRYLOCK, rc, NULL);
+	return rc;
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t* m, const struct timespec* abstime)
+{
+	struct thr* t = self();
+	struct event* e;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_mutex_timedlock);
+	if(!t)
+		return real_pthread_mutex_timedlock(m, abstime);
+	if((e = turn(t, EV_TIMEDLOCK))) {
+		rc = e->value ? (int)e->value : real_pthread_mutex_lock(m);
+		advance();
+		return rc;
+	}
+	rc = real_pthread_mutex_timedlock(m, abstime);
+	done(t, EV_TIMEDLOCK, rc, NULL);
+	return rc;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* m)
+{
+	struct thr* t = self();
+
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+	if(t)
+		done(t, EV_UNLOCK, 0, turn(t, EV_UNLOCK));
+	return real_pthread_mutex_unlock(m);
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t* l)
+{
+	struct thr* t = self();
+	struct event* e;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_rwlock_rdlock);
+	if(!t)
+		return real_pthread_rwlock_rdlock(l);
+	e = turn(t, EV_RDLOCK);
+	rc = real_pthread_rwlock_rdlock(l);
+	done(t, EV_RDLOCK, rc, e);
+	return rc;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t* l)
+{
+	struct thr* t = self();
+	struct event* e;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_rwlock_tryrdlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_rdlock);
+	if(!t)
+		return real_pthread_rwlock_tryrdlock(l);
+	if((e = turn(t, EV_TRYRDLOCK))) {
+		rc = e->value ? (int)e->value : real_pthread_rwlock_rdlock(l);
+		advance();
+		return rc;
+	}
+	rc = real_pthread_rwlock_tryrdlock(l);
+	done(t, EV_TRYRDLOCK, rc, NULL);
+	return rc;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t* l)
+{
+	struct thr* t = self();
+	struct event* e;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_rwlock_wrlock);
+	if(!t)
+		return real_pthread_rwlock_wrlock(l);
+	e = turn(t, EV_WRLOCK);
+	rc = real_pthread_rwlock_wrlock(l);
+	done(t, EV_WRLOCK, rc, e);
+	return rc;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t* l)
+{
+	struct thr* t = self();
+	struct event* e;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_rwlock_trywrlock);
+	INTERPOSE_RESOLVE(pthread_rwlock_wrlock);
+	if(!t)
+		return real_pthread_rwlock_trywrlock(l);
+	if((e = turn(t, EV_TRYWRLOCK))) {
+		rc = e->value ? (int)e->value : real_pthread_rwlock_wrlock(l);
+		advance();
+		return rc;
+	}
+	rc = real_pthread_rwlock_trywrlock(l);
+	done(t, EV_TRYWRLOCK, rc, NULL);
+	return rc;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t* l)
+{
+	struct thr* t = self();
+
+	INTERPOSE_RESOLVE(pthread_rwlock_unlock);
+	if(t)
+		done(t, EV_RWUNLOCK, 0, turn(t, EV_RWUNLOCK));
+	return real_pthread_rwlock_unlock(l);
+}
+
+/* replay: the wait itself is the gap between the two turns */
+static int replay_wait(struct thr* t, pthread_mutex_t* m)
+{
+	struct event* e;
+
+	INTERPOSE_RESOLVE(pthread_mutex_lock);
+	INTERPOSE_RESOLVE(pthread_mutex_unlock);
+	real_pthread_mutex_unlock(m);
+	advance();
+	e = next_event(t, EV_WOKEN);
+	real_pthread_mutex_lock(m);
+	if(!e)
+		return 0;	/* a spurious wakeup */
+	advance();
+	return e->value;
+}
+
+int pthread_cond_wait(pthread_cond_t* c, pthread_mutex_t* m)
+{
+	struct thr* t = self();
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_cond_wait);
+	if(!t)
+		return real_pthread_cond_wait(c, m);
+	if(g_mode == M_REPLAY) {
+		if(next_event(t, EV_WAIT))
+			return replay_wait(t, m);
+		return real_pthread_cond_wait(c, m);
+	}
+	rec(t, EV_WAIT, 0);
+	rc = real_pthread_cond_wait(c, m);
+	rec(t, EV_WOKEN, rc);
+	return rc;
+}
+
+int pthread_cond_timedwait(pthread_cond_t* c, pthread_mutex_t* m,
+		const struct timespec* abstime)
+{
+	struct thr* t = self();
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_cond_timedwait);
+	if(!t)
+		return real_pthread_cond_timedwait(c, m, abstime);
+	if(g_mode == M_REPLAY) {
+		if(next_event(t, EV_WAIT))
+			return replay_wait(t, m);
+		return real_pthread_cond_timedwait(c, m, abstime);
+	}
+	rec(t, EV_WAIT, 0);
+	rc = real_pthread_cond_timedwait(c, m, abstime);
+	rec(t, EV_WOKEN, rc);
+	return rc;
+}
+
+int pthread_cond_signal(pthread_cond_t* c)
+{
+	struct thr* t = self();
+
+	INTERPOSE_RESOLVE(pthread_cond_signal);
+	if(t)
+		done(t, EV_SIGNAL, 0, turn(t, EV_SIGNAL));
+	return real_pthread_cond_signal(c);
+}
+
+int pthread_cond_broadcast(pthread_cond_t* c)
+{
+	struct thr* t = self();
+
+	INTERPOSE_RESOLVE(pthread_cond_broadcast);
+	if(t)
+		done(t, EV_BROADCAST, 0, turn(t, EV_BROADCAST));
+	return real_pthread_cond_broadcast(c);
+}
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+		void* (*start)(void*), void* arg)
+{
+	struct thr* t = self();
+	struct event* e = NULL;
+	struct start* s;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_create);
+	if(!t || !(s = malloc(sizeof(*s))))
+		return real_pthread_create(thread, attr, start, arg);
+	s->fn = start;
+	s->arg = arg;
+	s->id = -1;
+	if(g_mode == M_RECORD) {
+		s->id = __sync_fetch_and_add(&g_nthreads, 1);
+		rec(t, EV_CREATE, s->id);
+	} else if((e = turn(t, EV_CREATE)))
+		s->id = e->value;
+	rc = real_pthread_create(thread, attr, start_thread, s);
+	if(rc)
+		free(s);
+	if(e)
+		advance();
+	return rc;
+}
+
+int pthread_join(pthread_t thread, void** ret)
+{
+	struct thr* t = self();
+	struct event* e;
+	int rc;
+
+	INTERPOSE_RESOLVE(pthread_join);
+	if(!t)
+		return real_pthread_join(thread, ret);
+	e = turn(t, EV_JOIN);
+	rc = real_pthread_join(thread, ret);
+	done(t, EV_JOIN, rc, e);
+	return rc;
+}
+
+void srand(unsigned int seed)
+{
+	struct thr* t = self();
+	struct event* e;
+
+	INTERPOSE_RESOLVE(srand);
+	if(t) {
+		if((e = turn(t, EV_SRAND)))
+			seed = e->value;
+		done(t, EV_SRAND, seed, e);
+	}
+	real_srand(seed);
+}
+
+int rand(void)
+{
+	struct thr* t = self();
+	struct event* e;
+	int v;
+
+	INTERPOSE_RESOLVE(rand);
+	if(!t)
+		return real_rand();
+	e = turn(t, EV_RAND);
+	v = real_rand();
+	if(e)
+		v = e->value;
+	done(t, EV_RAND, v, e);
+	return v;
+}
+
+void srandom(unsigned int seed)
+{
+	struct thr* t = self();
+	struct event* e;
+
+	INTERPOSE_RESOLVE(srandom);
+	if(t) {
+		if((e = turn(t, EV_SRANDOM)))
+			seed = e->value;
+		done(t, EV_SRANDOM, seed, e);
+	}
+	real_srandom(seed);
+}
+
+long random(void)
+{
+	struct thr* t = self();
+	struct event* e;
+	long v;
+
+	INTERPOSE_RESOLVE(random);
+	if(!t)
+		return real_random();
+	e = turn(t, EV_RANDOM);
+	v = real_random();
+	if(e)
+		v = e->value;
+	done(t, EV_RANDOM, v, e);
+	return v;
+}